@@ -41,29 +41,143 @@
 #pragma once
 
 #include <stdint.h>
+#include <cstring>
+#include <initializer_list>
+#include <string_view>
+#include <type_traits>
+
+// On Linux, emitters find per-thread buffers through initial-exec thread_local (lop_custom_tls in
+// profiler.cpp). It has to fit in static TLS block, so build profiler.cpp into the executable or into
+// a shared object loaded at startup, dlopen of a shared object with it may fail.
+
+// All switches below can also be set from the command line of the compiler (e.g. -DLOP_SAFER=true),
+// which sets them for profiler.h, profiler.cpp and profiler_asm.cpp at once. For profiler_asm.asm
+// pass them to MASM as numbers (e.g. /DLOP_SAFER=1).
 
 // You can set this to "true" to enable what is called "safer" mode.
-// This mode will attempt to check for buffer exhaustion in the assembly and will try to
-// recover from such situation by disabling the profiler, doing necessary operations, and re-enabling it.
-// This mode is highly experimental and might not be tested enough.
+// This mode will check for buffer exhaustion in the assembly. Thread that fills its buffer swaps it
+// for one of its spare ones prepared in background, without taking any lock, and the full one is
+// flushed to disk asynchronously by a single background thread. Other threads are not affected.
 // Side effects:
-// - double memory usage due to double buffering used in recovery process
-// - during recovery process some events will be lost
+// - triple memory usage due to the two spare buffers of every thread
 // - tracing overhead might be increased by around 1 nanosecond / event
-// - the asynchronous flushing of events to disk might create many threads if you continue to
-//   emit events faster than they are flushed for long time
+// - thread that fills its buffer more times than it has spares before the background thread writes
+//   them out and refills its spares (polled every millisecond) drops the events of the full buffer,
+//   the number of dropped records is printed at flush
 // To enable, set this to true, and also find macros with same name
 // in the profiler_asm.cpp (Linux) or profiler_asm.asm (Windows) and also set them to true or 1.
 // You will find appropriate comment near them in their respective files.
+#ifndef LOP_SAFER
 #define LOP_SAFER false
+#endif
 
-// This is additional variation of mode explained above. When you enable "safer" mode above, on
-// top of that you can also enable lossless mode which will not loose events during the recovery.
-// As above, it requires support both in cpp and asm files so change both.
-// Side effects:
-// - much lower performance (like 16ns/event), because we are not stopping the profiler in that
-//   case, we need to do interlocked increments to the event buffers (due to hot swap done).
+// Used to select lossless variant of "safer" mode, which did interlocked increments on every event.
+// "Safer" mode is always lossless now at no extra cost, so this switch doesn't do anything anymore.
+#ifndef LOP_SAFER_LOSSLESS
 #define LOP_SAFER_LOSSLESS false
+#endif
+
+// You can set this to "true" to use compact 16-byte event records instead of 32-byte ones.
+// Simple events take 16 bytes and events with metadata (meta, counter, flow) take additional
+// 16-byte extension record, so the same buffer holds about 2x more events and tracing pollutes
+// caches of traced program much less.
+// Side effects:
+// - timestamps are truncated to 56 bits in memory (restored at flush, it wraps after months of uptime)
+// As with "safer" mode, it requires support both in cpp and asm files so change both.
+#ifndef LOP_COMPACT_EVENTS
+#define LOP_COMPACT_EVENTS false
+#endif
+
+// You can set this to "true" to enable "flight recorder" mode. Event tables become ring buffers
+// that keep only the last events of each thread, so the profiler can stay enabled all the time with
+// bounded memory usage, and you call profiler_snapshot() when something interesting happens.
+// Side effects:
+// - can't be used together with "safer" mode and compact events
+// - begin/end pairs cut by the window edge are dropped/left open in the trace
+// - snapshot needs a temporary copy of all event tables
+// As with "safer" mode, it requires support both in cpp and asm files so change both.
+#ifndef LOP_RING
+#define LOP_RING false
+#endif
+
+// You can set this to "true" to enable "streaming" mode, for traces of unbounded length. Event
+// tables become single-producer/single-consumer rings and background thread keeps on appending
+// events from them to a binary dump (see profiler_dump.h) every LOP_STREAM_INTERVAL_MS, so memory
+// stays bounded, nothing is lost and nothing stops the other threads. Thread that catches up with
+// the drain thread waits for it in the emitter.
+// Side effects:
+// - can't be used together with "safer" mode, ring mode and compact events
+// - output is always binary dump, opened at enable and finished by flush, use lop_convert on it
+// - threads emitting faster than the disk takes the events get slowed down to its pace
+// As with "safer" mode, it requires support both in cpp and asm files so change both.
+#ifndef LOP_STREAMING
+#define LOP_STREAMING false
+#endif
+
+// You can set this to "true" to enable "aggregation" mode. Begin and end events are not recorded,
+// instead every thread keeps per-name statistics of its scopes (call count, inclusive time, min,
+// max and log2-bucketed latency histogram) and flush merges them into events_*_summary.json.
+// Memory stays constant no matter how long you run. Other events are recorded as usual.
+// Side effects:
+// - begin/end pairs don't show up on the trace, metadata of begin/end meta events is ignored
+// - end event closes the latest open scope of its thread, whatever its name is (same as on trace)
+// - can't be used together with inline emitters
+// It requires support only in profiler.h and profiler.cpp, asm files stay as they are.
+#ifndef LOP_AGGREGATE
+#define LOP_AGGREGATE false
+#endif
+
+// You can set this to "true" to let the compiler inline event emission right into your code,
+// instead of calling into profiler.cpp and then asm for every event. Record layout, buffers and
+// output stay the same, see profiler_inline.h.
+// Side effects:
+// - profiler.h exposes the event layout and some internals (they are checked in profiler.cpp)
+// - can't be used together with compact events
+// - code size of every emission site grows
+// It requires support only in profiler.h and profiler.cpp, asm files stay as they are.
+#ifndef LOP_INLINE_EMITTERS
+#define LOP_INLINE_EMITTERS false
+#endif
+
+// You can set this to "true" on top of inline emitters to make disabled tracepoints almost free.
+// Every emission site starts with 5-byte NOP, registered in "lop_sites" section, and
+// profiler_enable()/profiler_disable() patch those NOPs into jumps to the emission code and back.
+// Side effects:
+// - Linux only (needs asm goto), on Windows the enabled flag is checked as usual
+// - only sites linked into the same binary as profiler.cpp are patched, others stay disabled
+// - enable/disable have to make code pages writable for a moment, it won't work under strict W^X
+#ifndef LOP_STATIC_KEYS
+#define LOP_STATIC_KEYS false
+#endif
+
+// You can set this to "true" to record CPU number (and NUMA node) with every event, read by rdtscp
+// together with the timestamp. Trace gets per-CPU tracks and migration markers on thread tracks,
+// and with LOP_TSC_SKEW=1 timestamps are corrected by TSC offset of their CPU.
+// Side effects:
+// - rdtscp waits for preceding instructions, so every emission costs a bit more (see lop_bench)
+// - can't be used together with compact events
+// As with "safer" mode, it requires support both in cpp and asm files so change both.
+#ifndef LOP_CPU_ID
+#define LOP_CPU_ID false
+#endif
+
+// Mask of event categories compiled into the program, bit N stands for category N (see
+// LOP_DEFINE_CATEGORY below). Categorized tracepoints of categories missing here don't generate
+// any code at all, so you can keep verbose tracing of some subsystem in the sources for free.
+// Unlike modes above, it's used only in your code and profiler.h, so change it just here.
+#ifndef LOP_COMPILED_CATEGORIES
+#define LOP_COMPILED_CATEGORIES 0xFFFFFFFFFFFFFFFFULL
+#endif
+
+#if LOP_INLINE_EMITTERS
+#include "profiler_inline.h"
+#endif
+
+// Categories enabled right now, bit N for category N. It's zero while the profiler is disabled,
+// so categorized tracepoints test only this one word.
+extern "C" {
+    extern volatile uint64_t lop_active_categories;
+}
 
 namespace LOP {
 
@@ -74,12 +188,30 @@ void profiler_disable();
 // You can use suffix to create multiple files in one process session.
 void profiler_flush(const char* suffix = nullptr);
 
+// Ring mode only (see LOP_RING). Copies last events of all threads and saves them to a file, while
+// the profiler keeps on running. Suffix works like in profiler_flush().
+void profiler_snapshot(const char* suffix = nullptr);
+
+// Size of event buffer of each thread, in bytes. Default is 128MB, or LOP_BUFFER_MB megabytes
+// if set in environment. It only applies to threads that didn't emit any event yet.
+void profiler_set_buffer_size(uint64_t bytes);
+
+// Same as above, but only for calling thread. Call it before first event on the thread.
+void profiler_set_thread_buffer_size(uint64_t bytes);
+
+// Runtime mask of categories that should be traced, bit N for category N. By default all categories
+// are traced, unless LOP_CATEGORIES is set in environment to comma separated list of category names.
+// Uncategorized events are not affected by the mask.
+void profiler_set_category_mask(uint64_t mask);
+
 // All events require a string that will be used as a name of the event and this is what
 // you will see on the trace. The pointer that you supply to the emit functions must be alive
 // at the point of profiler_flush() call. The profiler will not copy the string, it will just
 // store the pointer, because copying it around would kill the performance. So it is safest
-// to just use some static strings as in example.
+// to just use some static strings as in example. For names built at runtime, use *_dyn emitters below.
 
+// With LOP_INLINE_EMITTERS, emitters below are defined in profiler_inline.h.
+#if !LOP_INLINE_EMITTERS
 // Simple events.
 void emit_begin_event(const char* name);
 void emit_end_event(const char* name);
@@ -103,6 +235,71 @@ void emit_counter_event(const char* name, uint64_t count);
 // Check context_example.cpp/contextize.py for example usage.
 void emit_flow_start_event(const char* name, uint64_t flow_id);
 void emit_flow_finish_event(const char* name, uint64_t flow_id);
+#endif
+
+// Events with names built at runtime (request IDs, tensor names, ...), which don't have to stay alive
+// until profiler_flush(). Each thread copies a name into its own arena the first time it sees it and
+// finds the copy by hash afterwards, so only the hashing is paid on every event. Copies are kept until
+// the process ends, so don't feed it unbounded number of distinct names.
+const char* intern_event_name(std::string_view name);
+
+void emit_begin_event_dyn(std::string_view name);
+void emit_end_event_dyn(std::string_view name);
+void emit_immediate_event_dyn(std::string_view name);
+void emit_endbegin_event_dyn(std::string_view end_name, std::string_view begin_name);
+void emit_begin_meta_event_dyn(std::string_view name, uint64_t metadata);
+void emit_end_meta_event_dyn(std::string_view name, uint64_t metadata);
+void emit_immediate_meta_event_dyn(std::string_view name, uint64_t metadata);
+void emit_counter_event_dyn(std::string_view name, uint64_t count);
+void emit_flow_start_event_dyn(std::string_view name, uint64_t flow_id);
+void emit_flow_finish_event_dyn(std::string_view name, uint64_t flow_id);
+
+// Argument of events with arguments below, typed by its value: signed or unsigned integer, floating
+// point number, string or pointer. Argument names and const char* values are stored as pointers, same
+// as event names, std::string_view (and std::string) values are interned (see intern_event_name).
+struct EventArg {
+    enum Type : uint32_t {
+        INT,
+        UINT,
+        DOUBLE,
+        STRING,
+        POINTER,
+        STRING_VIEW, // Interned when the event is recorded, then stored as STRING.
+    };
+
+    const char* name;
+    uint64_t value;
+    uint64_t length = 0; // STRING_VIEW only.
+    Type type;
+
+    template <typename T, std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>, int> = 0>
+    EventArg(const char* name, T value) : name(name), value(static_cast<uint64_t>(static_cast<int64_t>(value))), type(INT) {}
+
+    template <typename T, std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T>, int> = 0>
+    EventArg(const char* name, T value) : name(name), value(value), type(UINT) {}
+
+    template <typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+    EventArg(const char* name, T value) : name(name), type(DOUBLE) {
+        double number = static_cast<double>(value);
+        memcpy(&this->value, &number, sizeof(number));
+    }
+
+    EventArg(const char* name, const char* value) : name(name), value(reinterpret_cast<uint64_t>(value)), type(STRING) {}
+
+    EventArg(const char* name, std::string_view value)
+        : name(name), value(reinterpret_cast<uint64_t>(value.data())), length(value.size()), type(STRING_VIEW) {}
+
+    EventArg(const char* name, const void* value) : name(name), value(reinterpret_cast<uint64_t>(value)), type(POINTER) {}
+};
+
+// Events with any number of typed arguments (up to LOP_MAX_EVENT_ARGS, the rest is dropped), e.g.
+//     LOP::emit_begin_args_event("request", { { "id", request_id }, { "ratio", 0.5 }, { "user", user_name } });
+// Arguments are written right after the event, in the same emit call, and show up as named "args" on
+// the trace. They are always emitted out of line, other events don't pay anything for them.
+#define LOP_MAX_EVENT_ARGS 6
+
+void emit_begin_args_event(const char* name, std::initializer_list<EventArg> args);
+void emit_immediate_args_event(const char* name, std::initializer_list<EventArg> args);
 
 // Scoped profiles. Automatically emit begin/end events when entering/leaving scope.
 class SimpleScopedProfile {
@@ -133,6 +330,20 @@ public:
     }
 };
 
+class ArgsScopedProfile {
+    const char* name;
+
+public:
+    ArgsScopedProfile(const char* name, std::initializer_list<EventArg> args) {
+        this->name = name;
+        emit_begin_args_event(this->name, args);
+    }
+
+    ~ArgsScopedProfile() {
+        emit_end_event(this->name);
+    }
+};
+
 // This macro will create a scoped profile with the name of the function.
 #if defined(_WIN32) || defined(_WIN64)
 #   define LOP_PROFILE_FUNC LOP::SimpleScopedProfile func_scope_profiler(__FUNCSIG__);
@@ -140,4 +351,159 @@ public:
 #   define LOP_PROFILE_FUNC LOP::SimpleScopedProfile func_scope_profiler(__PRETTY_FUNCTION__);
 #endif
 
+// Event categories. There can be up to 64 of them, each one is a bit index that you name with
+// LOP_DEFINE_CATEGORY(name, bit) at global scope of some header of yours, e.g.:
+//     LOP_DEFINE_CATEGORY(net, 3)
+//     void send() { LOP_PROFILE_FUNC_CAT(net); ... LOP_EMIT_CAT(net, emit_counter_event, "queue", depth); }
+// Category of an event is exported as "cat" field (categories in Perfetto). It's attached to event
+// names, registered once per tracepoint when it's hit for the first time, so name arguments of
+// categorized tracepoints shouldn't change between calls, and one name should stay in one category.
+#define LOP_MAX_CATEGORIES 64
+
+bool register_category(uint32_t category, const char* category_name);
+bool register_event_category(const char* name, uint32_t category);
+
+constexpr bool category_compiled(uint32_t category) {
+    return (LOP_COMPILED_CATEGORIES >> category) & 1;
+}
+
+inline bool category_active(uint32_t category) {
+    return lop_active_categories & (1ULL << category);
+}
+
+// Registers every name argument of categorized tracepoint, other arguments are skipped.
+template <typename... Args>
+inline bool register_event_arguments(uint32_t category, Args... args) {
+    auto register_argument = [category](auto argument) {
+        if constexpr (std::is_convertible_v<decltype(argument), const char*>) register_event_category(argument, category);
+    };
+    (register_argument(args), ...);
+    return true;
+}
+
+// Scoped profile of a category. Register is a lambda unique to the tracepoint, holding its
+// registration flag, see LOP_PROFILE_SCOPE_CAT.
+template <bool compiled>
+class CategoryScopedProfile {
+    const char* name = nullptr;
+
+public:
+    template <typename Register>
+    CategoryScopedProfile(uint32_t category, const char* name, Register register_site) {
+        if (category_active(category)) {
+            register_site(name);
+            this->name = name;
+            emit_begin_event(this->name);
+        }
+    }
+
+    ~CategoryScopedProfile() {
+        if (name) emit_end_event(name);
+    }
+};
+
+// Category not compiled in, nothing to do.
+template <>
+class CategoryScopedProfile<false> {
+public:
+    template <typename Register>
+    CategoryScopedProfile(uint32_t, const char*, Register) {}
+};
+
+// Sampled tracepoints, recording only every period-th call, e.g.:
+//     void on_packet() { LOP_PROFILE_FUNC_SAMPLED(64); ... LOP_EMIT_SAMPLED(16, emit_counter_event, "queue", depth); }
+// Each thread counts calls of every tracepoint on its own, so a skipped call costs one decrement and
+// a branch. Sampled scope is kept or dropped as a whole and its begin event carries the period as a
+// weight (exported as meta), which aggregation mode and percentile report use to scale counts
+// and totals back up.
+
+// Begin event of a sampled scope, weight is a number of calls the scope stands for. It is recorded
+// as its own event type, so only these begins are weighted, not meta begins that share the name.
+void emit_sampled_begin_event(const char* name, uint64_t weight);
+
+// Site is a lambda unique to the tracepoint, holding its per-thread countdown, see LOP_PROFILE_SCOPE_SAMPLED.
+class SampledScopedProfile {
+    const char* name = nullptr;
+
+public:
+    template <typename Site>
+    SampledScopedProfile(const char* name, uint32_t period, Site site) {
+        uint32_t& countdown = site();
+        if (countdown) {
+            countdown--;
+            return;
+        }
+        countdown = period ? period - 1 : 0;
+        this->name = name;
+        emit_sampled_begin_event(this->name, period ? period : 1);
+    }
+
+    ~SampledScopedProfile() {
+        if (name) emit_end_event(name);
+    }
+};
+
 }
+
+#define LOP_DEFINE_CATEGORY(category, bit)                                                                    \
+    namespace LOP { namespace categories {                                                                  \
+        static_assert((bit) < LOP_MAX_CATEGORIES, "Category must be bit index lower than LOP_MAX_CATEGORIES."); \
+        constexpr uint32_t category = (bit);                                                                \
+        inline const bool category##_registered = LOP::register_category(category, #category);              \
+    } }
+
+// Like LOP_PROFILE_FUNC and SimpleScopedProfile, but traced only when the category is enabled.
+#define LOP_PROFILE_SCOPE_CAT(category, name)                                                                 \
+    LOP::CategoryScopedProfile<LOP::category_compiled(LOP::categories::category)> category##_scope_profiler( \
+        LOP::categories::category, name, [](const char* site_name) {                                        \
+            [[maybe_unused]] static const bool registered =                                                 \
+                LOP::register_event_category(site_name, LOP::categories::category);                         \
+        });
+
+#if defined(_WIN32) || defined(_WIN64)
+#   define LOP_PROFILE_FUNC_CAT(category) LOP_PROFILE_SCOPE_CAT(category, __FUNCSIG__)
+#else
+#   define LOP_PROFILE_FUNC_CAT(category) LOP_PROFILE_SCOPE_CAT(category, __PRETTY_FUNCTION__)
+#endif
+
+// Calls any of the emit_* functions above, if the category is enabled, e.g.
+// LOP_EMIT_CAT(net, emit_flow_start_event, "packet", id).
+#define LOP_EMIT_CAT(category, emitter, ...)                                                                  \
+    do {                                                                                                    \
+        if constexpr (LOP::category_compiled(LOP::categories::category)) {                                  \
+            if (LOP::category_active(LOP::categories::category)) {                                          \
+                [[maybe_unused]] static const bool registered =                                             \
+                    LOP::register_event_arguments(LOP::categories::category, __VA_ARGS__);                  \
+                LOP::emitter(__VA_ARGS__);                                                                  \
+            }                                                                                               \
+        }                                                                                                   \
+    } while (0)
+
+
+// Like LOP_PROFILE_FUNC and SimpleScopedProfile, but traced once every period calls on each thread.
+#define LOP_PROFILE_SCOPE_SAMPLED(name, period)                                                               \
+    LOP::SampledScopedProfile sampled_scope_profiler(name, period, []() -> uint32_t& {                      \
+        static thread_local uint32_t countdown = 0;                                                         \
+        return countdown;                                                                                   \
+    });
+
+#if defined(_WIN32) || defined(_WIN64)
+#   define LOP_PROFILE_FUNC_SAMPLED(period) LOP_PROFILE_SCOPE_SAMPLED(__FUNCSIG__, period)
+#else
+#   define LOP_PROFILE_FUNC_SAMPLED(period) LOP_PROFILE_SCOPE_SAMPLED(__PRETTY_FUNCTION__, period)
+#endif
+
+// Calls any of the emit_* functions above once every period calls on each thread, e.g.
+// LOP_EMIT_SAMPLED(16, emit_counter_event, "queue", depth). Events are not weighted, and separate
+// begin and end events sampled this way don't stay paired, use sampled scopes for those.
+#define LOP_EMIT_SAMPLED(period, emitter, ...)                                                                \
+    do {                                                                                                    \
+        static thread_local uint32_t lop_sample_countdown = 0;                                              \
+        if (lop_sample_countdown) {                                                                         \
+            lop_sample_countdown--;                                                                         \
+        }                                                                                                   \
+        else {                                                                                              \
+            lop_sample_countdown = (period) ? (period) - 1 : 0;                                             \
+            LOP::emitter(__VA_ARGS__);                                                                      \
+        }                                                                                                   \
+    } while (0)
@@ -0,0 +1,295 @@
+/**
+ * Copyright (c) 2025 Krzysztof Badziak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+// Inline event emitters, used when LOP_INLINE_EMITTERS is enabled in profiler.h. Don't include
+// this file directly.
+//
+// Record write is done right in the caller, so compiler can schedule it together with the traced
+// code and there is no call, no spill and no TLS lookup through asm. Structures below mirror the
+// ones from profiler.cpp (which checks that they match). Thread's first event, exhaustion in "safer"
+// mode, wrap in ring mode and full table in streaming mode are still handled by the out-of-line emitters.
+
+#include <stdint.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+namespace LOP {
+struct CustomTLS;
+}
+
+extern "C" {
+    extern volatile bool lop_enabled;
+#if defined(_WIN32) || defined(_WIN64)
+    extern unsigned long lop_custom_tls_index;
+#else
+    // Initial-exec, so profiler.cpp can't be in a shared object loaded with dlopen, see profiler.cpp.
+    extern __thread LOP::CustomTLS* lop_custom_tls __attribute__((tls_model("initial-exec")));
+#endif
+}
+
+namespace LOP {
+namespace inline_emitters {
+
+enum event_type : uint32_t {
+    CALL_BEGIN,
+    CALL_END,
+    CALL_BEGIN_META,
+    CALL_END_META,
+    COUNTER_INT,
+    FLOW_START,
+    FLOW_FINISH,
+};
+
+// Set above the type of the first record of immediate and end-begin calls, see profiler_dump.h.
+constexpr uint32_t IMMEDIATE_CALL = 0x40;
+constexpr uint32_t ENDBEGIN_CALL = 0x80;
+
+struct Event {
+    uint64_t timestamp;
+    const char* name;
+    uint64_t metadata;
+    event_type type;
+    uint32_t tsc_aux;
+};
+
+struct EventBuffer {
+    Event* next_event;
+    Event* events;
+    void* spare_table;
+    uint64_t thread_id;
+    Event* events_end;
+};
+
+// Out-of-line emitters from profiler.cpp.
+void emit_begin_event(const char* name);
+void emit_end_event(const char* name);
+void emit_immediate_event(const char* name);
+void emit_endbegin_event(const char* end_name, const char* begin_name);
+void emit_begin_meta_event(const char* name, uint64_t metadata);
+void emit_end_meta_event(const char* name, uint64_t metadata);
+void emit_immediate_meta_event(const char* name, uint64_t metadata);
+void emit_counter_event(const char* name, uint64_t count);
+void emit_flow_start_event(const char* name, uint64_t flow_id);
+void emit_flow_finish_event(const char* name, uint64_t flow_id);
+
+#if LOP_STATIC_KEYS && !defined(_WIN32) && !defined(_WIN64)
+// Entry of "lop_sites" section, patched by profiler.cpp.
+struct PatchSite {
+    uint64_t site;
+    uint64_t target;
+};
+
+// Static key. Site is 5-byte NOP that profiler swaps for jump to "on" label (and back) while other
+// threads may run it, see patch_sites() in profiler.cpp. It's aligned so that it never spans cache
+// lines. Flag is still checked after the jump, because profiler_disable() clears it before the sites are patched back.
+inline bool enabled() {
+    __asm__ goto(
+        ".balign 8\n\t"
+        "1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+        ".pushsection lop_sites, \"aw\"\n\t"
+        ".balign 8\n\t"
+        ".quad 1b, %l[on]\n\t"
+        ".popsection\n\t"
+        : : : : on);
+    return false;
+on:
+    return lop_enabled;
+}
+#else
+inline bool enabled() {
+    return lop_enabled;
+}
+#endif
+
+// Reserves given number of records in the thread's table, or returns nullptr when out-of-line
+// emitter has to take care of this event.
+inline Event* reserve(uint64_t count) {
+#if defined(_WIN32) || defined(_WIN64)
+    // Same TEB slot that asm reads, see custom_tls_offset in profiler.cpp.
+    EventBuffer* buffer = reinterpret_cast<EventBuffer*>(__readgsqword(0x1480 + lop_custom_tls_index * sizeof(void*)));
+#else
+    EventBuffer* buffer = reinterpret_cast<EventBuffer*>(lop_custom_tls);
+#endif
+    if (!buffer) return nullptr;
+
+    Event* event = buffer->next_event;
+#if LOP_SAFER || LOP_RING || LOP_STREAMING
+    if (event >= buffer->events_end) return nullptr;
+#endif
+    buffer->next_event = event + count;
+    return event;
+}
+
+// Reads timestamp for given records, with LOP_CPU_ID also stores CPU number and NUMA node in them.
+inline uint64_t read_timestamp(Event* event, uint32_t count) {
+#if LOP_CPU_ID
+    unsigned int tsc_aux;
+    uint64_t timestamp = __rdtscp(&tsc_aux);
+    for (uint32_t i = 0; i < count; ++i) event[i].tsc_aux = tsc_aux;
+    return timestamp;
+#else
+    (void)event;
+    (void)count;
+    return __rdtsc();
+#endif
+}
+
+// Header (timestamp) must be written as the last thing, see event_written in profiler.cpp.
+inline void publish(Event* event, uint64_t timestamp) {
+#if defined(_WIN32) || defined(_WIN64)
+    _ReadWriteBarrier();
+    event->timestamp = timestamp;
+#else
+    __atomic_store_n(&event->timestamp, timestamp, __ATOMIC_RELEASE);
+#endif
+}
+
+// Flow markers are wrapped in tiny meta slice, the marker itself has no name.
+inline void emit_flow(event_type type, const char* name, uint64_t flow_id) {
+    Event* event = reserve(3);
+    if (!event) {
+        if (type == FLOW_START) emit_flow_start_event(name, flow_id);
+        else                    emit_flow_finish_event(name, flow_id);
+        return;
+    }
+    event[0].name = name;
+    event[0].type = CALL_BEGIN_META;
+    event[0].metadata = flow_id;
+    event[1].type = type;
+    event[1].metadata = flow_id;
+    event[2].name = name;
+    event[2].type = CALL_END_META;
+    event[2].metadata = flow_id;
+    uint64_t timestamp = read_timestamp(event, 3);
+    publish(&event[0], timestamp);
+    publish(&event[1], timestamp + 5);
+    publish(&event[2], timestamp + 10);
+}
+
+}
+
+// Record contents and timestamp offsets match the asm emitters from profiler_asm.cpp.
+
+inline void emit_begin_event(const char* name) {
+    if (!inline_emitters::enabled()) return;
+    inline_emitters::Event* event = inline_emitters::reserve(1);
+    if (!event) return inline_emitters::emit_begin_event(name);
+    event->name = name;
+    event->type = inline_emitters::CALL_BEGIN;
+    inline_emitters::publish(event, inline_emitters::read_timestamp(event, 1));
+}
+
+inline void emit_end_event(const char* name) {
+    if (!inline_emitters::enabled()) return;
+    inline_emitters::Event* event = inline_emitters::reserve(1);
+    if (!event) return inline_emitters::emit_end_event(name);
+    event->name = name;
+    event->type = inline_emitters::CALL_END;
+    inline_emitters::publish(event, inline_emitters::read_timestamp(event, 1));
+}
+
+inline void emit_immediate_event(const char* name) {
+    if (!inline_emitters::enabled()) return;
+    inline_emitters::Event* event = inline_emitters::reserve(2);
+    if (!event) return inline_emitters::emit_immediate_event(name);
+    event[0].name = name;
+    event[0].type = static_cast<inline_emitters::event_type>(inline_emitters::CALL_END | inline_emitters::IMMEDIATE_CALL);
+    event[1].name = name;
+    event[1].type = inline_emitters::CALL_BEGIN;
+    uint64_t timestamp = inline_emitters::read_timestamp(event, 2);
+    inline_emitters::publish(&event[0], timestamp);
+    inline_emitters::publish(&event[1], timestamp + 10);
+}
+
+inline void emit_endbegin_event(const char* end_name, const char* begin_name) {
+    if (!inline_emitters::enabled()) return;
+    inline_emitters::Event* event = inline_emitters::reserve(2);
+    if (!event) return inline_emitters::emit_endbegin_event(end_name, begin_name);
+    event[0].name = end_name;
+    event[0].type = static_cast<inline_emitters::event_type>(inline_emitters::CALL_END | inline_emitters::ENDBEGIN_CALL);
+    event[1].name = begin_name;
+    event[1].type = inline_emitters::CALL_BEGIN;
+    uint64_t timestamp = inline_emitters::read_timestamp(event, 2);
+    inline_emitters::publish(&event[0], timestamp);
+    inline_emitters::publish(&event[1], timestamp + 1);
+}
+
+inline void emit_begin_meta_event(const char* name, uint64_t metadata) {
+    if (!inline_emitters::enabled()) return;
+    inline_emitters::Event* event = inline_emitters::reserve(1);
+    if (!event) return inline_emitters::emit_begin_meta_event(name, metadata);
+    event->name = name;
+    event->type = inline_emitters::CALL_BEGIN_META;
+    event->metadata = metadata;
+    inline_emitters::publish(event, inline_emitters::read_timestamp(event, 1));
+}
+
+inline void emit_end_meta_event(const char* name, uint64_t metadata) {
+    if (!inline_emitters::enabled()) return;
+    inline_emitters::Event* event = inline_emitters::reserve(1);
+    if (!event) return inline_emitters::emit_end_meta_event(name, metadata);
+    event->name = name;
+    event->type = inline_emitters::CALL_END_META;
+    event->metadata = metadata;
+    inline_emitters::publish(event, inline_emitters::read_timestamp(event, 1));
+}
+
+inline void emit_immediate_meta_event(const char* name, uint64_t metadata) {
+    if (!inline_emitters::enabled()) return;
+    inline_emitters::Event* event = inline_emitters::reserve(2);
+    if (!event) return inline_emitters::emit_immediate_meta_event(name, metadata);
+    event[0].name = name;
+    event[0].type = static_cast<inline_emitters::event_type>(inline_emitters::CALL_END_META | inline_emitters::IMMEDIATE_CALL);
+    event[0].metadata = metadata;
+    event[1].name = name;
+    event[1].type = inline_emitters::CALL_BEGIN_META;
+    event[1].metadata = metadata;
+    uint64_t timestamp = inline_emitters::read_timestamp(event, 2);
+    inline_emitters::publish(&event[0], timestamp);
+    inline_emitters::publish(&event[1], timestamp + 10);
+}
+
+inline void emit_counter_event(const char* name, uint64_t count) {
+    if (!inline_emitters::enabled()) return;
+    inline_emitters::Event* event = inline_emitters::reserve(1);
+    if (!event) return inline_emitters::emit_counter_event(name, count);
+    event->name = name;
+    event->type = inline_emitters::COUNTER_INT;
+    event->metadata = count;
+    inline_emitters::publish(event, inline_emitters::read_timestamp(event, 1));
+}
+
+inline void emit_flow_start_event(const char* name, uint64_t flow_id) {
+    if (inline_emitters::enabled()) inline_emitters::emit_flow(inline_emitters::FLOW_START, name, flow_id);
+}
+
+inline void emit_flow_finish_event(const char* name, uint64_t flow_id) {
+    if (inline_emitters::enabled()) inline_emitters::emit_flow(inline_emitters::FLOW_FINISH, name, flow_id);
+}
+
+}
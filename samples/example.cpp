@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <thread>
 #include <chrono>
+#include <string>
 
 void some_sleeping_function()
 {   LOP_PROFILE_FUNC
@@ -55,6 +56,12 @@ int main()
         LOP::emit_end_event("loop iteration");
     }
 
+    // Names built at runtime can contain anything, quotes and backslashes are escaped in output.
+    std::string file_name = "C:\\data\\\"quoted\" input.txt";
+    LOP::emit_begin_event_dyn("loading " + file_name);
+    LOP::emit_counter_event_dyn("bytes of " + file_name, 1024);
+    LOP::emit_end_event_dyn("loading " + file_name);
+
     some_sleeping_function();
 
     LOP::emit_end_event("test part C");
@@ -43,31 +43,106 @@
 #include <mutex>
 #include <vector>
 #include <cstring>
+#include <cstdlib>
+#include <cstddef>
 #include <map>
+#include <memory>
 #include <climits>
 #include <stdint.h>
 #include <chrono>
 #include <ctime>
+#include <cmath>
 #include <algorithm>
+#include <array>
 #include <atomic>
-#include <queue>
 #include <string>
+#include <string_view>
+#include <unordered_set>
+#include <unordered_map>
+#include <charconv>
+#include <condition_variable>
 #include <inttypes.h>
+#include <fcntl.h>
 
 #include "profiler.h"
+#include "profiler_dump.h"
 
-#define CUSTOM_TLS_SIZE 0x10000
-#define LOP_BUFFER_SIZE 0x400000U
+// Default size of event table of each thread, in bytes. It can be changed at runtime with
+// LOP_BUFFER_MB environment variable or profiler_set_buffer_size() calls.
+#define LOP_DEFAULT_BUFFER_SIZE 0x8000000ULL
 
 #if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#include <intrin.h>
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
 # define compiler_barrier() _ReadWriteBarrier()
 # define get_process_id() _getpid()
+# define open_output_file(name) _open(name, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE)
+# define write_output_file(fd, data, size) _write(fd, data, static_cast<unsigned int>(size))
+# define close_output_file(fd) _close(fd)
+# define seek_output_file(fd, offset) _lseeki64(fd, offset, SEEK_SET)
+# define prefault_touch(address) _InterlockedExchangeAdd64(reinterpret_cast<volatile __int64*>(address), 0)
 #else
 #include <unistd.h>
+#include <errno.h>
+#include <cpuid.h>
+#include <sched.h>
+#include <x86intrin.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
 # define compiler_barrier() __asm__ __volatile__("" ::: "memory")
 # define get_process_id() getpid()
+# define open_output_file(name) open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+# define write_output_file(fd, data, size) write(fd, data, size)
+# define close_output_file(fd) close(fd)
+# define seek_output_file(fd, offset) lseek(fd, offset, SEEK_SET)
+# define prefault_touch(address) __atomic_fetch_add(reinterpret_cast<uint64_t*>(address), 0, __ATOMIC_RELAXED)
 #endif
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#if LOP_RING && (LOP_SAFER || LOP_COMPACT_EVENTS)
+#error "LOP_RING can't be combined with LOP_SAFER nor LOP_COMPACT_EVENTS."
+#endif
+
+#if LOP_STREAMING && (LOP_SAFER || LOP_RING || LOP_COMPACT_EVENTS)
+#error "LOP_STREAMING can't be combined with LOP_SAFER, LOP_RING nor LOP_COMPACT_EVENTS."
+#endif
+
+#if LOP_INLINE_EMITTERS && LOP_COMPACT_EVENTS
+#error "LOP_INLINE_EMITTERS can't be combined with LOP_COMPACT_EVENTS."
+#endif
+
+#if LOP_STATIC_KEYS && !LOP_INLINE_EMITTERS
+#error "LOP_STATIC_KEYS requires LOP_INLINE_EMITTERS."
+#endif
+
+#if LOP_CPU_ID && LOP_COMPACT_EVENTS
+#error "LOP_CPU_ID can't be combined with LOP_COMPACT_EVENTS."
+#endif
+
+#if LOP_AGGREGATE && LOP_INLINE_EMITTERS
+#error "LOP_AGGREGATE can't be combined with LOP_INLINE_EMITTERS."
+#endif
+
+#if LOP_STATIC_KEYS && !defined(_WIN32) && !defined(_WIN64)
+#define LOP_PATCH_SITES true
+#else
+#define LOP_PATCH_SITES false
+#endif
+
+// Crash dump writes names of events through this preallocated set, as it can't allocate anything.
+#define CRASH_DUMP_NAMES_SIZE 0x10000
+#define CRASH_DUMP_STAGING_SIZE 0x10000
+
+#define LOP_PAGE_SIZE 0x1000U
+#define LOP_HUGE_PAGE_SIZE 0x200000U
+
 #pragma warning(disable: 4996)
 
 namespace LOP {
@@ -80,28 +155,284 @@ enum event_type : uint32_t {
     COUNTER_INT,
     FLOW_START,
     FLOW_FINISH,
+    CALL_BEGIN_ARGS, // Followed by as many argument records as its metadata says.
+    ARG_INT,         // Argument records, name is argument name and metadata its value. Same order as EventArg::Type.
+    ARG_UINT,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+    CALL_BEGIN_SAMPLED, // Begin of sampled scope, metadata is its weight. Decoded as CALL_BEGIN_META.
 };
 
+inline bool is_argument_record(event_type type) {
+    return type >= ARG_INT && type <= ARG_POINTER;
+}
+
+#if LOP_COMPACT_EVENTS
+// Compact layout. Timestamp is shifted left by COMPACT_TYPE_BITS and shares the qword with the type.
+// Meta, counter and args events and argument records are followed by an extension record holding
+// the metadata in its first qword.
+// Flow markers don't have a name, so they keep the flow ID in the name slot and need no extension.
+#define COMPACT_TYPE_BITS 8
+#define COMPACT_TIMESTAMP_BITS (64 - COMPACT_TYPE_BITS)
+
+struct Event {
+    uint64_t timestamp_type;
+    const char* name;
+};
+#else
 struct Event {
     uint64_t timestamp;
     const char* name;
     uint64_t metadata;
     event_type type;
+    uint32_t tsc_aux; // CPU number and NUMA node with LOP_CPU_ID, padding otherwise.
+};
+#endif
+
+// Kinds of emit calls, each has its own overhead measured at startup, see calibrate_overhead.
+enum emit_kind : uint32_t {
+    EMIT_BEGIN,
+    EMIT_END,
+    EMIT_IMMEDIATE,
+    EMIT_ENDBEGIN,
+    EMIT_BEGIN_META,
+    EMIT_END_META,
+    EMIT_IMMEDIATE_META,
+    EMIT_COUNTER,
+    EMIT_FLOW_START,
+    EMIT_FLOW_FINISH,
+    EMIT_BEGIN_ARGS,
+    EMIT_IMMEDIATE_ARGS,
+    EMIT_BEGIN_SAMPLED,
+    EMIT_KIND_COUNT,
+};
+
+// Decoded event, independent of the in-memory layout. This is what exporters work on.
+struct EventRecord {
+    uint64_t timestamp;
+    const char* name;
+    uint64_t metadata;
+    event_type type;
+    uint32_t tsc_aux; // Zero without LOP_CPU_ID.
+    Event* args;      // Argument records of CALL_BEGIN_ARGS (metadata is their count), see decode_event_arg.
+    bool sampled;     // Begin of sampled scope, metadata is its weight.
+    uint32_t call_flags; // DUMP_EVENT_IMMEDIATE_CALL or DUMP_EVENT_ENDBEGIN_CALL, see profiler_dump.h.
+};
+
+// Decoded argument record.
+struct EventArgRecord {
+    const char* name;
+    uint64_t value;
+    event_type type;
+};
+
+inline uint32_t tsc_aux_cpu(uint32_t tsc_aux) {
+    return tsc_aux & ((1U << DUMP_TSC_AUX_CPU_BITS) - 1);
+}
+
+inline uint32_t tsc_aux_node(uint32_t tsc_aux) {
+    return tsc_aux >> DUMP_TSC_AUX_CPU_BITS;
+}
+
+// Maximum number of records written by single emit call, buffers are allocated with this many
+// additional records, so that an emit starting right before the end of the buffer can't overflow it.
+#define LOP_BUFFER_SLACK 16
+
+// "Safer" mode. Table prepared for the next exhaustion of a thread, or, once the thread swapped to
+// it, the same node carries the exhausted table to the scheduler thread, see swap_exhausted_table.
+// Every thread keeps up to LOP_SPARE_TABLES of them, so that it survives a few exhaustions in a row
+// before the scheduler thread writes the full tables out and refills its spares.
+#define LOP_SPARE_TABLES 2
+
+struct SpareTable {
+    Event* events;
+    Event* next_event;
+    uint64_t thread_id;
+    uint64_t capacity;
+    SpareTable* next;
+};
+
+// Aggregation mode. Per-thread statistics of scopes, keyed by name pointer in open addressing table
+// of LOP_AGGREGATE_NAMES entries (power of two). Histogram bucket N counts durations of [2^N, 2^(N+1))
+// ticks. Scopes nested deeper than LOP_AGGREGATE_DEPTH and names that don't fit are dropped.
+#define LOP_AGGREGATE_NAMES 1024
+#define LOP_AGGREGATE_DEPTH 256
+#define LOP_AGGREGATE_BUCKETS 64
+
+struct AggregateEntry {
+    const char* name;
+    uint64_t count;          // Counts and totals include weights of sampled scopes.
+    uint64_t total_ticks;
+    uint64_t min_ticks;
+    uint64_t max_ticks;
+    uint64_t histogram[LOP_AGGREGATE_BUCKETS];
+};
+
+struct AggregateTable {
+    struct OpenScope {
+        const char* name;
+        uint64_t tsc;
+        uint64_t weight; // Calls the scope stands for, above 1 for sampled scopes.
+    };
+
+    AggregateEntry entries[LOP_AGGREGATE_NAMES];
+    OpenScope scopes[LOP_AGGREGATE_DEPTH];
+    uint64_t depth;          // Can be above LOP_AGGREGATE_DEPTH, scopes past it aren't stored.
+    uint64_t unmatched_ends; // End events without open scope.
+    uint64_t dropped;        // Scopes too deep or with names that didn't fit.
+};
+
+// Copies of dynamic event names of one thread, see intern_event_name. Strings are bump-allocated
+// from blocks that are freed only with the buffer, so pointers stored in events stay valid through
+// any flush, and deduplicated through open-addressing table (power of two, at most half full).
+// Only the owning thread touches it, so there is no locking.
+#define LOP_NAME_BLOCK_SIZE (64 * 1024)
+#define LOP_NAME_TABLE_MIN 256
+
+struct NameArena {
+    struct Slot {
+        uint64_t hash;
+        const char* name; // Null for empty slot.
+        uint64_t length;
+    };
+
+    std::vector<char*> blocks;
+    char* block_next = nullptr;
+    char* block_end = nullptr;
+    std::vector<Slot> slots;
+    uint64_t names_count = 0;
+
+    ~NameArena() {
+        for (char* block : blocks) std::free(block);
+    }
+
+    const char* intern(std::string_view name);
 };
 
 struct EventBuffer {
     Event* next_event; // Must be first field!!! For simplicty, because its accessed
                        // in critical part of asm and I don't want extra offsets there.
     Event* events;
-    Event* events_backup;
+    std::atomic<SpareTable*> spare_table{ nullptr }; // "Safer" mode, stack of spares, see swap_exhausted_table.
     uint64_t thread_id = 0;
+    Event* events_end; // Exhaustion check in asm compares next_event against this.
+    Event* wrap_end = nullptr;   // Ring and streaming mode, where the previous lap ended.
+    uint64_t wrap_sequence = 0; // Ring and streaming mode, incremented before and after each wrap.
+    uint64_t capacity; // In records.
+
+    // Streaming mode, written only by the drain thread. Records before drain_event (in lap drain_laps)
+    // are in the stream already and zeroed, so the owning thread can write there again.
+    Event* drain_event = nullptr;
+    uint64_t drain_laps = 0;
+
+    // Touched only by prefault thread, under buffers_mutex.
+    Event* prefaulted_table = nullptr;
+    Event* prefaulted_end = nullptr;
+
+    // "Safer" mode. Incremented by the scheduler before it pushes a spare, decremented by the owning
+    // thread after it pops one, so it never drops below the number of spares on the stack.
+    std::atomic<uint32_t> spare_count{ 0 };
+
+    AggregateTable* aggregate = nullptr; // Aggregation mode, allocated with the first scope of the thread.
+    NameArena* names = nullptr; // Allocated with the first dynamic name of the thread.
+    bool registered = false; // Seen by flush, prefault thread and crash dump.
 
     EventBuffer();
+    explicit EventBuffer(uint64_t table_capacity); // Not registered, see calibrate_overhead.
     ~EventBuffer();
 };
 
 struct CustomTLS {
     EventBuffer event_buffer;
+
+    CustomTLS() = default;
+    explicit CustomTLS(uint64_t detached_capacity) : event_buffer(detached_capacity) {}
+};
+
+// TSC paired with steady clock reading taken at the same moment, see record_clock_sync.
+struct ClockSync {
+    uint64_t tsc;
+    int64_t time_ns;
+};
+
+// Sync points are kept in fixed table, so that crash handler can dump them.
+#define LOP_MAX_CLOCK_SYNCS 4096
+
+// When frequency isn't reported, flush waits until it's measured over at least this long. Sync points
+// closer to each other than that are too noisy to interpolate between, so mapping skips them.
+#define LOP_TSC_MIN_MEASUREMENT_NS 50000000LL
+
+// Converts ticks into nanoseconds since the first event of the trace, interpolating steady clock
+// between the nearest sync points and extrapolating with the closest segment outside of them.
+// Without two usable sync points it falls back to the single frequency. Timestamps taken on CPUs
+// with known TSC offset are moved to the timeline of the reference CPU first.
+struct ClockMapping {
+    std::vector<ClockSync> points;
+    std::vector<double> ns_per_tick; // Of segment that starts at given point.
+    std::vector<int64_t> cpu_offsets;
+    int64_t time_base_ns;
+
+    ClockMapping(const ClockSync* syncs, uint32_t count, double ticks_per_ns_ratio, uint64_t tsc_base) {
+        std::vector<ClockSync> sorted(syncs, syncs + count);
+        std::sort(sorted.begin(), sorted.end(), [](const ClockSync& a, const ClockSync& b) { return a.tsc < b.tsc; });
+        for (const ClockSync& sync : sorted) {
+            if (points.empty() || (sync.tsc > points.back().tsc && sync.time_ns - points.back().time_ns >= LOP_TSC_MIN_MEASUREMENT_NS)) {
+                points.push_back(sync);
+            }
+        }
+        if (points.empty()) points.push_back({ tsc_base, 0 });
+
+        for (size_t i = 0; i + 1 < points.size(); ++i) {
+            ns_per_tick.push_back(static_cast<double>(points[i + 1].time_ns - points[i].time_ns) / static_cast<double>(points[i + 1].tsc - points[i].tsc));
+        }
+        ns_per_tick.push_back(ns_per_tick.empty() ? 1.0 / ticks_per_ns_ratio : ns_per_tick.back());
+
+        size_t segment = 0;
+        time_base_ns = 0;
+        time_base_ns = static_cast<int64_t>(time_ns(tsc_base, segment));
+    }
+
+    // Events of single thread come in order, so segment of the previous one is checked first.
+    uint64_t time_ns(uint64_t tsc, size_t& segment, uint32_t cpu = 0) const {
+        if (cpu < cpu_offsets.size()) tsc -= cpu_offsets[cpu];
+        bool in_segment = (segment < points.size()) && (tsc >= points[segment].tsc) &&
+                          (segment + 1 == points.size() || tsc < points[segment + 1].tsc);
+        if (!in_segment) {
+            auto next = std::upper_bound(points.begin(), points.end(), tsc, [](uint64_t value, const ClockSync& sync) { return value < sync.tsc; });
+            segment = (next == points.begin()) ? 0 : (next - points.begin()) - 1;
+        }
+        int64_t ticks = static_cast<int64_t>(tsc - points[segment].tsc);
+        int64_t time = points[segment].time_ns + static_cast<int64_t>(static_cast<double>(ticks) * ns_per_tick[segment]);
+        return static_cast<uint64_t>(std::max<int64_t>(time - time_base_ns, 0));
+    }
+
+    // For durations known only as tick counts, like aggregated ones. They can span any part of the run,
+    // so the average rate between the first and the last sync point is used.
+    uint64_t duration_ns(uint64_t ticks) const {
+        double rate = (points.size() > 1) ? static_cast<double>(points.back().time_ns - points.front().time_ns) /
+                                            static_cast<double>(points.back().tsc - points.front().tsc)
+                                          : ns_per_tick.back();
+        return static_cast<uint64_t>(static_cast<double>(ticks) * rate);
+    }
+};
+
+enum output_format : uint32_t {
+    OUTPUT_JSON,
+    OUTPUT_BINARY,
+    OUTPUT_PERFETTO,
+};
+
+enum hugepages_mode : uint32_t {
+    HUGEPAGES_NONE,
+    HUGEPAGES_TRANSPARENT,
+    HUGEPAGES_EXPLICIT,
+};
+
+enum prefault_mode : uint32_t {
+    PREFAULT_NONE,
+    PREFAULT_EAGER,
+    PREFAULT_WINDOW,
 };
 
 struct ProfilerEngine {
@@ -110,6 +441,7 @@ struct ProfilerEngine {
         Event* next_event;
         Event* events;
         uint64_t thread_id = 0;
+        uint64_t capacity = 0;
     };
 
     ProfilerEngine();
@@ -117,360 +449,3330 @@ struct ProfilerEngine {
 
     void add_event_buffer(EventBuffer* event_buffer);
     void remove_event_buffer(EventBuffer* event_buffer);
-    void handle_exhausted_buffers(EventBuffer* signalling_event_buffer);
+    CustomTLS* acquire_custom_tls();
+    void retire_custom_tls(CustomTLS* custom_tls_entry);
+    void swap_exhausted_table(EventBuffer* event_buffer);
+    void refill_spare_tables();
+    void write_exhausted_tables(const std::vector<SpareTable*>& tables, uint64_t exhaustion_id);
 
     static void scheduler_loop();
+    static void prefault_loop();
+    static void clock_sync_loop();
+
+#if LOP_STREAMING
+    static void stream_loop();
+    void wait_for_stream_space(EventBuffer* event_buffer);
+    void open_stream();
+    void drain_streams();
+    uint64_t drain_stream_buffer(EventBuffer* event_buffer);
+    uint64_t append_stream_range(EventBuffer* event_buffer, Event* begin, Event* end);
+    void append_stream_clock_syncs();
+    void close_stream();
+#endif
 
     void enable();
     void disable();
     void flush(const char* suffix = nullptr);
-    void flush_buffers(const char* suffix, const std::vector<BufferState>& buffers);
+    void snapshot(const char* suffix = nullptr);
+    void flush_buffers(const char* suffix, const std::vector<BufferState>& recorded_buffers);
+    void write_json_trace(const char* file_name, const std::vector<BufferState>& buffers);
+    void write_perfetto_trace(const char* file_name, const std::vector<BufferState>& buffers);
+    void write_binary_trace(const char* file_name, const std::vector<BufferState>& buffers,
+                            uint64_t tsc_disable, std::chrono::system_clock::time_point time_disable);
+    void write_aggregate_summary(const char* suffix);
+    void write_percentile_report(const char* file_name, const std::vector<BufferState>& buffers);
+
+    void refine_tsc_frequency();
+    void record_clock_sync();
+    void measure_tsc_skew();
+    ClockMapping clock_mapping(uint64_t tsc_base);
+    void calibrate_overhead();
+    std::vector<BufferState> compensate_overhead(const std::vector<BufferState>& buffers, std::vector<std::unique_ptr<Event[]>>& tables);
 
-    CustomTLS** custom_tls; // Must be first field!!! For simplicty, because its accessed
-                            // in critical part of asm and I don't want extra offsets there.
-    bool enabled;
+    void install_crash_handler();
+    static void crash_signal_handler(int signal_number);
+    void write_crash_dump();
+
+    uint64_t custom_tls_offset; // Must be first field!!! For simplicty, because its accessed
+                                // in critical part of asm and I don't want extra offsets there.
+                                // Windows only, offset of our TLS slot in TEB.
     bool flushed;
     bool running;
 
+    output_format format;
+    uint64_t snapshot_count;
+    hugepages_mode hugepages;
+    prefault_mode prefault;
+    uint64_t prefault_window; // In records.
+    std::atomic<uint64_t> buffer_capacity; // In records, for threads that will start emitting from now on.
+
     uint64_t tsc_enable;
 
     double ticks_per_ns_ratio;
+    bool tsc_frequency_reported; // By CPU, hypervisor or kernel, otherwise measured since startup.
+    uint64_t tsc_startup;
+    int64_t time_startup_ns;     // Steady clock matching tsc_startup.
+
+    // Sync points taken at startup, enable, flush and periodically by background thread, every
+    // LOP_CLOCK_SYNC_MS. Exporters interpolate between them, see ClockMapping.
+    ClockSync clock_syncs[LOP_MAX_CLOCK_SYNCS];
+    std::atomic<uint32_t> clock_sync_count;
+    uint64_t clock_sync_interval_ms;
+    std::mutex clock_sync_mutex;
+    std::condition_variable clock_sync_cv;
+    bool clock_sync_run;
+    std::thread clock_sync_thread;
+
+    bool tsc_skew_measurement;
+    std::vector<int64_t> cpu_tsc_offsets; // In ticks, TSC of given CPU minus TSC of the reference one.
+
+    double emit_overhead[EMIT_KIND_COUNT]; // In ticks, see calibrate_overhead.
+    bool overhead_compensation;
+    bool percentile_report; // Written next to every trace, see write_percentile_report.
 
     std::mutex buffers_mutex;
-    std::mutex exhaustion_mutex;
     std::mutex control_mutex;
-    std::atomic<uint64_t> active_exhaustion_count;
+    std::atomic<uint64_t> active_exhaustion_count; // Exhausted tables not written yet.
+    std::atomic<uint64_t> dropped_records; // Records of threads that had no spare table, reported at flush.
 
+    // "Safer" mode. Exhausted thread takes no lock and makes no syscall. It pops a spare from its own
+    // stack (only the scheduler pushes there) and pushes the full table onto exhausted_tables stack, both
+    // with CAS, or drops its records if it has no spare. Scheduler thread polls every 1 ms while enabled.
+    // It tops up the spares of all threads under buffers_mutex, then takes the whole exhausted stack
+    // and writes the tables by itself, so there is only one writer and it's joined at exit. Written tables
+    // are cleared and kept in spare_tables, touched only by the scheduler, for the next refills. While
+    // profiler is disabled, scheduler waits on scheduler_cv instead of polling.
     bool scheduler_run;
     std::thread scheduler_thread;
-    std::queue<std::vector<BufferState>> scheduler_queue;
-    std::mutex scheduler_queue_mutex;
+    std::mutex scheduler_mutex;
+    std::condition_variable scheduler_cv;
+    std::atomic<SpareTable*> exhausted_tables;
+    std::vector<SpareTable*> spare_tables;
+
+    bool prefault_run;
+    std::thread prefault_thread;
+
+#if LOP_STREAMING
+    // Stream file is opened at enable and finished at flush, drain thread appends to it meanwhile.
+    // Everything below is under stream_mutex, which is taken before buffers_mutex.
+    std::mutex stream_mutex;
+    std::condition_variable stream_cv;
+    std::atomic<bool> stream_wakeup; // Set by threads waiting for space.
+    bool stream_run;
+    std::thread stream_thread;
+    uint64_t stream_interval_ms;
+    int stream_fd;
+    bool stream_success;
+    uint64_t stream_count;
+    uint64_t stream_records;
+    std::atomic<uint64_t> stream_waits;
+    uint64_t stream_sync_tsc; // Of the newest sync point in the stream.
+    DumpHeader stream_header;
+    char stream_name[64];
+    std::unordered_set<const char*> stream_names;
+    std::vector<char> stream_staging;
+#endif
 
     std::list<EventBuffer*> event_buffers;
+    std::list<CustomTLS*> retired_buffers; // Of exited threads, waiting for flush.
+    std::vector<CustomTLS*> free_buffers;  // Flushed, ready to be taken by new threads.
     std::chrono::system_clock::time_point time_enable;
+
+    bool thread_exit_tracking;
+#if defined(_WIN32) || defined(_WIN64)
+    DWORD thread_exit_key;
+#else
+    pthread_key_t thread_exit_key;
+#endif
+
+    // Everything crash handler needs is prepared up front, see install_crash_handler.
+    int crash_dump_fd;
+    std::atomic<bool> crash_dump_written;
+    char crash_dump_name[64];
+    const char** crash_dump_names;
+    char* crash_dump_staging;
 };
 
 inline ProfilerEngine g_lop_inst;
 
+// Not a member of ProfilerEngine, so that inline emitters from profiler_inline.h can read it.
 extern "C" {
-    // For windows, these are implemented in profiler_asm.asm (via MASM/ml64.exe).
-    // For linux, these are implemented in profiler_asm.cpp (via inline assembly).
-    uint64_t _asm_fast_rdtsc();
-    uint64_t _asm_get_tid();
+    volatile bool lop_enabled = false;
+}
 
-    // Default event emitters.
-    void _asm_emit_begin_event(ProfilerEngine*, const char*);
-    void _asm_emit_end_event(ProfilerEngine*, const char*);
-    void _asm_emit_endbegin_event(ProfilerEngine*, const char*, const char*);
-    void _asm_emit_immediate_event(ProfilerEngine*, const char*);
+// Custom TLS of calling thread, read directly by MacroTLSCheck from the asm files and by inline
+// emitters from profiler_inline.h. On Linux it's initial-exec thread_local, so it's a single fs-relative load (linker removes the GOT load in
+// executables). Initial-exec needs the variable in static TLS block, so shared object built with this file
+// can fail to dlopen ("cannot allocate memory in static TLS block"), link it in or load it at startup instead.
+// On Windows it's TlsAlloc slot, read from TEB at custom_tls_offset.
+#if defined(_WIN32) || defined(_WIN64)
+extern "C" {
+    DWORD lop_custom_tls_index = TLS_OUT_OF_INDEXES;
+}
+#define TEB_TLS_SLOTS_OFFSET 0x1480
+#define TEB_TLS_SLOTS_COUNT 64
 
-    void _asm_emit_begin_meta_event(ProfilerEngine*, const char*, uint64_t);
-    void _asm_emit_end_meta_event(ProfilerEngine*, const char*, uint64_t);
-    void _asm_emit_counter_event(ProfilerEngine*, const char*, uint64_t);
-    void _asm_emit_immediate_meta_event(ProfilerEngine*, const char*, uint64_t);
+static void set_thread_custom_tls(CustomTLS* custom_tls_entry) {
+    TlsSetValue(lop_custom_tls_index, custom_tls_entry);
+}
+static CustomTLS* get_thread_custom_tls() {
+    return static_cast<CustomTLS*>(TlsGetValue(lop_custom_tls_index));
+}
+#else
+extern "C" {
+    __thread CustomTLS* lop_custom_tls __attribute__((tls_model("initial-exec"))) = nullptr;
+}
 
-    void _asm_emit_flow_start_event(ProfilerEngine*, const char*, uint64_t);
-    void _asm_emit_flow_finish_event(ProfilerEngine*, const char*, uint64_t);
+static void set_thread_custom_tls(CustomTLS* custom_tls_entry) {
+    lop_custom_tls = custom_tls_entry;
+}
+static CustomTLS* get_thread_custom_tls() {
+    return lop_custom_tls;
+}
+#endif
 
-    CustomTLS* allocate_custom_tls() {
-        return new CustomTLS;
+extern "C" {
+    volatile uint64_t lop_active_categories = 0;
+}
+
+// Names of categories and categories of event names. Categories are registered from static
+// initializers of the traced program, possibly before g_lop_inst is constructed, so it lives in
+// a function-local static (ProfilerEngine constructor touches it, so it outlives g_lop_inst).
+struct CategoryRegistry {
+    std::mutex mutex;
+    const char* category_names[LOP_MAX_CATEGORIES] = {};
+    std::unordered_map<const char*, uint32_t> event_categories;
+    std::vector<std::string> filter; // Names from LOP_CATEGORIES, they enable categories as they get registered.
+    uint64_t mask = ~0ULL;
+    bool active = false; // Mirrors lop_enabled, under mutex.
+
+    CategoryRegistry() {
+        char* categories_string = std::getenv("LOP_CATEGORIES");
+        if (categories_string) {
+            std::string categories(categories_string);
+            for (size_t begin = 0; begin <= categories.size();) {
+                size_t end = std::min(categories.find(',', begin), categories.size());
+                if (end > begin) filter.push_back(categories.substr(begin, end - begin));
+                begin = end + 1;
+            }
+            mask = 0;
+        }
     }
 
-    void exhaustion_handler(EventBuffer* signalling_event_buffer) {
-        g_lop_inst.handle_exhausted_buffers(signalling_event_buffer);
+    // Call under mutex.
+    void publish() {
+        lop_active_categories = active ? mask : 0;
     }
 };
 
-void profiler_enable() {
-    g_lop_inst.enable();
+static CategoryRegistry& category_registry() {
+    static CategoryRegistry registry;
+    return registry;
 }
-void profiler_disable() {
-    g_lop_inst.disable();
+
+// Category names for event names seen in the trace, exporters take a copy so they can look them up without locking.
+using EventCategories = std::unordered_map<const char*, const char*>;
+
+static EventCategories snapshot_event_categories() {
+    CategoryRegistry& registry = category_registry();
+    const std::lock_guard<std::mutex> lock(registry.mutex);
+    EventCategories categories;
+    for (const auto& [name, category] : registry.event_categories) {
+        if (registry.category_names[category]) categories.insert({ name, registry.category_names[category] });
+    }
+    return categories;
 }
-void profiler_flush(const char* suffix) {
-    g_lop_inst.flush(suffix);
+
+static const char* find_event_category(const EventCategories& categories, const char* name) {
+    if (categories.empty()) return nullptr;
+    auto category = categories.find(name);
+    return (category != categories.end()) ? category->second : nullptr;
 }
 
-ProfilerEngine::ProfilerEngine()
-:   custom_tls(new CustomTLS* [CUSTOM_TLS_SIZE]),
-    enabled(false),
-    flushed(true),
-    running(false),
-    tsc_enable(0),
-    ticks_per_ns_ratio(0.0),
-    buffers_mutex(),
-    exhaustion_mutex(),
-    control_mutex(),
-    active_exhaustion_count(0),
-#if LOP_SAFER
-    scheduler_run(true),
-#else
-    scheduler_run(false),
+#if LOP_COMPACT_EVENTS
+// Restores bits truncated by compact layout, assuming the timestamp is no further than
+// half of the 56-bit range (months) from the reference one.
+inline uint64_t expand_compact_timestamp(uint64_t truncated, uint64_t reference) {
+    const uint64_t range = 1ULL << COMPACT_TIMESTAMP_BITS;
+    uint64_t timestamp = (reference & ~(range - 1)) | truncated;
+    if (timestamp > reference && timestamp - reference > range / 2) timestamp -= range;
+    else if (timestamp < reference && reference - timestamp > range / 2) timestamp += range;
+    return timestamp;
+}
 #endif
-    scheduler_thread(scheduler_loop),
-    scheduler_queue(),
-    scheduler_queue_mutex(),
-    event_buffers(),
-    time_enable()
-{
-    char* disable_string = std::getenv("LOP_DISABLE");
-    if (!disable_string || !static_cast<uint32_t>(std::stoi(disable_string))) {
-        // Kinda hacky way of estimating frequency. Result is overriden later at flush if
-        // run is longer than a 1 second because we gather similar statistics for whole run
-        // as well and the longer time we average over, the better accuracy we have.
-        auto chrono_start = std::chrono::system_clock::now();
-        uint64_t start_tsc = _asm_fast_rdtsc();
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
-        uint64_t stop_tsc = _asm_fast_rdtsc();
-        auto chrono_end = std::chrono::system_clock::now();
-
-        double unix_time_diff_ns = static_cast<double>(
-            std::chrono::duration_cast<std::chrono::nanoseconds>(chrono_end.time_since_epoch()).count() -
-            std::chrono::duration_cast<std::chrono::nanoseconds>(chrono_start.time_since_epoch()).count()
-        );
-
-        double tsc_ticks = static_cast<double>(stop_tsc - start_tsc);
-        ticks_per_ns_ratio = tsc_ticks / unix_time_diff_ns;
-        printf("Estimated TSC freq: %f GHz\n", ticks_per_ns_ratio);
-        printf("                    %f ticks per nanosecond\n", ticks_per_ns_ratio);
 
-        memset(custom_tls, 0, sizeof(CustomTLS*)*CUSTOM_TLS_SIZE);
+// Decodes event at given position and returns position of the next one.
+// Argument records of events with arguments are skipped, they are available through record.args.
+// Argument record found on its own (its event was cut off in ring mode) is returned as it is.
+// Begin of sampled scope is returned as meta begin, with sampled flag set. Call flags are returned
+// separately from the type.
+inline Event* decode_event(Event* position, EventRecord& record) {
+    record.args = nullptr;
+#if LOP_COMPACT_EVENTS
+    record.type = static_cast<event_type>(position->timestamp_type & DUMP_EVENT_TYPE_MASK);
+    record.call_flags = static_cast<uint32_t>(position->timestamp_type & ((1U << COMPACT_TYPE_BITS) - 1) & ~DUMP_EVENT_TYPE_MASK);
+    record.timestamp = expand_compact_timestamp(position->timestamp_type >> COMPACT_TYPE_BITS, g_lop_inst.tsc_enable);
+    record.name = position->name;
+    record.metadata = 0;
+    record.tsc_aux = 0;
+    record.sampled = (record.type == CALL_BEGIN_SAMPLED);
+    if (record.sampled) record.type = CALL_BEGIN_META;
 
-        running = true;
+    if (record.type == FLOW_START || record.type == FLOW_FINISH) {
+        record.name = nullptr;
+        record.metadata = reinterpret_cast<uint64_t>(position->name);
+    }
+    else if (record.type == CALL_BEGIN_ARGS) {
+        record.metadata = std::min<uint64_t>(position[1].timestamp_type, LOP_MAX_EVENT_ARGS);
+        record.args = position + 2;
+        return record.args + 2 * record.metadata;
+    }
+    else if (record.type == CALL_BEGIN_META || record.type == CALL_END_META || record.type == COUNTER_INT || is_argument_record(record.type)) {
+        record.metadata = position[1].timestamp_type;
+        return position + 2;
+    }
+    return position + 1;
+#else
+    record.timestamp = position->timestamp;
+    record.name = position->name;
+    record.metadata = position->metadata;
+    record.type = static_cast<event_type>(position->type & DUMP_EVENT_TYPE_MASK);
+    record.call_flags = position->type & ~DUMP_EVENT_TYPE_MASK;
+    record.tsc_aux = LOP_CPU_ID ? position->tsc_aux : 0;
+    record.sampled = (record.type == CALL_BEGIN_SAMPLED);
+    if (record.sampled) record.type = CALL_BEGIN_META;
+    if (record.type == CALL_BEGIN_ARGS) {
+        record.metadata = std::min<uint64_t>(record.metadata, LOP_MAX_EVENT_ARGS);
+        record.args = position + 1;
+        return record.args + record.metadata;
     }
+    return position + 1;
+#endif
 }
 
-void ProfilerEngine::enable() {
-    const std::lock_guard<std::mutex> lock(control_mutex);
-    if (running && !enabled) {
-        flushed = false;
-        enabled = true;
-        
-        // Generate special event so that we can track on the trace at what point of UNIX time it was enabled.
-        emit_begin_event("lop_engine_enable");
-        time_enable = std::chrono::system_clock::now();
-        tsc_enable = _asm_fast_rdtsc();
-        emit_end_meta_event("lop_engine_enable", std::chrono::duration_cast<std::chrono::nanoseconds>(time_enable.time_since_epoch()).count());
+// Decodes argument record at given position and returns position of the next one.
+inline Event* decode_event_arg(Event* position, EventArgRecord& arg) {
+    arg.name = position->name;
+#if LOP_COMPACT_EVENTS
+    arg.type = static_cast<event_type>(position->timestamp_type & ((1U << COMPACT_TYPE_BITS) - 1));
+    arg.value = position[1].timestamp_type;
+    return position + 2;
+#else
+    arg.type = position->type;
+    arg.value = position->metadata;
+    return position + 1;
+#endif
+}
+
+// Calls function for names and string values of arguments of the event, if it has any.
+template <typename Function>
+inline void for_each_arg_string(const EventRecord& event, Function function) {
+    Event* position = event.args;
+    for (uint64_t i = 0; position && i < event.metadata; ++i) {
+        EventArgRecord arg;
+        position = decode_event_arg(position, arg);
+        if (arg.name) function(arg.name);
+        if (arg.type == ARG_STRING && arg.value) function(reinterpret_cast<const char*>(arg.value));
     }
 }
 
-void ProfilerEngine::disable() {
-    const std::lock_guard<std::mutex> lock(control_mutex);
-    if (running && enabled) {
-        // Generate special event so that we can track on the trace at what point of UNIX time it was disabled.
-        emit_begin_event("lop_engine_disable");
-        auto time_disable = std::chrono::system_clock::now();
-        emit_end_meta_event("lop_engine_disable", std::chrono::duration_cast<std::chrono::nanoseconds>(time_disable.time_since_epoch()).count());
-        
-        enabled = false;
-    } 
+// Emitters write event header (the one with timestamp) as the last thing.
+inline bool event_written(const Event* position) {
+#if LOP_COMPACT_EVENTS
+    return position->timestamp_type != 0;
+#else
+    return position->timestamp != 0;
+#endif
 }
 
-void ProfilerEngine::scheduler_loop()
-{
-    uint64_t exhaustion_count = 0;
-    while (g_lop_inst.scheduler_run)
-    {
-        if (g_lop_inst.scheduler_queue.empty())
-        {
-            // Why 5 milliseconds? We want this thread to have negligible impact when waiting. But on
-            // the other hand, when we put a request in this queue, we have to generate new backup
-            // buffers before next exhaustion comes up, or we're screwed. Time between exhaustions
-            // won't be smaller than LOP_BUFFER_SIZE * 8ns which gives us 32ms for 4M events.
-            // It means 5 milliseconds delay between checks is well enough to catch any queue request
-            // and allocate it on time.
-            std::this_thread::sleep_for(std::chrono::milliseconds(5));
-            continue;
-        }
+// Rewrites timestamp of the event at given position.
+inline void set_event_timestamp(Event* position, uint64_t timestamp) {
+#if LOP_COMPACT_EVENTS
+    position->timestamp_type = (timestamp << COMPACT_TYPE_BITS) | (position->timestamp_type & ((1U << COMPACT_TYPE_BITS) - 1));
+#else
+    position->timestamp = timestamp;
+#endif
+}
 
-        ++exhaustion_count;
+// Records written by single emit call get single timestamp plus offset of at most this many ticks.
+#define LOP_CALL_TIMESTAMP_SPREAD 10
 
-        // Allocate new backups, as this is the time critical part.
-        for (auto& event_buffer : g_lop_inst.event_buffers) {
-            event_buffer->events_backup = new Event[LOP_BUFFER_SIZE];
-        }
+// Number of records (as returned by decode_event) written by the emit call that starts with given one,
+// if the next one is as given. Immediate and end-begin calls are marked, flows are the only ones with
+// a flow marker in the middle.
+static uint32_t emit_call_records(const EventRecord& first, const EventRecord* next) {
+    if (first.call_flags & (DUMP_EVENT_IMMEDIATE_CALL | DUMP_EVENT_ENDBEGIN_CALL)) return 2;
+    if (first.type == CALL_BEGIN_META && next && (next->type == FLOW_START || next->type == FLOW_FINISH)) return 3;
+    return 1;
+}
 
-        // Get buffers.
-        std::vector<BufferState> buffers;
-        {
-            const std::lock_guard<std::mutex> lock(g_lop_inst.scheduler_queue_mutex);
-            std::swap(buffers, g_lop_inst.scheduler_queue.front());
-            g_lop_inst.scheduler_queue.pop();
+// Recognizes kind of emit call by types of the records it has written, EMIT_KIND_COUNT if it's
+// not a start of one (argument or flow records whose call was cut off in ring mode).
+static emit_kind classify_emit_call(const EventRecord* records, uint32_t count) {
+    if (count == 3) return (records[1].type == FLOW_START) ? EMIT_FLOW_START : EMIT_FLOW_FINISH;
+    if (records[0].call_flags & DUMP_EVENT_ENDBEGIN_CALL) return EMIT_ENDBEGIN;
+    if (records[0].call_flags & DUMP_EVENT_IMMEDIATE_CALL) {
+        if (records[0].type == CALL_END_META) return EMIT_IMMEDIATE_META;
+        if (records[0].type == CALL_BEGIN_ARGS) return EMIT_IMMEDIATE_ARGS;
+        return EMIT_IMMEDIATE;
+    }
+    // CALL_BEGIN_SAMPLED, decoded as meta begin, is written by C++ emitter with its own cost.
+    if (records[0].sampled) return EMIT_BEGIN_SAMPLED;
+    switch (records[0].type) {
+        case CALL_BEGIN:      return EMIT_BEGIN;
+        case CALL_END:        return EMIT_END;
+        case CALL_BEGIN_META: return EMIT_BEGIN_META;
+        case CALL_BEGIN_ARGS: return EMIT_BEGIN_ARGS;
+        case CALL_END_META:   return EMIT_END_META;
+        case COUNTER_INT:     return EMIT_COUNTER;
+        default:              return EMIT_KIND_COUNT;
+    }
+}
+
+// Finds first event, timewise.
+static uint64_t find_first_timestamp(const std::vector<ProfilerEngine::BufferState>& buffers) {
+    uint64_t tsc_base = std::numeric_limits<uint64_t>::max();
+    for (const ProfilerEngine::BufferState& buffer : buffers) {
+        for (Event* position = buffer.events; position < buffer.next_event;) {
+            EventRecord event;
+            position = decode_event(position, event);
+            if (event.timestamp < tsc_base) tsc_base = event.timestamp;
         }
+    }
+    return tsc_base;
+}
 
-        // Schedule thread to save buffers to disk.
-        std::thread([exhaustion_count, buffers = std::move(buffers)]() {
-            // Save exhausted buffers to the disk.
-            std::string suffix = "exh_" + std::to_string(exhaustion_count);
-            printf("saving to disk, exhaustion # %" PRIu64 "\n", exhaustion_count);
-            g_lop_inst.flush_buffers(suffix.c_str(), buffers);
+#if LOP_CPU_ID
+// Time a thread was seen on a CPU, from its first to its last event there before an event of any
+// other thread shows up on that CPU. Thread could have been switched out at any point in between,
+// events don't tell that.
+struct CpuResidency {
+    uint64_t begin; // In ticks.
+    uint64_t end;
+    uint64_t thread_id;
+    uint32_t tsc_aux;
+};
 
-            // Cleanup buffers.
-            for (auto& event_buffer : buffers)
-            {
-                delete[] event_buffer.events;
-            }
+// Collects residencies of all threads, sorted by CPU and begin, they don't overlap on a single CPU.
+static std::vector<CpuResidency> collect_cpu_residencies(const std::vector<ProfilerEngine::BufferState>& buffers) {
+    struct CpuSample {
+        uint64_t timestamp;
+        uint32_t buffer_index;
+        uint32_t tsc_aux;
+    };
+    std::vector<CpuSample> samples;
+    for (uint32_t buffer_index = 0; buffer_index < buffers.size(); ++buffer_index) {
+        const ProfilerEngine::BufferState& buffer = buffers[buffer_index];
+        for (Event* position = buffer.events; position < buffer.next_event;) {
+            EventRecord event;
+            position = decode_event(position, event);
+            samples.push_back({ event.timestamp, buffer_index, event.tsc_aux });
+        }
+    }
+
+    std::sort(samples.begin(), samples.end(), [](const CpuSample& a, const CpuSample& b) {
+        uint32_t a_cpu = tsc_aux_cpu(a.tsc_aux);
+        uint32_t b_cpu = tsc_aux_cpu(b.tsc_aux);
+        return (a_cpu != b_cpu) ? a_cpu < b_cpu : a.timestamp < b.timestamp;
+    });
 
-            --g_lop_inst.active_exhaustion_count;
-            }).detach();
+    std::vector<CpuResidency> residencies;
+    uint32_t last_buffer_index = 0;
+    for (const CpuSample& sample : samples) {
+        bool continued = !residencies.empty() && last_buffer_index == sample.buffer_index &&
+                         tsc_aux_cpu(residencies.back().tsc_aux) == tsc_aux_cpu(sample.tsc_aux);
+        if (continued) {
+            residencies.back().end = sample.timestamp;
+        }
+        else {
+            residencies.push_back({ sample.timestamp, sample.timestamp, buffers[sample.buffer_index].thread_id, sample.tsc_aux });
+            last_buffer_index = sample.buffer_index;
+        }
     }
+    return residencies;
 }
+#endif
 
-void ProfilerEngine::flush_buffers(const char* suffix, const std::vector<BufferState>& buffers) {
-    // We REALLY want these two to happen together.
-    compiler_barrier();
-    auto tsc_disable = _asm_fast_rdtsc();
-    auto time_disable = std::chrono::system_clock::now();
-    compiler_barrier();
+// Per-thread override of buffer_capacity, set by profiler_set_thread_buffer_size().
+static thread_local uint64_t t_buffer_capacity = 0;
 
-    uint64_t events_counter = 0;
-    for (const BufferState& buffer : buffers) {
-        uint64_t events_in_buffer = buffer.next_event - buffer.events;
-        printf("Got %" PRIu64 "/%" PRIu32 " (%" PRIu64 "%%) events in buffer of thread: %" PRIx64 "\n",
-            events_in_buffer,
-            LOP_BUFFER_SIZE,
-            events_in_buffer * 100 / LOP_BUFFER_SIZE,
-            buffer.thread_id);
-        events_counter += events_in_buffer;
-    }
+static size_t event_table_size(uint64_t capacity) {
+    size_t size = (capacity + LOP_BUFFER_SLACK) * sizeof(Event);
+    return (size + LOP_HUGE_PAGE_SIZE - 1) & ~static_cast<size_t>(LOP_HUGE_PAGE_SIZE - 1);
+}
 
-    printf("TOTAL EVENTS: %" PRIu64 "\n", events_counter);
+// Event tables are allocated directly from the OS, so nothing is committed until it's touched
+// and we can control page size. Falls back to regular pages when huge ones can't be had.
+static Event* allocate_event_table(uint64_t capacity) {
+    size_t size = event_table_size(capacity);
+#if defined(_WIN32) || defined(_WIN64)
+    if (g_lop_inst.hugepages == HUGEPAGES_EXPLICIT) {
+        // Requires SeLockMemoryPrivilege. Large pages are always committed up front.
+        size_t large_page = GetLargePageMinimum();
+        if (large_page) {
+            size_t large_size = (size + large_page - 1) & ~(large_page - 1);
+            void* table = VirtualAlloc(nullptr, large_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (table) return static_cast<Event*>(table);
+        }
+        printf("Couldn't allocate large pages, falling back to regular ones.\n");
+    }
+    return static_cast<Event*>(VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+    if (g_lop_inst.hugepages == HUGEPAGES_EXPLICIT) {
+        void* table = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (table != MAP_FAILED) return static_cast<Event*>(table);
+        printf("Couldn't allocate explicit huge pages (see /proc/sys/vm/nr_hugepages), falling back to transparent ones.\n");
+    }
 
-    auto pid = get_process_id();
-    double unix_time_diff_ns = static_cast<double>(
-        std::chrono::duration_cast<std::chrono::nanoseconds>(time_disable.time_since_epoch()).count() -
-        std::chrono::duration_cast<std::chrono::nanoseconds>(time_enable.time_since_epoch()).count()
-        );
+    // Over-allocate, so that table can be aligned to huge page boundary, otherwise THP
+    // can't back the edges of the table.
+    char* mapping = static_cast<char*>(mmap(nullptr, size + LOP_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (mapping == MAP_FAILED) return nullptr;
 
-    char name[200];
-    if (suffix) snprintf(name, 200, "events_pid%u_ts%" PRIu64 "_%s.json", pid, static_cast<uint64_t>(unix_time_diff_ns / 1000), suffix);
-    else        snprintf(name, 200, "events_pid%u_ts%" PRIu64 ".json", pid, static_cast<uint64_t>(unix_time_diff_ns / 1000));
+    char* table = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(mapping) + LOP_HUGE_PAGE_SIZE - 1) & ~static_cast<uintptr_t>(LOP_HUGE_PAGE_SIZE - 1));
+    if (table != mapping) munmap(mapping, table - mapping);
+    munmap(table + size, mapping + LOP_HUGE_PAGE_SIZE - table);
+
+    if (g_lop_inst.hugepages != HUGEPAGES_NONE) {
+        madvise(table, size, MADV_HUGEPAGE);
+    }
+    return reinterpret_cast<Event*>(table);
+#endif
+}
+
+static void free_event_table(Event* table, uint64_t capacity) {
+#if defined(_WIN32) || defined(_WIN64)
+    VirtualFree(table, 0, MEM_RELEASE);
+#else
+    munmap(table, event_table_size(capacity));
+#endif
+}
+
+// Faults in pages of given range without changing their content, so it's safe to call
+// while owning thread is writing events there.
+static void prefault_range(Event* begin, Event* end) {
+    char* first = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(begin) & ~static_cast<uintptr_t>(LOP_PAGE_SIZE - 1));
+    char* last = reinterpret_cast<char*>(end);
+#if !defined(_WIN32) && !defined(_WIN64)
+    // Linux 5.14+ can do it without touching the memory at all.
+    static bool populate_supported = true;
+    if (populate_supported) {
+        if (madvise(first, last - first, MADV_POPULATE_WRITE) == 0) return;
+        if (errno == EINVAL) populate_supported = false;
+    }
+#endif
+    for (char* page = first; page < last; page += LOP_PAGE_SIZE) {
+        prefault_touch(page);
+    }
+}
+
+extern "C" {
+    // For windows, these are implemented in profiler_asm.asm (via MASM/ml64.exe).
+    // For linux, these are implemented in profiler_asm.cpp (via inline assembly).
+    uint64_t _asm_fast_rdtsc();
+    uint64_t _asm_get_tid();
+
+    // Default event emitters.
+    void _asm_emit_begin_event(ProfilerEngine*, const char*);
+    void _asm_emit_end_event(ProfilerEngine*, const char*);
+    void _asm_emit_endbegin_event(ProfilerEngine*, const char*, const char*);
+    void _asm_emit_immediate_event(ProfilerEngine*, const char*);
+
+    void _asm_emit_begin_meta_event(ProfilerEngine*, const char*, uint64_t);
+    void _asm_emit_end_meta_event(ProfilerEngine*, const char*, uint64_t);
+    void _asm_emit_counter_event(ProfilerEngine*, const char*, uint64_t);
+    void _asm_emit_immediate_meta_event(ProfilerEngine*, const char*, uint64_t);
+
+    void _asm_emit_flow_start_event(ProfilerEngine*, const char*, uint64_t);
+    void _asm_emit_flow_finish_event(ProfilerEngine*, const char*, uint64_t);
+
+    CustomTLS* allocate_custom_tls() {
+        return g_lop_inst.acquire_custom_tls();
+    }
+
+    void exhaustion_handler(EventBuffer* event_buffer) {
+        g_lop_inst.swap_exhausted_table(event_buffer);
+    }
+
+#if LOP_STREAMING
+    void stream_handler(EventBuffer* event_buffer) {
+        g_lop_inst.wait_for_stream_space(event_buffer);
+    }
+#endif
+};
+
+#if defined(_WIN32) || defined(_WIN64)
+static void WINAPI thread_exit_callback(void* custom_tls_entry) {
+#else
+static void thread_exit_callback(void* custom_tls_entry) {
+#endif
+    if (custom_tls_entry && g_lop_inst.thread_exit_tracking) {
+        g_lop_inst.retire_custom_tls(static_cast<CustomTLS*>(custom_tls_entry));
+    }
+}
+
+// Measurement of TSC frequency over at least this long is more accurate than any reported one.
+#define LOP_TSC_LONG_MEASUREMENT_NS 1000000000LL
+
+// Same clock as CLOCK_MONOTONIC used by crash handler on Linux.
+static int64_t steady_time_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t current_cpu() {
+#if defined(_WIN32) || defined(_WIN64)
+    return GetCurrentProcessorNumber();
+#else
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : static_cast<uint32_t>(cpu);
+#endif
+}
+
+static bool pin_current_thread(uint32_t cpu) {
+#if defined(_WIN32) || defined(_WIN64)
+    return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), 1ULL << cpu) != 0;
+#else
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+#endif
+}
+
+// CPUs the process is allowed to run on, which aren't always 0..N-1 (taskset, cgroups, offline CPUs).
+static std::vector<uint32_t> allowed_cpus() {
+    std::vector<uint32_t> cpus;
+#if defined(_WIN32) || defined(_WIN64)
+    DWORD_PTR process_mask, system_mask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+        for (uint32_t cpu = 0; cpu < 8 * sizeof(DWORD_PTR); ++cpu) {
+            if (process_mask & (static_cast<DWORD_PTR>(1) << cpu)) cpus.push_back(cpu);
+        }
+    }
+#else
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+        for (uint32_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cpu_set)) cpus.push_back(cpu);
+        }
+    }
+#endif
+    if (cpus.empty()) cpus.push_back(current_cpu());
+    return cpus;
+}
+
+#define LOP_CLOCK_SYNC_TRIES 5
+
+// Reads steady clock between two TSC readings, few times, and takes the tightest pair. Tries that
+// migrated to other CPU meanwhile are used only if all of them did.
+static ClockSync read_clock_sync(uint32_t& cpu) {
+    ClockSync sync = {};
+    uint64_t best_window = std::numeric_limits<uint64_t>::max();
+    for (uint32_t attempt = 0; attempt < LOP_CLOCK_SYNC_TRIES; ++attempt) {
+        uint32_t cpu_before = current_cpu();
+        compiler_barrier();
+        uint64_t tsc_before = _asm_fast_rdtsc();
+        int64_t time_ns = steady_time_ns();
+        uint64_t tsc_after = _asm_fast_rdtsc();
+        compiler_barrier();
+        bool migrated = (current_cpu() != cpu_before);
+
+        uint64_t window = tsc_after - tsc_before;
+        if (migrated && best_window != std::numeric_limits<uint64_t>::max()) continue;
+        if (migrated || window < best_window) {
+            best_window = migrated ? std::numeric_limits<uint64_t>::max() - 1 : window;
+            sync = { tsc_before + window / 2, time_ns };
+            cpu = cpu_before;
+        }
+    }
+    return sync;
+}
+
+#define LOP_TSC_SKEW_ROUNDS 1000
+
+// Round trip between cores takes few hundred ticks. Anything way longer means that the threads had
+// to be scheduled in and out, e.g. because CPUs are overcommitted, and the offset isn't reliable.
+#define LOP_TSC_SKEW_MAX_ROUND_TRIP 100000
+
+// Measures TSC of given CPU minus TSC of the reference one, in ticks. Threads pinned to both CPUs take turns,
+// reference one reads TSC before and after the other one reads it, and the fastest round trip gives
+// the best estimate. rdtscp waits for the previous loads, so it can't be read ahead of the turn.
+// Returns false if either thread couldn't be moved to its CPU or round trips were too slow.
+static bool measure_cpu_tsc_offset(uint32_t reference_cpu, uint32_t cpu, int64_t& offset) {
+    uint64_t best_round_trip = std::numeric_limits<uint64_t>::max();
+    std::atomic<uint32_t> turn(0);
+    std::atomic<uint64_t> remote_tsc(0);
+    std::atomic<bool> failed(false);
+
+    std::thread remote([&]() {
+        if (!pin_current_thread(cpu)) failed = true;
+        for (uint32_t round = 0; round < LOP_TSC_SKEW_ROUNDS && !failed; ++round) {
+            while (turn.load(std::memory_order_acquire) != 2 * round + 1) {
+                if (failed) return;
+            }
+            unsigned int aux;
+            remote_tsc.store(__rdtscp(&aux), std::memory_order_relaxed);
+            turn.store(2 * round + 2, std::memory_order_release);
+        }
+    });
+
+    std::thread reference([&]() {
+        if (!pin_current_thread(reference_cpu)) failed = true;
+        for (uint32_t round = 0; round < LOP_TSC_SKEW_ROUNDS && !failed; ++round) {
+            unsigned int aux;
+            uint64_t before = __rdtscp(&aux);
+            turn.store(2 * round + 1, std::memory_order_release);
+            while (turn.load(std::memory_order_acquire) != 2 * round + 2) {
+                if (failed) return;
+            }
+            uint64_t after = __rdtscp(&aux);
+            if (after - before < best_round_trip) {
+                best_round_trip = after - before;
+                offset = static_cast<int64_t>(remote_tsc.load(std::memory_order_relaxed) - before) - static_cast<int64_t>(best_round_trip / 2);
+            }
+        }
+    });
+
+    reference.join();
+    remote.join();
+    return !failed && best_round_trip <= LOP_TSC_SKEW_MAX_ROUND_TRIP;
+}
+
+static void cpuid(uint32_t leaf, uint32_t registers[4]) {
+#if defined(_WIN32) || defined(_WIN64)
+    __cpuidex(reinterpret_cast<int*>(registers), static_cast<int>(leaf), 0);
+#else
+    __cpuid_count(leaf, 0, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// TSC frequency in ticks per nanosecond as reported by the CPU (leaf 0x15, crystal clock and its ratio
+// to TSC), hypervisor (leaf 0x40000010) or Linux kernel, or nominal frequency (leaf 0x16) as the last
+// resort. Zero if nothing reports it, which is the usual case in virtual machines.
+static double reported_tsc_frequency(const char** source) {
+    uint32_t registers[4];
+    cpuid(0, registers);
+    uint32_t max_leaf = registers[0];
+
+    if (max_leaf >= 0x15) {
+        cpuid(0x15, registers);
+        if (registers[0] && registers[1] && registers[2]) {
+            *source = "CPUID leaf 0x15";
+            return static_cast<double>(registers[2]) * registers[1] / registers[0] / 1e9;
+        }
+    }
+
+    cpuid(1, registers);
+    if (registers[2] & (1U << 31)) {
+        cpuid(0x40000000, registers);
+        if (registers[0] >= 0x40000010) {
+            cpuid(0x40000010, registers);
+            if (registers[0]) {
+                *source = "hypervisor";
+                return registers[0] / 1e6;
+            }
+        }
+    }
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    FILE* file = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+    if (file) {
+        unsigned long long frequency_khz = 0;
+        bool parsed = (fscanf(file, "%llu", &frequency_khz) == 1);
+        fclose(file);
+        if (parsed && frequency_khz) {
+            *source = "kernel";
+            return frequency_khz / 1e6;
+        }
+    }
+#endif
+
+    if (max_leaf >= 0x16) {
+        cpuid(0x16, registers);
+        if (registers[0]) {
+            *source = "CPUID leaf 0x16";
+            return registers[0] / 1e3;
+        }
+    }
+    return 0.0;
+}
+
+void profiler_enable() {
+    g_lop_inst.enable();
+}
+void profiler_disable() {
+    g_lop_inst.disable();
+}
+void profiler_flush(const char* suffix) {
+    g_lop_inst.flush(suffix);
+}
+void profiler_snapshot(const char* suffix) {
+    g_lop_inst.snapshot(suffix);
+}
+void profiler_set_buffer_size(uint64_t bytes) {
+    g_lop_inst.buffer_capacity = std::max<uint64_t>(bytes / sizeof(Event), LOP_BUFFER_SLACK);
+}
+void profiler_set_thread_buffer_size(uint64_t bytes) {
+    t_buffer_capacity = std::max<uint64_t>(bytes / sizeof(Event), LOP_BUFFER_SLACK);
+}
+void profiler_set_category_mask(uint64_t mask) {
+    CategoryRegistry& registry = category_registry();
+    const std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.filter.clear();
+    registry.mask = mask;
+    registry.publish();
+}
+
+bool register_category(uint32_t category, const char* category_name) {
+    if (category >= LOP_MAX_CATEGORIES) return false;
+    CategoryRegistry& registry = category_registry();
+    const std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.category_names[category] = category_name;
+    if (std::find(registry.filter.begin(), registry.filter.end(), category_name) != registry.filter.end()) {
+        registry.mask |= 1ULL << category;
+        registry.publish();
+    }
+    return true;
+}
+
+bool register_event_category(const char* name, uint32_t category) {
+    if (category >= LOP_MAX_CATEGORIES) return false;
+    CategoryRegistry& registry = category_registry();
+    const std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.event_categories.insert({ name, category });
+    return true;
+}
+
+ProfilerEngine::ProfilerEngine()
+:   custom_tls_offset(0),
+    flushed(true),
+    running(false),
+    format(OUTPUT_JSON),
+    snapshot_count(0),
+    hugepages(HUGEPAGES_NONE),
+    prefault(PREFAULT_NONE),
+    prefault_window(0),
+    buffer_capacity(LOP_DEFAULT_BUFFER_SIZE / sizeof(Event)),
+    tsc_enable(0),
+    ticks_per_ns_ratio(0.0),
+    tsc_frequency_reported(false),
+    tsc_startup(0),
+    time_startup_ns(0),
+    clock_syncs(),
+    clock_sync_count(0),
+    clock_sync_interval_ms(1000),
+    clock_sync_mutex(),
+    clock_sync_cv(),
+    clock_sync_run(false),
+    clock_sync_thread(),
+    tsc_skew_measurement(false),
+    cpu_tsc_offsets(),
+    emit_overhead(),
+    overhead_compensation(false),
+    percentile_report(false),
+    buffers_mutex(),
+    control_mutex(),
+    active_exhaustion_count(0),
+    dropped_records(0),
+#if LOP_SAFER
+    scheduler_run(true),
+#else
+    scheduler_run(false),
+#endif
+    scheduler_thread(),
+    scheduler_mutex(),
+    scheduler_cv(),
+    exhausted_tables(nullptr),
+    spare_tables(),
+    prefault_run(false),
+    prefault_thread(),
+#if LOP_STREAMING
+    stream_mutex(),
+    stream_cv(),
+    stream_wakeup(false),
+    stream_run(false),
+    stream_thread(),
+    stream_interval_ms(10),
+    stream_fd(-1),
+    stream_success(true),
+    stream_count(0),
+    stream_records(0),
+    stream_waits(0),
+    stream_sync_tsc(0),
+    stream_header(),
+    stream_name(),
+    stream_names(),
+    stream_staging(),
+#endif
+    event_buffers(),
+    retired_buffers(),
+    free_buffers(),
+    time_enable(),
+    thread_exit_tracking(false),
+    thread_exit_key(),
+    crash_dump_fd(-1),
+    crash_dump_written(false),
+    crash_dump_name(),
+    crash_dump_names(nullptr),
+    crash_dump_staging(nullptr)
+{
+    // Started here, not in the initializer list, because it uses members declared after it.
+    scheduler_thread = std::thread(scheduler_loop);
+
+    // Constructed before us, so destroyed after our final flush.
+    category_registry();
+
+    char* disable_string = std::getenv("LOP_DISABLE");
+    if (!disable_string || !static_cast<uint32_t>(std::stoi(disable_string))) {
+        // TSC frequency is taken from the CPU, hypervisor or kernel if any of them reports it. Either way
+        // it's also measured from now on and the measurement is used at flush when it's long enough
+        // to be more accurate (or when nothing was reported), see refine_tsc_frequency.
+        record_clock_sync();
+        tsc_startup = clock_syncs[0].tsc;
+        time_startup_ns = clock_syncs[0].time_ns;
+
+        const char* frequency_source = nullptr;
+        ticks_per_ns_ratio = reported_tsc_frequency(&frequency_source);
+        tsc_frequency_reported = (ticks_per_ns_ratio > 0.0);
+        if (tsc_frequency_reported) {
+            printf("TSC freq reported by %s: %f GHz\n", frequency_source, ticks_per_ns_ratio);
+            printf("                    %f ticks per nanosecond\n", ticks_per_ns_ratio);
+        }
+        else {
+            printf("TSC freq is not reported, it will be measured until flush.\n");
+        }
+
+#if defined(_WIN32) || defined(_WIN64)
+        // Asm reads TEB slots directly and only the first ones are in TEB itself.
+        lop_custom_tls_index = TlsAlloc();
+        if (lop_custom_tls_index >= TEB_TLS_SLOTS_COUNT) {
+            printf("Couldn't allocate TLS slot for the profiler, it won't run.\n");
+            return;
+        }
+        custom_tls_offset = TEB_TLS_SLOTS_OFFSET + lop_custom_tls_index * sizeof(void*);
+#endif
+
+        // Binary format dumps the raw event tables, which is way faster than formatting JSON
+        // inside of the traced process. Use tools/lop_convert.cpp to convert it afterwards.
+        // Perfetto format is native protobuf trace with interned names, much smaller and faster
+        // to load than JSON for big traces.
+        char* format_string = std::getenv("LOP_OUTPUT_FORMAT");
+        if (format_string && std::string(format_string) == "binary") {
+            format = OUTPUT_BINARY;
+            printf("Using binary output format.\n");
+        }
+        else if (format_string && std::string(format_string) == "perfetto") {
+            format = OUTPUT_PERFETTO;
+            printf("Using perfetto output format.\n");
+        }
+
+        // Event tables are big, so by default their pages are faulted in one by one from inside
+        // of the emitters, which shows up on the trace as profiler-made spikes. Huge pages make
+        // it far less frequent and also remove dTLB misses, prefaulting removes it completely by
+        // touching pages on background thread, either whole tables at once or just a window
+        // of LOP_PREFAULT_WINDOW megabytes ahead of the current position.
+        char* buffer_string = std::getenv("LOP_BUFFER_MB");
+        if (buffer_string) {
+            buffer_capacity = (std::stoull(buffer_string) << 20) / sizeof(Event);
+            printf("Using %s MB event buffers.\n", buffer_string);
+        }
+
+        char* hugepages_string = std::getenv("LOP_HUGEPAGES");
+        if (hugepages_string && std::string(hugepages_string) == "thp") {
+            hugepages = HUGEPAGES_TRANSPARENT;
+            printf("Using transparent huge pages.\n");
+        }
+        else if (hugepages_string && std::string(hugepages_string) == "explicit") {
+            hugepages = HUGEPAGES_EXPLICIT;
+            printf("Using explicit huge pages.\n");
+        }
+
+        char* prefault_string = std::getenv("LOP_PREFAULT");
+        if (prefault_string && std::string(prefault_string) == "eager") {
+            prefault = PREFAULT_EAGER;
+            printf("Using eager prefault.\n");
+        }
+        else if (prefault_string && std::string(prefault_string) == "window") {
+            prefault = PREFAULT_WINDOW;
+            char* window_string = std::getenv("LOP_PREFAULT_WINDOW");
+            uint64_t window_mb = window_string ? std::stoull(window_string) : 32;
+            prefault_window = (window_mb << 20) / sizeof(Event);
+            printf("Using window prefault, %" PRIu64 " MB ahead.\n", window_mb);
+        }
+
+        if (prefault != PREFAULT_NONE) {
+            prefault_run = true;
+            prefault_thread = std::thread(prefault_loop);
+        }
+
+        // Buffers of exited threads are kept until flush and then given to new threads, so thread
+        // churn neither loses events nor allocates new tables all the time.
+#if defined(_WIN32) || defined(_WIN64)
+        thread_exit_key = FlsAlloc(thread_exit_callback);
+        thread_exit_tracking = (thread_exit_key != FLS_OUT_OF_INDEXES);
+#else
+        thread_exit_tracking = (pthread_key_create(&thread_exit_key, thread_exit_callback) == 0);
+#endif
+
+        // Events that lead to a crash are lost, because destructor never runs. With crash dumps
+        // enabled, fatal signals write whatever is in the tables to a .lopdump file.
+        char* crash_dump_string = std::getenv("LOP_CRASH_DUMP");
+        if (crash_dump_string && static_cast<uint32_t>(std::stoi(crash_dump_string))) {
+            install_crash_handler();
+        }
+
+        // Single frequency doesn't fit long runs, as TSC drifts against the system clock which is
+        // kept in sync with NTP, so steady clock is sampled every LOP_CLOCK_SYNC_MS and exporters
+        // interpolate between samples. With LOP_TSC_SKEW=1, TSC offsets between CPUs are measured
+        // at every enable and the samples taken on other CPUs are corrected by them.
+        char* clock_sync_string = std::getenv("LOP_CLOCK_SYNC_MS");
+        if (clock_sync_string) {
+            clock_sync_interval_ms = std::stoull(clock_sync_string);
+            printf("Using %" PRIu64 " ms clock sync interval.\n", clock_sync_interval_ms);
+        }
+        if (clock_sync_interval_ms) {
+            clock_sync_run = true;
+            clock_sync_thread = std::thread(clock_sync_loop);
+        }
+
+        char* tsc_skew_string = std::getenv("LOP_TSC_SKEW");
+        if (tsc_skew_string && static_cast<uint32_t>(std::stoi(tsc_skew_string))) {
+            tsc_skew_measurement = true;
+            printf("Measuring TSC skew between CPUs at first enable.\n");
+        }
+
+        // Every event adds the emitter cost to the slices around it, so nested scopes make their
+        // parents longer. With compensation, events of each thread are moved back in time by
+        // the overhead of all emit calls made before them on that thread, measured right here.
+        char* compensate_string = std::getenv("LOP_COMPENSATE");
+        if (compensate_string && static_cast<uint32_t>(std::stoi(compensate_string))) {
+            overhead_compensation = true;
+            printf("Compensating tracing overhead.\n");
+            calibrate_overhead();
+        }
+
+        char* percentiles_string = std::getenv("LOP_PERCENTILES");
+        if (percentiles_string && static_cast<uint32_t>(std::stoi(percentiles_string))) {
+            percentile_report = true;
+            printf("Writing latency percentiles next to traces.\n");
+        }
+
+#if LOP_STREAMING
+        // Started after the calibration, which emits into its own temporary buffer.
+        char* stream_interval_string = std::getenv("LOP_STREAM_INTERVAL_MS");
+        if (stream_interval_string) {
+            stream_interval_ms = std::max<uint64_t>(std::stoull(stream_interval_string), 1);
+            printf("Draining event buffers every %" PRIu64 " ms.\n", stream_interval_ms);
+        }
+        if (format != OUTPUT_BINARY) printf("Streaming mode writes binary dumps only, convert them with lop_convert.\n");
+        stream_run = true;
+        stream_thread = std::thread(stream_loop);
+#endif
+
+        running = true;
+    }
+}
+
+#if LOP_PATCH_SITES
+#include <sys/syscall.h>
+
+// Boundaries of "lop_sites" section, provided by the linker.
+extern "C" {
+    extern inline_emitters::PatchSite __start_lop_sites[] __attribute__((weak));
+    extern inline_emitters::PatchSite __stop_lop_sites[] __attribute__((weak));
+}
+
+#define LOP_SITE_SIZE 5
+#define LOP_SITE_BREAKPOINT 0xcc
+
+// Commands of membarrier(), from linux/membarrier.h, which has them only as enum values and
+// only since 4.16.
+#define LOP_MEMBARRIER_PRIVATE_EXPEDITED_SYNC_CORE (1 << 5)
+#define LOP_MEMBARRIER_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE (1 << 6)
+
+// Direction of the patching in progress, for threads that hit the breakpoint meanwhile.
+static volatile bool patching_to_enabled;
+static struct sigaction previous_sigtrap_action;
+
+// Thread that reaches a site while it's being patched hits int3 in its first byte and continues
+// as if the new instruction was there. Breakpoints that aren't ours go to the previous handler.
+// It stays installed after the first patching, as the signal of late trap can still be on the way.
+static void patch_sigtrap_handler(int signal_number, siginfo_t* info, void* context) {
+    ucontext_t* user_context = static_cast<ucontext_t*>(context);
+    uintptr_t address = static_cast<uintptr_t>(user_context->uc_mcontext.gregs[REG_RIP]) - 1;
+    for (inline_emitters::PatchSite* site = __start_lop_sites; site < __stop_lop_sites; ++site) {
+        if (site->site == address) {
+            user_context->uc_mcontext.gregs[REG_RIP] = static_cast<greg_t>(patching_to_enabled ? site->target : site->site + LOP_SITE_SIZE);
+            return;
+        }
+    }
+
+    if (previous_sigtrap_action.sa_flags & SA_SIGINFO) {
+        previous_sigtrap_action.sa_sigaction(signal_number, info, context);
+    }
+    else if (previous_sigtrap_action.sa_handler != SIG_IGN && previous_sigtrap_action.sa_handler != SIG_DFL) {
+        previous_sigtrap_action.sa_handler(signal_number);
+    }
+    else if (previous_sigtrap_action.sa_handler == SIG_DFL) {
+        signal(SIGTRAP, SIG_DFL);
+        raise(SIGTRAP);
+    }
+}
+
+// Makes every core of the process execute a serializing instruction, so none of them runs stale
+// bytes of the modified code. Returns false on kernels without the command (before 4.16).
+static bool sync_cores() {
+    static bool registered = (syscall(__NR_membarrier, LOP_MEMBARRIER_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0);
+    return registered && syscall(__NR_membarrier, LOP_MEMBARRIER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0;
+}
+
+// Protection of the mapping holding every given page (sorted), read from /proc/self/maps.
+// Pages that can't be found there get R+X, which code pages normally have.
+static std::vector<int> page_protections(const std::vector<uintptr_t>& pages) {
+    std::vector<int> protections(pages.size(), PROT_READ | PROT_EXEC);
+    FILE* file = fopen("/proc/self/maps", "r");
+    if (!file) return protections;
+
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long long begin, end;
+        char permissions[5];
+        if (sscanf(line, "%llx-%llx %4s", &begin, &end, permissions) != 3) continue;
+        int protection = (permissions[0] == 'r' ? PROT_READ : 0) | (permissions[1] == 'w' ? PROT_WRITE : 0) |
+                         (permissions[2] == 'x' ? PROT_EXEC : 0);
+        auto first = std::lower_bound(pages.begin(), pages.end(), static_cast<uintptr_t>(begin));
+        for (auto page = first; page != pages.end() && *page < end; ++page) protections[page - pages.begin()] = protection;
+    }
+    fclose(file);
+    return protections;
+}
+
+// Turns all static keys on (jump to emission code) or off (NOP), while other threads may run them.
+// Cross-modifying code needs the same steps as kernel's text_poke_bp(): int3 goes to the first byte
+// of every site, then the rest of new instruction, then its first byte, with all cores serialized
+// after each step. Threads that hit int3 meanwhile are sent where the new instruction would send them.
+static bool patch_sites(bool enable) {
+    static const uint8_t site_nop[LOP_SITE_SIZE] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+    std::vector<inline_emitters::PatchSite*> sites;
+    std::vector<std::array<uint8_t, LOP_SITE_SIZE>> instructions;
+    std::vector<uintptr_t> pages;
+    bool success = true;
+    for (inline_emitters::PatchSite* site = __start_lop_sites; site < __stop_lop_sites; ++site) {
+        std::array<uint8_t, LOP_SITE_SIZE> instruction;
+        if (enable) {
+            int64_t displacement = static_cast<int64_t>(site->target - (site->site + LOP_SITE_SIZE));
+            if (displacement != static_cast<int32_t>(displacement)) {
+                success = false;
+                continue;
+            }
+            int32_t displacement32 = static_cast<int32_t>(displacement);
+            instruction[0] = 0xe9;
+            memcpy(&instruction[1], &displacement32, sizeof(displacement32));
+        }
+        else {
+            memcpy(instruction.data(), site_nop, LOP_SITE_SIZE);
+        }
+        if (memcmp(reinterpret_cast<const void*>(site->site), instruction.data(), LOP_SITE_SIZE) == 0) continue;
+
+        sites.push_back(site);
+        instructions.push_back(instruction);
+        pages.push_back(site->site & ~static_cast<uintptr_t>(LOP_PAGE_SIZE - 1));
+        pages.push_back((site->site + LOP_SITE_SIZE - 1) & ~static_cast<uintptr_t>(LOP_PAGE_SIZE - 1));
+    }
+    if (!success) printf("Some tracepoints are too far from their emission code to be patched.\n");
+    if (sites.empty()) return success;
+
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    std::vector<int> protections = page_protections(pages);
+    std::vector<bool> writable(pages.size(), false);
+    for (size_t i = 0; i < pages.size(); ++i) {
+        writable[i] = (mprotect(reinterpret_cast<void*>(pages[i]), LOP_PAGE_SIZE, protections[i] | PROT_WRITE | PROT_EXEC) == 0);
+    }
+    auto site_writable = [&](const inline_emitters::PatchSite* site) {
+        for (uintptr_t address : { site->site, site->site + LOP_SITE_SIZE - 1 }) {
+            size_t page = std::lower_bound(pages.begin(), pages.end(), address & ~static_cast<uintptr_t>(LOP_PAGE_SIZE - 1)) - pages.begin();
+            if (!writable[page]) return false;
+        }
+        return true;
+    };
+
+    patching_to_enabled = enable;
+    static bool handler_installed = false;
+    if (!handler_installed) {
+        struct sigaction action = {};
+        action.sa_sigaction = patch_sigtrap_handler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGTRAP, &action, &previous_sigtrap_action);
+        handler_installed = true;
+    }
+
+    auto write_byte = [](uintptr_t address, uint8_t value) {
+        __atomic_store_n(reinterpret_cast<uint8_t*>(address), value, __ATOMIC_SEQ_CST);
+    };
+    std::vector<bool> patched(sites.size(), false);
+    for (size_t i = 0; i < sites.size(); ++i) {
+        patched[i] = site_writable(sites[i]);
+        if (patched[i]) write_byte(sites[i]->site, LOP_SITE_BREAKPOINT);
+        else success = false;
+    }
+    bool synced = sync_cores();
+    for (size_t i = 0; i < sites.size(); ++i) {
+        if (!patched[i]) continue;
+        for (size_t byte = 1; byte < LOP_SITE_SIZE; ++byte) write_byte(sites[i]->site + byte, instructions[i][byte]);
+    }
+    synced = sync_cores() && synced;
+    for (size_t i = 0; i < sites.size(); ++i) {
+        if (patched[i]) write_byte(sites[i]->site, instructions[i][0]);
+    }
+    synced = sync_cores() && synced;
+
+    for (size_t i = 0; i < pages.size(); ++i) {
+        if (writable[i]) mprotect(reinterpret_cast<void*>(pages[i]), LOP_PAGE_SIZE, protections[i]);
+    }
+    static bool sync_warning_printed = false;
+    if (!synced && !sync_warning_printed) {
+        printf("membarrier(SYNC_CORE) isn't available, enable and disable only while no traced thread runs.\n");
+        sync_warning_printed = true;
+    }
+
+    if (!success) printf("Couldn't make code writable, some tracepoints weren't patched.\n");
+    return success;
+}
+#endif
+
+// Uses TSC frequency measured since startup, if it's long enough to be more accurate than
+// the reported one. If nothing was reported, waits until it's measured long enough.
+void ProfilerEngine::refine_tsc_frequency() {
+    int64_t measured_ns = steady_time_ns() - time_startup_ns;
+    if (tsc_frequency_reported && measured_ns < LOP_TSC_LONG_MEASUREMENT_NS) return;
+
+    if (measured_ns < LOP_TSC_MIN_MEASUREMENT_NS) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(LOP_TSC_MIN_MEASUREMENT_NS - measured_ns));
+    }
+
+    compiler_barrier();
+    uint64_t tsc_now = _asm_fast_rdtsc();
+    measured_ns = steady_time_ns() - time_startup_ns;
+    compiler_barrier();
+
+    // Flushes of exhausted tables run on the scheduler thread, readers take the same lock.
+    double ratio = static_cast<double>(tsc_now - tsc_startup) / static_cast<double>(measured_ns);
+    {
+        const std::lock_guard<std::mutex> lock(clock_sync_mutex);
+        ticks_per_ns_ratio = ratio;
+    }
+    printf("Measured %f ticks per nanosecond over %.3f s\n", ratio, measured_ns / 1e9);
+}
+
+// Sync point is taken on whatever CPU the caller runs, so with known skew it's moved to the timeline
+// of the reference CPU. Full table is thinned out by dropping every other point, so the older part of very long
+// runs ends up interpolated over longer segments.
+void ProfilerEngine::record_clock_sync() {
+    uint32_t cpu = 0;
+    ClockSync sync = read_clock_sync(cpu);
+
+    const std::lock_guard<std::mutex> lock(clock_sync_mutex);
+    if (cpu < cpu_tsc_offsets.size()) sync.tsc -= cpu_tsc_offsets[cpu];
+
+    uint32_t count = clock_sync_count;
+    if (count == LOP_MAX_CLOCK_SYNCS) {
+        for (uint32_t i = 1; i < count / 2; ++i) clock_syncs[i] = clock_syncs[2 * i];
+        count /= 2;
+    }
+    clock_syncs[count] = sync;
+    clock_sync_count = count + 1;
+}
+
+void ProfilerEngine::clock_sync_loop() {
+    std::unique_lock<std::mutex> lock(g_lop_inst.clock_sync_mutex);
+    while (g_lop_inst.clock_sync_run) {
+        g_lop_inst.clock_sync_cv.wait_for(lock, std::chrono::milliseconds(g_lop_inst.clock_sync_interval_ms), []() {
+            return !g_lop_inst.clock_sync_run;
+        });
+        if (!g_lop_inst.clock_sync_run) break;
+
+        lock.unlock();
+        g_lop_inst.record_clock_sync();
+        lock.lock();
+    }
+}
+
+void ProfilerEngine::measure_tsc_skew() {
+    std::vector<uint32_t> cpus = allowed_cpus();
+    uint32_t reference_cpu = cpus.front();
+    std::vector<int64_t> offsets(cpus.back() + 1, 0);
+
+    uint32_t skewed_cpu = reference_cpu;
+    for (uint32_t cpu : cpus) {
+        if (cpu == reference_cpu) continue;
+        if (!measure_cpu_tsc_offset(reference_cpu, cpu, offsets[cpu])) {
+            printf("Couldn't measure TSC offset of CPU %u.\n", cpu);
+            offsets[cpu] = 0;
+        }
+        if (std::abs(offsets[cpu]) > std::abs(offsets[skewed_cpu])) skewed_cpu = cpu;
+    }
+    printf("Max TSC skew against CPU %u: %" PRId64 " ticks on CPU %u\n", reference_cpu, offsets[skewed_cpu], skewed_cpu);
+
+    const std::lock_guard<std::mutex> lock(clock_sync_mutex);
+    cpu_tsc_offsets = std::move(offsets);
+}
+
+ClockMapping ProfilerEngine::clock_mapping(uint64_t tsc_base) {
+    const std::lock_guard<std::mutex> lock(clock_sync_mutex);
+    ClockMapping clock(clock_syncs, clock_sync_count, ticks_per_ns_ratio, tsc_base);
+    if (LOP_CPU_ID) clock.cpu_offsets = cpu_tsc_offsets;
+    return clock;
+}
+
+#define LOP_CALIBRATION_CALLS 1000
+#define LOP_CALIBRATION_ROUNDS 5
+
+static void write_args_event(const char* name, std::initializer_list<EventArg> args, bool immediate);
+static void write_sampled_begin_event(const char* name, uint64_t weight);
+
+// Measures how many ticks each kind of emit call takes, best of few rounds. Asm emitters are called
+// directly, with calling thread temporarily pointed at a table that isn't registered anywhere, so
+// neither lop_enabled nor patch sites are touched and other threads keep emitting (or not) as before.
+// With inline emitters this measures the out-of-line path, which is a bit slower than inlined one.
+// Events with arguments are measured with three of them, interning of string_view values isn't included.
+void ProfilerEngine::calibrate_overhead() {
+    CustomTLS* thread_custom_tls = get_thread_custom_tls();
+    CustomTLS calibration_tls(LOP_CALIBRATION_CALLS * LOP_BUFFER_SLACK);
+
+    EventBuffer& event_buffer = calibration_tls.event_buffer;
+    if (!event_buffer.events) return;
+    set_thread_custom_tls(&calibration_tls);
+
+    auto measure = [&event_buffer](auto emit) {
+        uint64_t best_ticks = std::numeric_limits<uint64_t>::max();
+        for (uint32_t round = 0; round < LOP_CALIBRATION_ROUNDS; ++round) {
+            event_buffer.next_event = event_buffer.events;
+            compiler_barrier();
+            uint64_t start = _asm_fast_rdtsc();
+            for (uint32_t call = 0; call < LOP_CALIBRATION_CALLS; ++call) emit(call);
+            uint64_t ticks = _asm_fast_rdtsc() - start;
+            compiler_barrier();
+            best_ticks = std::min(best_ticks, ticks);
+        }
+        return static_cast<double>(best_ticks) / LOP_CALIBRATION_CALLS;
+    };
+    const char* name = "lop_calibration";
+    emit_overhead[EMIT_BEGIN] = measure([this, name](uint32_t) { _asm_emit_begin_event(this, name); });
+    emit_overhead[EMIT_END] = measure([this, name](uint32_t) { _asm_emit_end_event(this, name); });
+    emit_overhead[EMIT_IMMEDIATE] = measure([this, name](uint32_t) { _asm_emit_immediate_event(this, name); });
+    emit_overhead[EMIT_ENDBEGIN] = measure([this, name](uint32_t) { _asm_emit_endbegin_event(this, name, name); });
+    emit_overhead[EMIT_BEGIN_META] = measure([this, name](uint32_t call) { _asm_emit_begin_meta_event(this, name, call); });
+    emit_overhead[EMIT_END_META] = measure([this, name](uint32_t call) { _asm_emit_end_meta_event(this, name, call); });
+    emit_overhead[EMIT_IMMEDIATE_META] = measure([this, name](uint32_t call) { _asm_emit_immediate_meta_event(this, name, call); });
+    emit_overhead[EMIT_COUNTER] = measure([this, name](uint32_t call) { _asm_emit_counter_event(this, name, call); });
+    emit_overhead[EMIT_FLOW_START] = measure([this, name](uint32_t call) { _asm_emit_flow_start_event(this, name, call); });
+    emit_overhead[EMIT_FLOW_FINISH] = measure([this, name](uint32_t call) { _asm_emit_flow_finish_event(this, name, call); });
+    emit_overhead[EMIT_BEGIN_ARGS] = measure([name](uint32_t call) { write_args_event(name, { { "call", call }, { "ratio", 0.5 }, { "name", name } }, false); });
+    emit_overhead[EMIT_IMMEDIATE_ARGS] = measure([name](uint32_t call) { write_args_event(name, { { "call", call }, { "ratio", 0.5 }, { "name", name } }, true); });
+    emit_overhead[EMIT_BEGIN_SAMPLED] = measure([name](uint32_t call) { write_sampled_begin_event(name, call); });
+
+    set_thread_custom_tls(thread_custom_tls);
+
+    printf("Emit overhead in ticks: begin %.1f, end %.1f, immediate %.1f, endbegin %.1f, meta %.1f/%.1f/%.1f, counter %.1f, flow %.1f/%.1f, args %.1f/%.1f, sampled %.1f\n",
+        emit_overhead[EMIT_BEGIN], emit_overhead[EMIT_END], emit_overhead[EMIT_IMMEDIATE], emit_overhead[EMIT_ENDBEGIN],
+        emit_overhead[EMIT_BEGIN_META], emit_overhead[EMIT_END_META], emit_overhead[EMIT_IMMEDIATE_META],
+        emit_overhead[EMIT_COUNTER], emit_overhead[EMIT_FLOW_START], emit_overhead[EMIT_FLOW_FINISH],
+        emit_overhead[EMIT_BEGIN_ARGS], emit_overhead[EMIT_IMMEDIATE_ARGS], emit_overhead[EMIT_BEGIN_SAMPLED]);
+}
+
+// Moves every event back in time by the overhead of all emit calls made before it on the same
+// thread, so slices don't include tracing overhead of their children (nor their own). Threads are
+// shifted independently, so the more events a thread has, the further it drifts from the others.
+// Live tables are left as recorded, so that they can be flushed or snapshotted again, compensated
+// copies are returned instead, with their memory held by tables.
+std::vector<ProfilerEngine::BufferState> ProfilerEngine::compensate_overhead(const std::vector<BufferState>& buffers,
+                                                                             std::vector<std::unique_ptr<Event[]>>& tables) {
+    std::vector<BufferState> compensated = buffers;
+    for (BufferState& buffer : compensated) {
+        size_t records = buffer.next_event - buffer.events;
+        tables.emplace_back(new Event[std::max<size_t>(records, 1)]);
+        if (records) memcpy(tables.back().get(), buffer.events, records * sizeof(Event));
+        buffer.events = tables.back().get();
+        buffer.next_event = buffer.events + records;
+
+        double shift = 0.0;
+        uint64_t previous_timestamp = 0;
+        for (Event* position = buffer.events; position < buffer.next_event;) {
+            // Collect records of single emit call, they all move together.
+            Event* call_positions[3] = { position };
+            EventRecord call_records[3];
+            position = decode_event(position, call_records[0]);
+            uint32_t call_count = 1;
+            if (position < buffer.next_event) {
+                call_positions[1] = position;
+                Event* next_position = decode_event(position, call_records[1]);
+                uint32_t expected_count = emit_call_records(call_records[0], &call_records[1]);
+                if (expected_count > 1) {
+                    call_count = 2;
+                    position = next_position;
+                }
+                if (expected_count > 2 && position < buffer.next_event) {
+                    call_positions[2] = position;
+                    position = decode_event(position, call_records[2]);
+                    call_count = 3;
+                }
+            }
+
+            // Never written (safer mode recovery) or wiped, leave it alone.
+            if (call_records[0].timestamp == 0) continue;
+
+            uint64_t call_shift = static_cast<uint64_t>(shift);
+            for (uint32_t i = 0; i < call_count; ++i) {
+                uint64_t timestamp = call_records[i].timestamp;
+                timestamp = (timestamp > call_shift) ? timestamp - call_shift : 0;
+                timestamp = std::max(timestamp, previous_timestamp);
+                set_event_timestamp(call_positions[i], timestamp);
+                previous_timestamp = timestamp;
+            }
+
+            emit_kind kind = classify_emit_call(call_records, call_count);
+            if (kind < EMIT_KIND_COUNT) shift += emit_overhead[kind];
+        }
+    }
+    return compensated;
+}
+
+static void set_categories_active(bool active) {
+    CategoryRegistry& registry = category_registry();
+    const std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.active = active;
+    registry.publish();
+}
+
+void ProfilerEngine::enable() {
+    const std::lock_guard<std::mutex> lock(control_mutex);
+    if (running && !lop_enabled) {
+        // Tables exhausted in the previous session are named and written with its enable time.
+        while (active_exhaustion_count) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        flushed = false;
+        // Offsets are a property of the machine, so they are measured only at the first enable.
+        if (tsc_skew_measurement && cpu_tsc_offsets.empty()) measure_tsc_skew();
+        record_clock_sync();
+#if LOP_STREAMING
+        {
+            const std::lock_guard<std::mutex> stream_lock(stream_mutex);
+            open_stream();
+        }
+#endif
+#if LOP_PATCH_SITES
+        patch_sites(true);
+#endif
+        {
+            const std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex);
+            lop_enabled = true;
+        }
+        scheduler_cv.notify_one();
+        set_categories_active(true);
+        
+        // Generate special event so that we can track on the trace at what point of UNIX time it was enabled.
+        emit_begin_event("lop_engine_enable");
+        time_enable = std::chrono::system_clock::now();
+        tsc_enable = _asm_fast_rdtsc();
+        emit_end_meta_event("lop_engine_enable", std::chrono::duration_cast<std::chrono::nanoseconds>(time_enable.time_since_epoch()).count());
+    }
+}
+
+void ProfilerEngine::disable() {
+    const std::lock_guard<std::mutex> lock(control_mutex);
+    if (running && lop_enabled) {
+        // Generate special event so that we can track on the trace at what point of UNIX time it was disabled.
+        emit_begin_event("lop_engine_disable");
+        auto time_disable = std::chrono::system_clock::now();
+        emit_end_meta_event("lop_engine_disable", std::chrono::duration_cast<std::chrono::nanoseconds>(time_disable.time_since_epoch()).count());
+        
+        set_categories_active(false);
+        lop_enabled = false;
+#if LOP_PATCH_SITES
+        patch_sites(false);
+#endif
+    } 
+}
+
+#if LOP_RING || LOP_STREAMING
+// Reads position in ring table consistent with wraps done meanwhile by the owning thread, which
+// increments wrap_sequence before and after the wrap. Returns number of laps done.
+static uint64_t read_ring_position(const EventBuffer* event_buffer, Event*& next_event, Event*& wrap_end) {
+    const volatile EventBuffer* buffer = event_buffer;
+    while (true) {
+        uint64_t sequence = buffer->wrap_sequence;
+        compiler_barrier();
+        next_event = buffer->next_event;
+        wrap_end = buffer->wrap_end;
+        compiler_barrier();
+        if (!(sequence & 1) && sequence == buffer->wrap_sequence) return sequence / 2;
+    }
+}
+#endif
+
+#if LOP_RING
+// Copies out the last events of given thread in chronological order while the thread keeps on
+// writing them. The ring table holds the current lap at its start and the rest of the previous lap
+// after it. Whatever got overwritten during the copy is dropped, and so are end events whose begins
+// were overwritten before. Begins that are still open are left as they are, same as in regular flush.
+static ProfilerEngine::BufferState copy_ring_buffer(const EventBuffer* event_buffer) {
+    ProfilerEngine::BufferState buffer;
+    buffer.thread_id = event_buffer->thread_id;
+    buffer.capacity = event_buffer->capacity;
+    buffer.events = allocate_event_table(buffer.capacity);
+    buffer.next_event = buffer.events;
+    if (!buffer.events) {
+        printf("Couldn't allocate ring buffer copy for thread: %" PRIx64 "\n", buffer.thread_id);
+        return buffer;
+    }
+
+    Event* table = event_buffer->events;
+    Event* next_event;
+    Event* wrap_end;
+    uint64_t laps = read_ring_position(event_buffer, next_event, wrap_end);
+    size_t previous_lap_size = (laps && next_event < wrap_end) ? wrap_end - next_event : 0;
+    size_t current_lap_size = next_event - table;
+    memcpy(buffer.events, next_event, previous_lap_size * sizeof(Event));
+    memcpy(buffer.events + previous_lap_size, table, current_lap_size * sizeof(Event));
+
+    // Owner went on from next_event during the copy, so everything from there up to its current
+    // position could be overwritten, and that's always the beginning of our copy.
+    Event* next_event_after;
+    Event* wrap_end_after;
+    uint64_t laps_after = read_ring_position(event_buffer, next_event_after, wrap_end_after);
+    size_t overwritten = previous_lap_size + current_lap_size;
+    if (laps_after == laps) {
+        overwritten = std::min<size_t>(next_event_after - next_event, previous_lap_size);
+    }
+    else if (laps_after == laps + 1 && next_event_after < next_event) {
+        overwritten = previous_lap_size + (next_event_after - table);
+    }
+    memmove(buffer.events, buffer.events + overwritten, (previous_lap_size + current_lap_size - overwritten) * sizeof(Event));
+    buffer.next_event = buffer.events + (previous_lap_size + current_lap_size - overwritten);
+
+    // Records reserved by a thread preempted in the middle of emission might be not filled yet.
+    // They still hold events from the previous lap (or zeros), older than anything we have.
+    while (buffer.next_event > buffer.events + 1 && buffer.next_event[-1].timestamp < buffer.events->timestamp) {
+        --buffer.next_event;
+    }
+
+    uint64_t depth = 0;
+    Event* output = buffer.events;
+    for (Event* position = buffer.events; position < buffer.next_event; ++position) {
+        uint32_t type = position->type & DUMP_EVENT_TYPE_MASK;
+        if (type == CALL_BEGIN || type == CALL_BEGIN_META || type == CALL_BEGIN_ARGS || type == CALL_BEGIN_SAMPLED) {
+            ++depth;
+        }
+        else if (type == CALL_END || type == CALL_END_META) {
+            if (!depth) continue;
+            --depth;
+        }
+        *output++ = *position;
+    }
+    buffer.next_event = output;
+    return buffer;
+}
+#endif
+
+#define LOP_SCHEDULER_IDLE_MS 100
+
+void ProfilerEngine::scheduler_loop()
+{
+    uint64_t exhaustion_count = 0;
+    while (g_lop_inst.scheduler_run)
+    {
+        SpareTable* exhausted = g_lop_inst.exhausted_tables.exchange(nullptr);
+
+        // Spares go first, as this is the time critical part. Threads that dropped their records for
+        // the lack of them didn't push anything, so it's done on every poll while enabled.
+        if (exhausted || lop_enabled) g_lop_inst.refill_spare_tables();
+
+        if (!exhausted)
+        {
+            // Exhaustion handler doesn't wake us up, as that would be a syscall (and often a context
+            // switch) in the middle of traced code. Thread that exhausts its table more times than it
+            // has spares before we get here drops its records. While disabled, only emit calls racing
+            // with disable can exhaust anything, so it's enough to look once in a while.
+            if (!lop_enabled && !g_lop_inst.active_exhaustion_count) {
+                std::unique_lock<std::mutex> lock(g_lop_inst.scheduler_mutex);
+                g_lop_inst.scheduler_cv.wait_for(lock, std::chrono::milliseconds(LOP_SCHEDULER_IDLE_MS), []() {
+                    return !g_lop_inst.scheduler_run || lop_enabled;
+                });
+            }
+            else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            continue;
+        }
+
+        // Stack has them newest first.
+        std::vector<SpareTable*> tables;
+        for (; exhausted; exhausted = exhausted->next) tables.push_back(exhausted);
+        std::reverse(tables.begin(), tables.end());
+
+        // Written right here, so that flushes of exhausted tables never run concurrently.
+        g_lop_inst.write_exhausted_tables(tables, ++exhaustion_count);
+    }
+}
+
+// Tops up spares of every thread to LOP_SPARE_TABLES, reusing written tables of the same capacity.
+// Spare is counted before it's pushed, see EventBuffer::spare_count.
+void ProfilerEngine::refill_spare_tables() {
+    const std::lock_guard<std::mutex> lock(buffers_mutex);
+    for (EventBuffer* event_buffer : event_buffers) {
+        while (event_buffer->spare_count < LOP_SPARE_TABLES) {
+            SpareTable* spare = nullptr;
+            auto reusable = std::find_if(spare_tables.begin(), spare_tables.end(), [event_buffer](SpareTable* table) {
+                return table->capacity == event_buffer->capacity;
+            });
+            if (reusable != spare_tables.end()) {
+                spare = *reusable;
+                spare_tables.erase(reusable);
+            }
+            else {
+                spare = new SpareTable{ allocate_event_table(event_buffer->capacity), nullptr, 0, event_buffer->capacity, nullptr };
+                if (!spare->events) {
+                    delete spare;
+                    break;
+                }
+            }
+
+            ++event_buffer->spare_count;
+            spare->next = event_buffer->spare_table.load();
+            while (!event_buffer->spare_table.compare_exchange_weak(spare->next, spare)) {}
+        }
+    }
+}
+
+// Owning thread swapped to another table before it reserved anything in the exhausted one, so all
+// its records are written already. Tables are cleared afterwards (see event_written) and kept for
+// the next refills.
+void ProfilerEngine::write_exhausted_tables(const std::vector<SpareTable*>& tables, uint64_t exhaustion_id) {
+    std::vector<BufferState> buffers;
+    for (SpareTable* table : tables) {
+        BufferState buffer;
+        buffer.events = table->events;
+        buffer.next_event = table->next_event;
+        buffer.thread_id = table->thread_id;
+        buffer.capacity = table->capacity;
+        buffers.push_back(buffer);
+    }
+
+    std::string suffix = "exh_" + std::to_string(exhaustion_id);
+    printf("saving to disk, exhaustion # %" PRIu64 "\n", exhaustion_id);
+    flush_buffers(suffix.c_str(), buffers);
+
+    for (SpareTable* table : tables) {
+        memset(table->events, 0, (table->next_event - table->events) * sizeof(Event));
+        table->next_event = nullptr;
+        table->next = nullptr;
+    }
+    spare_tables.insert(spare_tables.end(), tables.begin(), tables.end());
+
+    active_exhaustion_count -= tables.size();
+}
+
+void ProfilerEngine::prefault_loop()
+{
+    // Buffers are prefaulted in chunks, so that the mutex isn't held for too long and all threads
+    // progress evenly. Holding the mutex also guarantees that tables we touch won't be freed meanwhile.
+    const uint64_t chunk = LOP_HUGE_PAGE_SIZE / sizeof(Event);
+    while (g_lop_inst.prefault_run)
+    {
+        bool progress = false;
+        {
+            const std::lock_guard<std::mutex> lock(g_lop_inst.buffers_mutex);
+            for (EventBuffer* event_buffer : g_lop_inst.event_buffers) {
+                // Table could have been swapped by exhaustion handling.
+                if (event_buffer->prefaulted_table != event_buffer->events) {
+                    event_buffer->prefaulted_table = event_buffer->events;
+                    event_buffer->prefaulted_end = event_buffer->events;
+                }
+
+                Event* target = event_buffer->events_end + LOP_BUFFER_SLACK;
+                if (g_lop_inst.prefault == PREFAULT_WINDOW) {
+                    target = std::min(target, event_buffer->next_event + g_lop_inst.prefault_window);
+                }
+
+                // In "safer" mode thread swaps its table without the mutex, so the pointers above
+                // may already belong to the next table.
+                target = std::min(target, event_buffer->prefaulted_table + event_buffer->capacity + LOP_BUFFER_SLACK);
+
+                if (event_buffer->prefaulted_end < target) {
+                    Event* chunk_end = std::min(target, event_buffer->prefaulted_end + chunk);
+                    prefault_range(event_buffer->prefaulted_end, chunk_end);
+                    event_buffer->prefaulted_end = chunk_end;
+                    progress = true;
+                }
+            }
+        }
+
+        if (!progress) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+void ProfilerEngine::flush_buffers(const char* suffix, const std::vector<BufferState>& recorded_buffers) {
+    // We REALLY want these two to happen together.
+    compiler_barrier();
+    auto tsc_disable = _asm_fast_rdtsc();
+    auto time_disable = std::chrono::system_clock::now();
+    compiler_barrier();
+
+    refine_tsc_frequency();
+    record_clock_sync();
+
+    std::vector<std::unique_ptr<Event[]>> compensated_tables;
+    std::vector<BufferState> compensated_buffers;
+    if (overhead_compensation) compensated_buffers = compensate_overhead(recorded_buffers, compensated_tables);
+    const std::vector<BufferState>& buffers = overhead_compensation ? compensated_buffers : recorded_buffers;
+
+    uint64_t events_counter = 0;
+    for (const BufferState& buffer : buffers) {
+        uint64_t events_in_buffer = buffer.next_event - buffer.events;
+        printf("Got %" PRIu64 "/%" PRIu64 " (%" PRIu64 "%%) events in buffer of thread: %" PRIx64 "\n",
+            events_in_buffer,
+            buffer.capacity,
+            events_in_buffer * 100 / buffer.capacity,
+            buffer.thread_id);
+        events_counter += events_in_buffer;
+    }
+
+    printf("TOTAL EVENTS: %" PRIu64 "\n", events_counter);
+
+    auto pid = get_process_id();
+    double unix_time_diff_ns = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(time_disable.time_since_epoch()).count() -
+        std::chrono::duration_cast<std::chrono::nanoseconds>(time_enable.time_since_epoch()).count()
+        );
+
+    const char* extension = (format == OUTPUT_BINARY) ? "lopdump" : (format == OUTPUT_PERFETTO) ? "pftrace" : "json";
+
+    char name[200];
+    if (suffix) snprintf(name, 200, "events_pid%u_ts%" PRIu64 "_%s.%s", pid, static_cast<uint64_t>(unix_time_diff_ns / 1000), suffix, extension);
+    else        snprintf(name, 200, "events_pid%u_ts%" PRIu64 ".%s", pid, static_cast<uint64_t>(unix_time_diff_ns / 1000), extension);
 
     std::string cleaned_name(name);
     std::replace(cleaned_name.begin(), cleaned_name.end(), '/', '_');
     std::replace(cleaned_name.begin(), cleaned_name.end(), '\\', '_');
 
-    printf("Creating file: %s\n", cleaned_name.c_str()); fflush(stdout);
-    auto file = fopen(name, "w");
-    fprintf(file,"{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    printf("Creating file: %s\n", cleaned_name.c_str()); fflush(stdout);
+
+    if (format == OUTPUT_BINARY) {
+        write_binary_trace(name, buffers, tsc_disable, time_disable);
+    }
+    else if (format == OUTPUT_PERFETTO) {
+        write_perfetto_trace(name, buffers);
+    }
+    else {
+        write_json_trace(name, buffers);
+    }
+
+    if (percentile_report) {
+        std::string report_name(name, strrchr(name, '.'));
+        report_name += "_percentiles.csv";
+        printf("Creating file: %s\n", report_name.c_str()); fflush(stdout);
+        write_percentile_report(report_name.c_str(), buffers);
+    }
+}
+
+static bool write_whole(int fd, const void* data, size_t size) {
+    // Single write call is allowed to write less than requested, especially for huge tables.
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        size_t chunk = std::min<size_t>(size, 0x40000000U);
+        auto written = write_output_file(fd, bytes, chunk);
+        if (written <= 0) return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Hand-rolled JSON formatting helpers. Output of those must stay byte-compatible with what
+// printf would produce for the format strings used historically by the exporter.
+template <size_t N>
+static inline char* put_literal(char* out, const char (&literal)[N]) {
+    memcpy(out, literal, N - 1);
+    return out + N - 1;
+}
+
+static inline char* put_string(char* out, const char* string, size_t length) {
+    memcpy(out, string, length);
+    return out + length;
+}
+
+// Escaped string contents grow at most this many times (control characters become \u00XX).
+#define JSON_ESCAPE_MAX_FACTOR 6
+
+// Like put_string, but escapes quotes, backslashes and control characters. Used for everything that
+// doesn't come from a fixed literal: event names (which may be interned at runtime), categories and arguments.
+static inline char* put_json_string(char* out, const char* string, size_t length) {
+    static const char hex_digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char character = static_cast<unsigned char>(string[i]);
+        if (character == '"' || character == '\\') {
+            *out++ = '\\';
+            *out++ = static_cast<char>(character);
+        }
+        else if (character < 0x20) {
+            out = put_literal(out, "\\u00");
+            *out++ = hex_digits[character >> 4];
+            *out++ = hex_digits[character & 0xF];
+        }
+        else {
+            *out++ = static_cast<char>(character);
+        }
+    }
+    return out;
+}
+
+static inline char* put_dec(char* out, uint64_t value) {
+    return std::to_chars(out, out + 20, value).ptr;
+}
+
+static inline char* put_hex(char* out, uint64_t value) {
+    return std::to_chars(out, out + 16, value, 16).ptr;
+}
+
+// Equivalent of "%" PRIu64 ".%03" PRIu64 for microseconds with nanosecond fraction.
+static inline char* put_time(char* out, uint64_t time_ns) {
+    uint64_t fraction = time_ns % 1000;
+    out = put_dec(out, time_ns / 1000);
+    out[0] = '.';
+    out[1] = static_cast<char>('0' + fraction / 100);
+    out[2] = static_cast<char>('0' + fraction / 10 % 10);
+    out[3] = static_cast<char>('0' + fraction % 10);
+    return out + 4;
+}
+
+// Growable output buffer that is reused between chunks, so after a warmup it doesn't allocate anymore.
+struct OutputBuffer {
+    std::vector<char> storage;
+    size_t size = 0;
+
+    char* reserve(size_t bytes) {
+        if (size + bytes > storage.size()) storage.resize(std::max(storage.size() * 2, size + bytes));
+        return storage.data() + size;
+    }
+
+    void commit(char* end) { size = end - storage.data(); }
+};
+
+// Continues the name string of a record with category field of the event, if it has any.
+static inline char* put_json_category(char* out, const char* category, size_t category_length) {
+    if (!category) return out;
+    out = put_literal(out, "\",\"cat\":\"");
+    return put_json_string(out, category, category_length);
+}
+
+// Upper bound of bytes produced by single record, excluding the event name and category.
+#define JSON_RECORD_MAX_SIZE 256
+
+// Upper bound of bytes produced by single argument, excluding its name and string value.
+#define JSON_ARG_MAX_SIZE 48
+
+// Names and string values are escaped, so they are counted as if every character had to be.
+static size_t json_args_size(const EventRecord& event) {
+    size_t size = 0;
+    Event* position = event.args;
+    for (uint64_t i = 0; i < event.metadata; ++i) {
+        EventArgRecord arg;
+        position = decode_event_arg(position, arg);
+        size += JSON_ARG_MAX_SIZE + (arg.name ? strlen(arg.name) : 0) * JSON_ESCAPE_MAX_FACTOR;
+        if (arg.type == ARG_STRING && arg.value) size += strlen(reinterpret_cast<const char*>(arg.value)) * JSON_ESCAPE_MAX_FACTOR;
+    }
+    return size;
+}
+
+// Arguments of events with arguments, as members of "args" object.
+static char* put_json_args(char* out, const EventRecord& event) {
+    Event* position = event.args;
+    for (uint64_t i = 0; i < event.metadata; ++i) {
+        EventArgRecord arg;
+        position = decode_event_arg(position, arg);
+        if (i) *out++ = ',';
+        *out++ = '"';
+        if (arg.name) out = put_json_string(out, arg.name, strlen(arg.name));
+        out = put_literal(out, "\":");
+
+        if (arg.type == ARG_INT && static_cast<int64_t>(arg.value) < 0) {
+            *out++ = '-';
+            out = put_dec(out, 0 - arg.value);
+        }
+        else if (arg.type == ARG_INT || arg.type == ARG_UINT) {
+            out = put_dec(out, arg.value);
+        }
+        else if (arg.type == ARG_DOUBLE) {
+            double number;
+            memcpy(&number, &arg.value, sizeof(number));
+            if (std::isfinite(number)) {
+                out = std::to_chars(out, out + 32, number).ptr;
+            }
+            else {
+                *out++ = '"';
+                out = std::to_chars(out, out + 32, number).ptr;
+                *out++ = '"';
+            }
+        }
+        else if (arg.type == ARG_STRING && arg.value) {
+            const char* value = reinterpret_cast<const char*>(arg.value);
+            *out++ = '"';
+            out = put_json_string(out, value, strlen(value));
+            *out++ = '"';
+        }
+        else if (arg.type == ARG_POINTER) {
+            out = put_literal(out, "\"0x");
+            out = put_hex(out, arg.value);
+            *out++ = '"';
+        }
+        else {
+            out = put_literal(out, "null");
+        }
+    }
+    return out;
+}
+
+// Events are serialized in slices of this many events, each slice by a single worker.
+#define JSON_SLICE_EVENTS 0x40000U
+
+struct JsonSlice {
+    const ProfilerEngine::BufferState* buffer;
+    Event* begin;
+    Event* end;
+};
+
+// Serializes events of single slice. Every record starts with ',' separator, the very first one in
+// the whole file is replaced with ' ' at write time. Returns false on unknown event type.
+static bool serialize_json_slice(const JsonSlice& slice, unsigned pid, const ClockMapping& clock,
+                                 const EventCategories& categories, OutputBuffer& output, std::vector<EventRecord>& counter_events) {
+    // This part is common for all records of given thread, so format it only once.
+    char prefix[64];
+    char* prefix_end = put_literal(prefix, ",{\"tid\":\"");
+    prefix_end = put_hex(prefix_end, slice.buffer->thread_id);
+    prefix_end = put_literal(prefix_end, "\",\"pid\":");
+    prefix_end = put_dec(prefix_end, pid);
+    prefix_end = put_literal(prefix_end, ",\"ts\":");
+    size_t prefix_length = prefix_end - prefix;
+
+    output.size = 0;
+    size_t clock_segment = 0;
+#if LOP_CPU_ID
+    // Slices of the same thread continue where the previous one ended.
+    uint32_t last_tsc_aux = (slice.begin > slice.buffer->events) ? slice.begin[-1].tsc_aux : slice.begin->tsc_aux;
+#endif
+    for (Event* position = slice.begin; position < slice.end;) {
+        EventRecord event;
+        position = decode_event(position, event);
+
+        auto time_ns = clock.time_ns(event.timestamp, clock_segment, tsc_aux_cpu(event.tsc_aux));
+
+#if LOP_CPU_ID
+        if (event.tsc_aux != last_tsc_aux) {
+            char* out = output.reserve(JSON_RECORD_MAX_SIZE);
+            out = put_string(out, prefix, prefix_length);
+            out = put_time(out, time_ns);
+            out = put_literal(out, ",\"name\":\"migration\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"from\":");
+            out = put_dec(out, tsc_aux_cpu(last_tsc_aux));
+            out = put_literal(out, ",\"to\":");
+            out = put_dec(out, tsc_aux_cpu(event.tsc_aux));
+            out = put_literal(out, ",\"from_node\":");
+            out = put_dec(out, tsc_aux_node(last_tsc_aux));
+            out = put_literal(out, ",\"to_node\":");
+            out = put_dec(out, tsc_aux_node(event.tsc_aux));
+            out = put_literal(out, "}}\n");
+            output.commit(out);
+            last_tsc_aux = event.tsc_aux;
+        }
+#endif
+
+        if (event.type == COUNTER_INT) {
+            // Counters are sorted and written at the very end, see write_json_trace.
+            counter_events.push_back(event);
+            continue;
+        }
+
+        if (event.type > ARG_POINTER) {
+            return false;
+        }
+
+        // Arguments of an event cut off in ring mode.
+        if (is_argument_record(event.type)) continue;
+
+        bool flow = (event.type == FLOW_START || event.type == FLOW_FINISH);
+        size_t name_length = flow ? 0 : strlen(event.name);
+        const char* category = flow ? nullptr : find_event_category(categories, event.name);
+        size_t category_length = category ? strlen(category) : 0;
+        size_t args_size = (event.type == CALL_BEGIN_ARGS) ? json_args_size(event) : 0;
+        char* out = output.reserve(JSON_RECORD_MAX_SIZE + (name_length + category_length) * JSON_ESCAPE_MAX_FACTOR + args_size);
+        out = put_string(out, prefix, prefix_length);
+        out = put_time(out, time_ns);
+
+        if (event.type == CALL_BEGIN || event.type == CALL_END) {
+            out = put_literal(out, ",\"name\":\"");
+            out = put_json_string(out, event.name, name_length);
+            out = put_json_category(out, category, category_length);
+            out = (event.type == CALL_BEGIN) ? put_literal(out, "\",\"ph\":\"B\"}\n") : put_literal(out, "\",\"ph\":\"E\"}\n");
+        }
+        else if (event.type == CALL_BEGIN_META || event.type == CALL_END_META) {
+            out = put_literal(out, ",\"name\":\"");
+            out = put_json_string(out, event.name, name_length);
+            out = put_json_category(out, category, category_length);
+            out = (event.type == CALL_BEGIN_META) ? put_literal(out, "\",\"ph\":\"B\",\"args\":{\"b_meta\":\"")
+                                                   : put_literal(out, "\",\"ph\":\"E\",\"args\":{\"e_meta\":\"");
+            out = put_hex(out, event.metadata);
+            out = put_literal(out, "\"}}\n");
+        }
+        else if (event.type == CALL_BEGIN_ARGS) {
+            out = put_literal(out, ",\"name\":\"");
+            out = put_json_string(out, event.name, name_length);
+            out = put_json_category(out, category, category_length);
+            out = put_literal(out, "\",\"ph\":\"B\",\"args\":{");
+            out = put_json_args(out, event);
+            out = put_literal(out, "}}\n");
+        }
+        else {
+            uint32_t truncated_flow_id = (uint32_t)event.metadata; // perfetto supports only 32bit flow IDs.
+            out = (event.type == FLOW_START) ? put_literal(out, ",\"name\":\"flow\",\"ph\":\"s\",\"bp\":\"e\",\"id\":")
+                                              : put_literal(out, ",\"name\":\"flow\",\"ph\":\"f\",\"bp\":\"e\",\"id\":");
+            out = put_dec(out, truncated_flow_id);
+            out = put_literal(out, ",\"args\":{\"flow_id\":\"");
+            out = put_hex(out, event.metadata);
+            out = put_literal(out, "\"}}\n");
+        }
+
+        output.commit(out);
+    }
+
+    return true;
+}
+
+void ProfilerEngine::write_json_trace(const char* file_name, const std::vector<BufferState>& buffers) {
+    auto serialization_start = std::chrono::steady_clock::now();
+    unsigned pid = get_process_id();
+
+    int fd = open_output_file(file_name);
+    if (fd < 0) {
+        printf("Couldn't create file: %s\n", file_name);
+        return;
+    }
+
+    static const char json_header[] = "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    bool success = write_whole(fd, json_header, sizeof(json_header) - 1);
+
+    ClockMapping clock = clock_mapping(find_first_timestamp(buffers));
+    EventCategories categories = snapshot_event_categories();
+
+    // Split all buffers into slices. Slices are serialized in parallel, each into private memory
+    // of its worker, and then written to the file strictly in order, so the output is exactly
+    // the same as if it was serialized sequentially.
+    std::vector<JsonSlice> slices;
+    uint64_t events_counter = 0;
+    for (const BufferState& buffer : buffers) {
+        // Records can have different sizes, so slices must be cut at event boundaries.
+        Event* slice_begin = buffer.events;
+        uint64_t slice_events = 0;
+        for (Event* position = buffer.events; position < buffer.next_event;) {
+            EventRecord event;
+            position = decode_event(position, event);
+            if (++slice_events == JSON_SLICE_EVENTS || position >= buffer.next_event) {
+                slices.push_back({ &buffer, slice_begin, position });
+                events_counter += slice_events;
+                slice_begin = position;
+                slice_events = 0;
+            }
+        }
+    }
+
+    std::vector<std::vector<EventRecord>> slice_counter_events(slices.size());
+    std::atomic<size_t> next_slice(0);
+    std::atomic<bool> failed(false);
+    size_t slice_to_write = 0;
+    bool first_event = true;
+    std::mutex write_mutex;
+    std::condition_variable write_turn;
+
+    auto worker = [&]() {
+        OutputBuffer output;
+        for (size_t slice_id = next_slice++; slice_id < slices.size(); slice_id = next_slice++) {
+            bool serialized = !failed && serialize_json_slice(slices[slice_id], pid, clock,
+                                                              categories, output, slice_counter_events[slice_id]);
+
+            std::unique_lock<std::mutex> lock(write_mutex);
+            write_turn.wait(lock, [&]() { return slice_to_write == slice_id; });
+            if (!serialized) {
+                failed = true;
+            }
+            else if (!failed && output.size > 0) {
+                if (first_event) output.storage[0] = ' ';
+                first_event = false;
+                if (!write_whole(fd, output.storage.data(), output.size)) failed = true;
+            }
+            ++slice_to_write;
+            write_turn.notify_all();
+        }
+    };
+
+    size_t workers_count = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()), slices.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < workers_count; ++i) workers.emplace_back(worker);
+    worker();
+    for (auto& worker_thread : workers) worker_thread.join();
+
+    if (failed) {
+        printf("Unknown event type or write failure. Bailing out.\n");
+        close_output_file(fd);
+        return;
+    }
+
+    // Sort COUNTER_INT events using ordered map and write them at the end.
+    // Chrome tracing requires that they are sorted by timestamps, otherwise it glitches.
+    // And no, that "feature" is not documented anywhere.
+    std::map<uint64_t, EventRecord> COUNTER_events;
+    for (const auto& counter_events : slice_counter_events) {
+        for (const EventRecord& event : counter_events) COUNTER_events.insert({ event.timestamp, event });
+    }
+
+    OutputBuffer output;
+    size_t clock_segment = 0;
+    for (const auto& [timestamp, event] : COUNTER_events) {
+        auto time_ns = clock.time_ns(timestamp, clock_segment, tsc_aux_cpu(event.tsc_aux));
+        size_t name_length = strlen(event.name);
+        const char* category = find_event_category(categories, event.name);
+        size_t category_length = category ? strlen(category) : 0;
+
+        char* out = output.reserve(JSON_RECORD_MAX_SIZE + (name_length + category_length) * JSON_ESCAPE_MAX_FACTOR);
+        *out++ = first_event ? ' ' : ',';
+        out = put_literal(out, "{\"pid\": ");
+        out = put_dec(out, pid);
+        out = put_literal(out, ",\"ts\":");
+        out = put_time(out, time_ns);
+        out = put_literal(out, ",\"name\":\"");
+        out = put_json_string(out, event.name, name_length);
+        out = put_json_category(out, category, category_length);
+        out = put_literal(out, "\",\"ph\":\"C\",\"args\":{\"val\":");
+        out = put_dec(out, event.metadata);
+        out = put_literal(out, "}}\n");
+        output.commit(out);
+
+        first_event = false;
+    }
+
+#if LOP_CPU_ID
+    // Every CPU gets its own track with the threads that ran on it.
+    uint32_t last_cpu = std::numeric_limits<uint32_t>::max();
+    for (const CpuResidency& residency : collect_cpu_residencies(buffers)) {
+        uint32_t cpu = tsc_aux_cpu(residency.tsc_aux);
+        char* out = output.reserve(JSON_RECORD_MAX_SIZE * 2);
+        if (cpu != last_cpu) {
+            *out++ = first_event ? ' ' : ',';
+            out = put_literal(out, "{\"pid\":");
+            out = put_dec(out, pid);
+            out = put_literal(out, ",\"tid\":\"cpu ");
+            out = put_dec(out, cpu);
+            out = put_literal(out, "\",\"name\":\"thread_name\",\"ph\":\"M\",\"args\":{\"name\":\"CPU ");
+            out = put_dec(out, cpu);
+            out = put_literal(out, "\"}}\n");
+            first_event = false;
+            last_cpu = cpu;
+        }
+
+        size_t begin_segment = 0;
+        size_t end_segment = 0;
+        uint64_t begin_ns = clock.time_ns(residency.begin, begin_segment, cpu);
+        uint64_t end_ns = clock.time_ns(residency.end, end_segment, cpu);
+        *out++ = first_event ? ' ' : ',';
+        out = put_literal(out, "{\"pid\":");
+        out = put_dec(out, pid);
+        out = put_literal(out, ",\"tid\":\"cpu ");
+        out = put_dec(out, cpu);
+        out = put_literal(out, "\",\"ts\":");
+        out = put_time(out, begin_ns);
+        out = put_literal(out, ",\"dur\":");
+        out = put_time(out, end_ns - begin_ns);
+        out = put_literal(out, ",\"name\":\"");
+        out = put_hex(out, residency.thread_id);
+        out = put_literal(out, "\",\"ph\":\"X\",\"args\":{\"node\":");
+        out = put_dec(out, tsc_aux_node(residency.tsc_aux));
+        out = put_literal(out, "}}\n");
+        output.commit(out);
+        first_event = false;
+    }
+#endif
+
+    char* out = output.reserve(2);
+    output.commit(put_literal(out, "]}"));
+    success = success && write_whole(fd, output.storage.data(), output.size);
+    if (!success) printf("Couldn't write whole trace to file: %s\n", file_name);
+    close_output_file(fd);
+
+    double serialization_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - serialization_start).count();
+    printf("Serialized %" PRIu64 " events in %.3f ms using %zu threads (%.2f M events/s)\n",
+        events_counter, serialization_s * 1000.0, workers_count, events_counter / serialization_s / 1000000.0);
+}
+
+// Minimal protobuf encoding helpers for the Perfetto exporter, so we don't need to depend
+// on protobuf library. Field numbers come from perfetto/protos/perfetto/trace/*.proto.
+#define PROTO_VARINT  0
+#define PROTO_FIXED64 1
+#define PROTO_BYTES   2
+
+// Trace
+#define PF_TRACE_PACKET                     1
+// TracePacket
+#define PF_PACKET_CLOCK_SNAPSHOT            6
+#define PF_PACKET_TIMESTAMP                 8
+#define PF_PACKET_SEQUENCE_ID               10
+#define PF_PACKET_TRACK_EVENT               11
+#define PF_PACKET_INTERNED_DATA             12
+#define PF_PACKET_SEQUENCE_FLAGS            13
+#define PF_PACKET_DEFAULTS                  59
+#define PF_PACKET_TRACK_DESCRIPTOR          60
+// TracePacketDefaults
+#define PF_DEFAULTS_TIMESTAMP_CLOCK_ID      58
+#define PF_DEFAULTS_TRACK_EVENT             11
+// TrackEventDefaults
+#define PF_EVENT_DEFAULTS_TRACK_UUID        11
+// ClockSnapshot and ClockSnapshot.Clock
+#define PF_SNAPSHOT_CLOCKS                  1
+#define PF_CLOCK_ID                         1
+#define PF_CLOCK_TIMESTAMP                  2
+#define PF_CLOCK_IS_INCREMENTAL             3
+// InternedData and EventName
+#define PF_INTERNED_EVENT_NAMES             2
+#define PF_EVENT_NAME_IID                   1
+#define PF_EVENT_NAME_NAME                  2
+// TrackDescriptor, ProcessDescriptor, ThreadDescriptor
+#define PF_TRACK_UUID                       1
+#define PF_TRACK_NAME                       2
+#define PF_TRACK_PROCESS                    3
+#define PF_TRACK_THREAD                     4
+#define PF_TRACK_PARENT_UUID                5
+#define PF_TRACK_COUNTER                    8
+#define PF_PROCESS_PID                      1
+#define PF_PROCESS_NAME                     6
+#define PF_THREAD_PID                       1
+#define PF_THREAD_TID                       2
+#define PF_THREAD_NAME                      5
+// TrackEvent and DebugAnnotation
+#define PF_EVENT_DEBUG_ANNOTATIONS          4
+#define PF_EVENT_TYPE                       9
+#define PF_EVENT_CATEGORIES                 22
+#define PF_EVENT_NAME                       23
+#define PF_EVENT_NAME_IID_FIELD             10
+#define PF_EVENT_TRACK_UUID                 11
+#define PF_EVENT_COUNTER_VALUE              30
+#define PF_EVENT_FLOW_IDS                   47
+#define PF_EVENT_TERMINATING_FLOW_IDS       48
+#define PF_ANNOTATION_UINT_VALUE            3
+#define PF_ANNOTATION_INT_VALUE             4
+#define PF_ANNOTATION_DOUBLE_VALUE          5
+#define PF_ANNOTATION_STRING_VALUE          6
+#define PF_ANNOTATION_POINTER_VALUE         7
+#define PF_ANNOTATION_NAME                  10
+
+#define PF_TYPE_SLICE_BEGIN                 1
+#define PF_TYPE_SLICE_END                   2
+#define PF_TYPE_INSTANT                     3
+#define PF_TYPE_COUNTER                     4
+#define PF_SEQ_INCREMENTAL_STATE_CLEARED    1
+#define PF_SEQ_NEEDS_INCREMENTAL_STATE      2
+#define PF_CLOCK_BOOTTIME                   6
+#define PF_CLOCK_INCREMENTAL                64
+
+// Upper bound of bytes produced by a single event packet, excluding the interned event name.
+#define PF_PACKET_MAX_SIZE 160
+
+// Events are streamed to the file whenever this many bytes are gathered.
+#define PF_WRITE_THRESHOLD 0x1000000U
+
+static inline char* put_varint(char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<char>(value);
+    return out;
+}
+
+static inline char* put_varint_field(char* out, uint32_t field, uint64_t value) {
+    out = put_varint(out, (field << 3) | PROTO_VARINT);
+    return put_varint(out, value);
+}
+
+static inline char* put_fixed64_field(char* out, uint32_t field, uint64_t value) {
+    out = put_varint(out, (field << 3) | PROTO_FIXED64);
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+}
+
+static inline char* put_bytes_field(char* out, uint32_t field, const char* data, size_t length) {
+    out = put_varint(out, (field << 3) | PROTO_BYTES);
+    out = put_varint(out, length);
+    return put_string(out, data, length);
+}
+
+// Nested messages are built in a scratch area first, because protobuf needs the length up front.
+static inline char* put_message_field(char* out, uint32_t field, const char* message, const char* message_end) {
+    return put_bytes_field(out, field, message, message_end - message);
+}
+
+struct PerfettoThreadState {
+    uint64_t sequence_id;
+    uint64_t last_time_ns = 0;
+    uint64_t next_name_iid = 1;
+    std::unordered_map<const char*, uint64_t> name_iids;
+};
 
-    // Find first event, timewise.
-    uint64_t tsc_base = std::numeric_limits<uint64_t>::max();
+static char* put_perfetto_packet(char* out, const char* packet, const char* packet_end) {
+    return put_message_field(out, PF_TRACE_PACKET, packet, packet_end);
+}
+
+#if LOP_CPU_ID
+static char* put_uint_annotation(char* out, const char* name, uint64_t value) {
+    char annotation[64];
+    char* annotation_end = put_bytes_field(annotation, PF_ANNOTATION_NAME, name, strlen(name));
+    annotation_end = put_varint_field(annotation_end, PF_ANNOTATION_UINT_VALUE, value);
+    return put_message_field(out, PF_EVENT_DEBUG_ANNOTATIONS, annotation, annotation_end);
+}
+#endif
+
+// Arguments of events with arguments, as debug annotations. Storage is for building the annotations
+// and holds at least twice the size of json_args_size of the event.
+static char* put_args_annotations(char* out, const EventRecord& event, char* storage) {
+    Event* position = event.args;
+    for (uint64_t i = 0; i < event.metadata; ++i) {
+        EventArgRecord arg;
+        position = decode_event_arg(position, arg);
+        char* annotation_end = put_bytes_field(storage, PF_ANNOTATION_NAME, arg.name ? arg.name : "", arg.name ? strlen(arg.name) : 0);
+        switch (arg.type) {
+            case ARG_INT:     annotation_end = put_varint_field(annotation_end, PF_ANNOTATION_INT_VALUE, arg.value); break;
+            case ARG_UINT:    annotation_end = put_varint_field(annotation_end, PF_ANNOTATION_UINT_VALUE, arg.value); break;
+            case ARG_DOUBLE:  annotation_end = put_fixed64_field(annotation_end, PF_ANNOTATION_DOUBLE_VALUE, arg.value); break;
+            case ARG_POINTER: annotation_end = put_varint_field(annotation_end, PF_ANNOTATION_POINTER_VALUE, arg.value); break;
+            default: {
+                const char* value = reinterpret_cast<const char*>(arg.value);
+                annotation_end = put_bytes_field(annotation_end, PF_ANNOTATION_STRING_VALUE, value ? value : "", value ? strlen(value) : 0);
+                break;
+            }
+        }
+        out = put_message_field(out, PF_EVENT_DEBUG_ANNOTATIONS, storage, annotation_end);
+    }
+    return out;
+}
+
+void ProfilerEngine::write_perfetto_trace(const char* file_name, const std::vector<BufferState>& buffers) {
+    unsigned pid = get_process_id();
+
+    int fd = open_output_file(file_name);
+    if (fd < 0) {
+        printf("Couldn't create file: %s\n", file_name);
+        return;
+    }
+
+    ClockMapping clock = clock_mapping(find_first_timestamp(buffers));
+    EventCategories categories = snapshot_event_categories();
+
+    // Track UUIDs only need to be unique inside of the trace.
+    const uint64_t process_uuid = 1;
+    const uint64_t thread_uuid_base = 0x1000;
+    const uint64_t counter_uuid_base = 0x100000;
+    std::unordered_map<const char*, uint64_t> counter_uuids;
+
+    OutputBuffer output;
+    std::vector<char> scratch_storage(0x1000);
+    bool success = true;
+
+    // Process track, everything else is parented to it.
+    {
+        char* scratch = scratch_storage.data();
+        char* process = put_varint_field(scratch, PF_PROCESS_PID, pid);
+        process = put_bytes_field(process, PF_PROCESS_NAME, "LOP", 3);
+        char* track = put_varint_field(process, PF_TRACK_UUID, process_uuid);
+        track = put_message_field(track, PF_TRACK_PROCESS, scratch, process);
+        char* packet = put_varint_field(track, PF_PACKET_SEQUENCE_ID, buffers.size() + 1);
+        packet = put_message_field(packet, PF_PACKET_TRACK_DESCRIPTOR, process, track);
+
+        char* out = output.reserve(PF_PACKET_MAX_SIZE);
+        output.commit(put_perfetto_packet(out, track, packet));
+    }
+
+    for (size_t buffer_id = 0; buffer_id < buffers.size(); ++buffer_id) {
+        const BufferState& buffer = buffers[buffer_id];
+        PerfettoThreadState state;
+        state.sequence_id = buffer_id + 1;
+        uint64_t thread_uuid = thread_uuid_base + buffer_id;
+
+        // Each thread gets its own packet sequence with its own interning state and incremental clock,
+        // so every event only carries a small name ID and a short timestamp delta.
+        {
+            char* scratch = scratch_storage.data();
+            char* clock = put_varint_field(scratch, PF_CLOCK_ID, PF_CLOCK_INCREMENTAL);
+            clock = put_varint_field(clock, PF_CLOCK_TIMESTAMP, 0);
+            clock = put_varint_field(clock, PF_CLOCK_IS_INCREMENTAL, 1);
+            char* base_clock = put_varint_field(clock, PF_CLOCK_ID, PF_CLOCK_BOOTTIME);
+            base_clock = put_varint_field(base_clock, PF_CLOCK_TIMESTAMP, 0);
+            char* snapshot = put_message_field(base_clock, PF_SNAPSHOT_CLOCKS, scratch, clock);
+            snapshot = put_message_field(snapshot, PF_SNAPSHOT_CLOCKS, clock, base_clock);
+            char* event_defaults = put_varint_field(snapshot, PF_EVENT_DEFAULTS_TRACK_UUID, thread_uuid);
+            char* defaults = put_varint_field(event_defaults, PF_DEFAULTS_TIMESTAMP_CLOCK_ID, PF_CLOCK_INCREMENTAL);
+            defaults = put_message_field(defaults, PF_DEFAULTS_TRACK_EVENT, snapshot, event_defaults);
+            char* packet = put_varint_field(defaults, PF_PACKET_SEQUENCE_ID, state.sequence_id);
+            packet = put_varint_field(packet, PF_PACKET_SEQUENCE_FLAGS, PF_SEQ_INCREMENTAL_STATE_CLEARED);
+            packet = put_message_field(packet, PF_PACKET_DEFAULTS, event_defaults, defaults);
+            packet = put_message_field(packet, PF_PACKET_CLOCK_SNAPSHOT, base_clock, snapshot);
+
+            char* out = output.reserve(PF_PACKET_MAX_SIZE * 2);
+            output.commit(put_perfetto_packet(out, defaults, packet));
+
+            char thread_name[20];
+            char* thread_name_end = put_hex(thread_name, buffer.thread_id);
+            char* thread = put_varint_field(scratch, PF_THREAD_PID, pid);
+            thread = put_varint_field(thread, PF_THREAD_TID, buffer_id + 1);
+            thread = put_bytes_field(thread, PF_THREAD_NAME, thread_name, thread_name_end - thread_name);
+            char* track = put_varint_field(thread, PF_TRACK_UUID, thread_uuid);
+            track = put_varint_field(track, PF_TRACK_PARENT_UUID, process_uuid);
+            track = put_message_field(track, PF_TRACK_THREAD, scratch, thread);
+            packet = put_varint_field(track, PF_PACKET_SEQUENCE_ID, state.sequence_id);
+            packet = put_varint_field(packet, PF_PACKET_SEQUENCE_FLAGS, PF_SEQ_NEEDS_INCREMENTAL_STATE);
+            packet = put_message_field(packet, PF_PACKET_TRACK_DESCRIPTOR, thread, track);
+
+            out = output.reserve(PF_PACKET_MAX_SIZE);
+            output.commit(put_perfetto_packet(out, track, packet));
+        }
+
+        size_t clock_segment = 0;
+#if LOP_CPU_ID
+        uint32_t last_tsc_aux = (buffer.events < buffer.next_event) ? buffer.events->tsc_aux : 0;
+#endif
+        for (Event* position = buffer.events; position < buffer.next_event;) {
+            EventRecord event;
+            position = decode_event(position, event);
+
+            if (event.type > ARG_POINTER) {
+                printf("Unknown event type. Bailing out.\n");
+                close_output_file(fd);
+                return;
+            }
+
+            // Flow markers are attached to the enclosing slice begin (same as "bp":"e" in JSON).
+            // Arguments records are handled with their event, unless it was cut off in ring mode.
+            if (event.type == FLOW_START || event.type == FLOW_FINISH || is_argument_record(event.type)) continue;
+
+            auto time_ns = clock.time_ns(event.timestamp, clock_segment, tsc_aux_cpu(event.tsc_aux));
+            // Timestamps on single thread might go slightly back after migration to core with skewed TSC.
+            if (time_ns < state.last_time_ns) time_ns = state.last_time_ns;
+
+#if LOP_CPU_ID
+            if (event.tsc_aux != last_tsc_aux) {
+                char migration[PF_PACKET_MAX_SIZE];
+                char* migration_end = put_varint_field(migration, PF_EVENT_TYPE, PF_TYPE_INSTANT);
+                migration_end = put_bytes_field(migration_end, PF_EVENT_NAME, "migration", 9);
+                migration_end = put_uint_annotation(migration_end, "from", tsc_aux_cpu(last_tsc_aux));
+                migration_end = put_uint_annotation(migration_end, "to", tsc_aux_cpu(event.tsc_aux));
+                migration_end = put_uint_annotation(migration_end, "from_node", tsc_aux_node(last_tsc_aux));
+                migration_end = put_uint_annotation(migration_end, "to_node", tsc_aux_node(event.tsc_aux));
+                char* packet = migration_end;
+                char* packet_end = put_varint_field(packet, PF_PACKET_TIMESTAMP, time_ns - state.last_time_ns);
+                packet_end = put_varint_field(packet_end, PF_PACKET_SEQUENCE_ID, state.sequence_id);
+                packet_end = put_varint_field(packet_end, PF_PACKET_SEQUENCE_FLAGS, PF_SEQ_NEEDS_INCREMENTAL_STATE);
+                packet_end = put_message_field(packet_end, PF_PACKET_TRACK_EVENT, migration, migration_end);
+
+                char* out = output.reserve(PF_PACKET_MAX_SIZE * 2);
+                output.commit(put_perfetto_packet(out, packet, packet_end));
+                state.last_time_ns = time_ns;
+                last_tsc_aux = event.tsc_aux;
+            }
+#endif
+
+            size_t name_length = strlen(event.name);
+            const char* category = find_event_category(categories, event.name);
+            size_t category_length = category ? strlen(category) : 0;
+            size_t args_size = (event.type == CALL_BEGIN_ARGS) ? json_args_size(event) : 0;
+            size_t scratch_size = PF_PACKET_MAX_SIZE * 4 + (name_length + category_length) * 4 + args_size * 6;
+            if (scratch_storage.size() < scratch_size) scratch_storage.resize(scratch_size);
+            char* scratch = scratch_storage.data();
+
+            // Counters get their own track per name, described once when seen for the first time.
+            uint64_t counter_uuid = 0;
+            if (event.type == COUNTER_INT) {
+                auto counter = counter_uuids.find(event.name);
+                if (counter == counter_uuids.end()) {
+                    counter_uuid = counter_uuid_base + counter_uuids.size();
+                    counter_uuids.insert({ event.name, counter_uuid });
+
+                    char* track = put_varint_field(scratch, PF_TRACK_UUID, counter_uuid);
+                    track = put_varint_field(track, PF_TRACK_PARENT_UUID, process_uuid);
+                    track = put_bytes_field(track, PF_TRACK_NAME, event.name, name_length);
+                    track = put_bytes_field(track, PF_TRACK_COUNTER, "", 0);
+                    char* packet = put_varint_field(track, PF_PACKET_SEQUENCE_ID, state.sequence_id);
+                    packet = put_message_field(packet, PF_PACKET_TRACK_DESCRIPTOR, scratch, track);
+
+                    char* out = output.reserve(PF_PACKET_MAX_SIZE + name_length);
+                    output.commit(put_perfetto_packet(out, track, packet));
+                }
+                else {
+                    counter_uuid = counter->second;
+                }
+            }
+
+            // Intern the name on first use in this sequence.
+            char* interned_data = scratch;
+            char* interned_data_end = scratch;
+            uint64_t name_iid = 0;
+            if (event.type != COUNTER_INT) {
+                auto iid = state.name_iids.find(event.name);
+                if (iid == state.name_iids.end()) {
+                    name_iid = state.next_name_iid++;
+                    state.name_iids.insert({ event.name, name_iid });
+
+                    char* event_name = put_varint_field(scratch, PF_EVENT_NAME_IID, name_iid);
+                    event_name = put_bytes_field(event_name, PF_EVENT_NAME_NAME, event.name, name_length);
+                    interned_data = event_name;
+                    interned_data_end = put_message_field(interned_data, PF_INTERNED_EVENT_NAMES, scratch, event_name);
+                }
+                else {
+                    name_iid = iid->second;
+                }
+            }
+
+            char* track_event = interned_data_end;
+            char* track_event_end = track_event;
+            if (category) track_event_end = put_bytes_field(track_event_end, PF_EVENT_CATEGORIES, category, category_length);
+            if (event.type == COUNTER_INT) {
+                track_event_end = put_varint_field(track_event_end, PF_EVENT_TYPE, PF_TYPE_COUNTER);
+                track_event_end = put_varint_field(track_event_end, PF_EVENT_TRACK_UUID, counter_uuid);
+                track_event_end = put_varint_field(track_event_end, PF_EVENT_COUNTER_VALUE, event.metadata);
+            }
+            else {
+                bool begin = (event.type == CALL_BEGIN || event.type == CALL_BEGIN_META || event.type == CALL_BEGIN_ARGS);
+                track_event_end = put_varint_field(track_event_end, PF_EVENT_TYPE, begin ? PF_TYPE_SLICE_BEGIN : PF_TYPE_SLICE_END);
+                track_event_end = put_varint_field(track_event_end, PF_EVENT_NAME_IID_FIELD, name_iid);
+
+                if (event.type == CALL_BEGIN_META || event.type == CALL_END_META) {
+                    char annotation[64];
+                    char value[20];
+                    char* value_end = put_hex(value, event.metadata);
+                    char* annotation_end = put_bytes_field(annotation, PF_ANNOTATION_NAME, begin ? "b_meta" : "e_meta", 6);
+                    annotation_end = put_bytes_field(annotation_end, PF_ANNOTATION_STRING_VALUE, value, value_end - value);
+                    track_event_end = put_message_field(track_event_end, PF_EVENT_DEBUG_ANNOTATIONS, annotation, annotation_end);
+                }
+                else if (event.type == CALL_BEGIN_ARGS) {
+                    // Annotations are built at the end of scratch, away from the packet being built.
+                    track_event_end = put_args_annotations(track_event_end, event, scratch + scratch_size - args_size * 2);
+                }
+
+                if (event.type == CALL_BEGIN_META && position < buffer.next_event) {
+                    EventRecord flow_event;
+                    decode_event(position, flow_event);
+                    if (flow_event.type == FLOW_START || flow_event.type == FLOW_FINISH) {
+                        uint32_t truncated_flow_id = (uint32_t)flow_event.metadata; // keep it consistent with JSON exporter.
+                        uint32_t flow_field = (flow_event.type == FLOW_START) ? PF_EVENT_FLOW_IDS : PF_EVENT_TERMINATING_FLOW_IDS;
+                        track_event_end = put_fixed64_field(track_event_end, flow_field, truncated_flow_id);
+                    }
+                }
+            }
+
+            char* packet = track_event_end;
+            char* packet_end = put_varint_field(packet, PF_PACKET_TIMESTAMP, time_ns - state.last_time_ns);
+            packet_end = put_varint_field(packet_end, PF_PACKET_SEQUENCE_ID, state.sequence_id);
+            packet_end = put_varint_field(packet_end, PF_PACKET_SEQUENCE_FLAGS, PF_SEQ_NEEDS_INCREMENTAL_STATE);
+            if (interned_data_end != interned_data) {
+                packet_end = put_message_field(packet_end, PF_PACKET_INTERNED_DATA, interned_data, interned_data_end);
+            }
+            packet_end = put_message_field(packet_end, PF_PACKET_TRACK_EVENT, track_event, track_event_end);
+
+            char* out = output.reserve(PF_PACKET_MAX_SIZE + (packet_end - packet));
+            output.commit(put_perfetto_packet(out, packet, packet_end));
+
+            state.last_time_ns = time_ns;
+
+            if (output.size >= PF_WRITE_THRESHOLD) {
+                success = success && write_whole(fd, output.storage.data(), output.size);
+                output.size = 0;
+            }
+        }
+    }
+
+#if LOP_CPU_ID
+    // Every CPU gets its own track with the threads that ran on it, all in one more sequence. It has no
+    // incremental clock, so timestamps are absolute, same as the ones of the other sequences.
+    {
+        const uint64_t cpu_uuid_base = 0x200000;
+        uint64_t sequence_id = buffers.size() + 2;
+        uint32_t last_cpu = std::numeric_limits<uint32_t>::max();
+        size_t clock_segment = 0;
+        char* scratch = scratch_storage.data();
+
+        auto put_slice_event = [&](uint64_t type, uint64_t track_uuid, uint64_t time_ns, const char* name, size_t name_length, uint32_t tsc_aux) {
+            char* track_event = scratch;
+            char* track_event_end = put_varint_field(track_event, PF_EVENT_TYPE, type);
+            track_event_end = put_varint_field(track_event_end, PF_EVENT_TRACK_UUID, track_uuid);
+            if (name) {
+                track_event_end = put_bytes_field(track_event_end, PF_EVENT_NAME, name, name_length);
+                track_event_end = put_uint_annotation(track_event_end, "node", tsc_aux_node(tsc_aux));
+            }
+            char* packet = track_event_end;
+            char* packet_end = put_varint_field(packet, PF_PACKET_TIMESTAMP, time_ns);
+            packet_end = put_varint_field(packet_end, PF_PACKET_SEQUENCE_ID, sequence_id);
+            packet_end = put_message_field(packet_end, PF_PACKET_TRACK_EVENT, track_event, track_event_end);
+
+            char* out = output.reserve(PF_PACKET_MAX_SIZE * 2);
+            output.commit(put_perfetto_packet(out, packet, packet_end));
+        };
+
+        for (const CpuResidency& residency : collect_cpu_residencies(buffers)) {
+            uint32_t cpu = tsc_aux_cpu(residency.tsc_aux);
+            uint64_t track_uuid = cpu_uuid_base + cpu;
+            uint64_t begin_ns = clock.time_ns(residency.begin, clock_segment, cpu);
+            uint64_t end_ns = clock.time_ns(residency.end, clock_segment, cpu);
+
+            if (cpu != last_cpu) {
+                char track_name[16];
+                char* track_name_end = put_dec(put_literal(track_name, "CPU "), cpu);
+                char* track = put_varint_field(scratch, PF_TRACK_UUID, track_uuid);
+                track = put_varint_field(track, PF_TRACK_PARENT_UUID, process_uuid);
+                track = put_bytes_field(track, PF_TRACK_NAME, track_name, track_name_end - track_name);
+                char* packet = put_varint_field(track, PF_PACKET_SEQUENCE_ID, sequence_id);
+                packet = put_message_field(packet, PF_PACKET_TRACK_DESCRIPTOR, scratch, track);
+
+                char* out = output.reserve(PF_PACKET_MAX_SIZE);
+                output.commit(put_perfetto_packet(out, track, packet));
+                last_cpu = cpu;
+            }
+
+            char thread_name[20];
+            char* thread_name_end = put_hex(thread_name, residency.thread_id);
+            put_slice_event(PF_TYPE_SLICE_BEGIN, track_uuid, begin_ns, thread_name, thread_name_end - thread_name, residency.tsc_aux);
+            put_slice_event(PF_TYPE_SLICE_END, track_uuid, end_ns, nullptr, 0, 0);
+        }
+    }
+#endif
+
+    success = success && write_whole(fd, output.storage.data(), output.size);
+    if (!success) printf("Couldn't write whole trace to file: %s\n", file_name);
+    close_output_file(fd);
+}
+
+static void append_bytes(std::vector<char>& output, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    output.insert(output.end(), bytes, bytes + size);
+}
+
+// String record of given event name, followed by category record if the event has category.
+static void append_name_records(std::vector<char>& output, const char* event_name, const EventCategories& categories) {
+    uint64_t name_pointer = reinterpret_cast<uint64_t>(event_name);
+    uint64_t name_length = strlen(event_name);
+    DumpRecord record = { DUMP_RECORD_STRING, 0, sizeof(name_pointer) + name_length };
+    append_bytes(output, &record, sizeof(record));
+    append_bytes(output, &name_pointer, sizeof(name_pointer));
+    append_bytes(output, event_name, name_length);
+
+    const char* category = find_event_category(categories, event_name);
+    if (category) {
+        uint64_t category_length = strlen(category);
+        DumpRecord category_record = { DUMP_RECORD_CATEGORY, 0, sizeof(name_pointer) + category_length };
+        append_bytes(output, &category_record, sizeof(category_record));
+        append_bytes(output, &name_pointer, sizeof(name_pointer));
+        append_bytes(output, category, category_length);
+    }
+}
+
+void ProfilerEngine::write_binary_trace(const char* file_name, const std::vector<BufferState>& buffers,
+                                        uint64_t tsc_disable, std::chrono::system_clock::time_point time_disable) {
+#if !LOP_COMPACT_EVENTS
+    static_assert(sizeof(Event) == sizeof(DumpEvent), "Dump event layout must match in-memory event layout.");
+#endif
+    static_assert(sizeof(ClockSync) == sizeof(DumpClockSync), "Dump sync point layout must match in-memory one.");
+
+    int fd = open_output_file(file_name);
+    if (fd < 0) {
+        printf("Couldn't create file: %s\n", file_name);
+        return;
+    }
+
+    DumpHeader header = {};
+    memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+    header.version = DUMP_VERSION;
+    header.event_size = sizeof(Event);
+    header.pid = get_process_id();
+    header.tsc_enable = tsc_enable;
+    header.tsc_disable = tsc_disable;
+    header.time_enable_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time_enable.time_since_epoch()).count();
+    header.time_disable_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time_disable.time_since_epoch()).count();
+
+    // Build the string table. Name pointers usually repeat a lot, so every name is stored only once.
+    // Flow markers don't carry any name (asm emitters leave it uninitialized), so skip them.
+    std::unordered_set<const char*> names;
     for (const BufferState& buffer : buffers) {
-        Event* event = buffer.events;
-        for (; event < buffer.next_event; ++event)
-            if (event->timestamp < tsc_base) tsc_base = event->timestamp;
+        for (Event* position = buffer.events; position < buffer.next_event;) {
+            EventRecord event;
+            position = decode_event(position, event);
+            if (event.type != FLOW_START && event.type != FLOW_FINISH) names.insert(event.name);
+            for_each_arg_string(event, [&names](const char* string) { names.insert(string); });
+        }
     }
 
-    if (unix_time_diff_ns > 1000000000.0) {
-        // For long (>1s) profiling sessions, overhead from start/end timestamp measurements is small enough that
-        // if we base our frequency on those measurements, it will bring more accurate results than hacky estimation
-        // code in the constructor.
-        double tsc_ticks = static_cast<double>(tsc_disable - tsc_enable);
-        ticks_per_ns_ratio = tsc_ticks / unix_time_diff_ns;
-        printf("Long run detected. Will use frequency measured over time.\n");
-        printf("Measured %f ticks per nanosecond\n", ticks_per_ns_ratio);
+    EventCategories categories = snapshot_event_categories();
+    std::vector<char> string_table;
+    for (const char* event_name : names) append_name_records(string_table, event_name, categories);
+
+    std::vector<ClockSync> syncs;
+    std::vector<int64_t> cpu_offsets;
+    {
+        const std::lock_guard<std::mutex> lock(clock_sync_mutex);
+        header.ticks_per_ns_ratio = ticks_per_ns_ratio;
+        syncs.assign(clock_syncs, clock_syncs + clock_sync_count);
+        cpu_offsets = cpu_tsc_offsets;
     }
-    bool first_event = true;
-    std::map<uint64_t, Event*> COUNTER_events;
+    DumpRecord sync_record = { DUMP_RECORD_CLOCK_SYNC, 0, syncs.size() * sizeof(ClockSync) };
+
+    bool success = write_whole(fd, &header, sizeof(header));
+    success = success && write_whole(fd, &sync_record, sizeof(sync_record));
+    success = success && write_whole(fd, syncs.data(), syncs.size() * sizeof(ClockSync));
+#if LOP_CPU_ID
+    DumpRecord cpu_record = { DUMP_RECORD_CPU_IDS, 0, cpu_offsets.size() * sizeof(int64_t) };
+    success = success && write_whole(fd, &cpu_record, sizeof(cpu_record));
+    success = success && write_whole(fd, cpu_offsets.data(), cpu_offsets.size() * sizeof(int64_t));
+#endif
+    success = success && write_whole(fd, string_table.data(), string_table.size());
+
+    // Thread tables go to the disk as they are, in one big write each.
     for (const BufferState& buffer : buffers) {
-        Event* event = buffer.events;
-        uint64_t event_thread_id = buffer.thread_id;
-        for (; event < buffer.next_event; ++event) {
-            auto tsc_diff = event->timestamp - tsc_base;
-            auto time_ns = static_cast<uint64_t>(static_cast<double>(tsc_diff) / ticks_per_ns_ratio);
-
-            if (event->type == COUNTER_INT) {
-                // Sort COUNTER_INT events in the meantime using ordered map and process them later.
-                // Chrome tracing requires that they are sorted by timestamps, otherwise it glitches.
-                // And no, that "feature" is not documented anywhere.
-                COUNTER_events.insert({ event->timestamp, event });
-            }
-            else if (event->type == CALL_BEGIN || event->type == CALL_END) {
-                const char* eventPh = (event->type == CALL_BEGIN) ? "B" : "E";
-                fprintf(file,
-                    "%c{"
-                    "\"tid\":\"%" PRIx64 "\","
-                    "\"pid\":%u,"
-                    "\"ts\":%" PRIu64 ".%03" PRIu64 ","
-                    "\"name\":\"%s\","
-                    "\"ph\":\"%s\""
-                    "}\n",
-                    first_event ? ' ' : ',', event_thread_id, pid, time_ns / 1000, time_ns % 1000, event->name, eventPh);
-            }
-            else if (event->type == CALL_BEGIN_META || event->type == CALL_END_META) {
-                const char* eventPh = (event->type == CALL_BEGIN_META) ? "B" : "E";
-                const char* metaName = (event->type == CALL_BEGIN_META) ? "b_meta" : "e_meta";
-                fprintf(file,
-                    "%c{"
-                    "\"tid\":\"%" PRIx64 "\","
-                    "\"pid\":%u,"
-                    "\"ts\":%" PRIu64 ".%03" PRIu64 ","
-                    "\"name\":\"%s\","
-                    "\"ph\":\"%s\","
-                    "\"args\":{"
-                    "\"%s\":\"%" PRIx64 "\""
-                    "}"
-                    "}\n",
-                    first_event ? ' ' : ',', event_thread_id, pid, time_ns / 1000, time_ns % 1000, event->name, eventPh, metaName, event->metadata);
-            }
-            else if (event->type == FLOW_START || event->type == FLOW_FINISH) {
-                const char* eventPh = (event->type == FLOW_START) ? "s" : "f";
-                uint32_t truncated_flow_id = (uint32_t)event->metadata; // perfetto supports only 32bit flow IDs.
-                fprintf(file,
-                    "%c{"
-                    "\"tid\":\"%" PRIx64 "\","
-                    "\"pid\":%u,"
-                    "\"ts\":%" PRIu64 ".%03" PRIu64 ","
-                    "\"name\":\"flow\","
-                    "\"ph\":\"%s\","
-                    "\"bp\":\"e\","
-                    "\"id\":%" PRIu32 ","
-                    "\"args\":{"
-                    "\"flow_id\":\"%" PRIx64 "\""
-                    "}"
-                    "}\n",
-                    first_event ? ' ' : ',', event_thread_id, pid, time_ns / 1000, time_ns % 1000, eventPh, truncated_flow_id, event->metadata);
+        uint64_t thread_info[2] = { buffer.thread_id, static_cast<uint64_t>(buffer.next_event - buffer.events) };
+        DumpRecord record = { DUMP_RECORD_THREAD, 0, sizeof(thread_info) + thread_info[1] * sizeof(Event) };
+
+        success = success && write_whole(fd, &record, sizeof(record));
+        success = success && write_whole(fd, thread_info, sizeof(thread_info));
+        success = success && write_whole(fd, buffer.events, thread_info[1] * sizeof(Event));
+    }
+
+    DumpRecord end_record = { DUMP_RECORD_END, 0, 0 };
+    success = success && write_whole(fd, &end_record, sizeof(end_record));
+
+    if (!success) printf("Couldn't write whole binary trace to file: %s\n", file_name);
+    close_output_file(fd);
+}
+
+// Latency histogram of the percentile report, HDR style. Durations below 2^(LOP_HISTOGRAM_SUB_BITS+1)
+// nanoseconds have a bucket each, every higher power of two is split into 2^LOP_HISTOGRAM_SUB_BITS buckets,
+// so reported values are within ~3% of the real ones.
+#define LOP_HISTOGRAM_SUB_BITS 5
+#define LOP_HISTOGRAM_BUCKETS ((65 - LOP_HISTOGRAM_SUB_BITS) << LOP_HISTOGRAM_SUB_BITS)
+
+struct LatencyHistogram {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t min_ns = UINT64_MAX;
+    uint64_t max_ns = 0;
+    uint64_t buckets[LOP_HISTOGRAM_BUCKETS] = {};
+
+    void merge(const LatencyHistogram& other) {
+        count += other.count;
+        total_ns += other.total_ns;
+        min_ns = std::min(min_ns, other.min_ns);
+        max_ns = std::max(max_ns, other.max_ns);
+        for (uint32_t bucket = 0; bucket < LOP_HISTOGRAM_BUCKETS; ++bucket) buckets[bucket] += other.buckets[bucket];
+    }
+
+    // Highest duration that falls into the bucket holding given fraction of samples, capped by the maximum.
+    uint64_t percentile_ns(double fraction) const {
+        uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(count))), 1);
+        uint64_t seen = 0;
+        for (uint32_t bucket = 0; bucket < LOP_HISTOGRAM_BUCKETS; ++bucket) {
+            seen += buckets[bucket];
+            if (seen >= rank) return std::min(histogram_bucket_upper(bucket), max_ns);
+        }
+        return max_ns;
+    }
+
+    static uint64_t histogram_bucket_upper(uint32_t bucket) {
+        if (bucket < (2U << LOP_HISTOGRAM_SUB_BITS)) return bucket;
+        uint32_t shift = (bucket >> LOP_HISTOGRAM_SUB_BITS) - 1;
+        uint64_t top = bucket - (static_cast<uint64_t>(shift) << LOP_HISTOGRAM_SUB_BITS);
+        return ((top + 1) << shift) - 1;
+    }
+};
+
+static inline uint32_t histogram_bucket(uint64_t duration_ns) {
+#if defined(_WIN32) || defined(_WIN64)
+    unsigned long highest_bit;
+    _BitScanReverse64(&highest_bit, duration_ns | 1);
+#else
+    uint32_t highest_bit = 63 - __builtin_clzll(duration_ns | 1);
+#endif
+    uint32_t shift = std::max<int32_t>(static_cast<int32_t>(highest_bit) - LOP_HISTOGRAM_SUB_BITS, 0);
+    return (shift << LOP_HISTOGRAM_SUB_BITS) + static_cast<uint32_t>(duration_ns >> shift);
+}
+
+// Pairs begins with ends of single thread, end closes the latest open scope like on the trace.
+// Scopes left open at the end of the table are not counted. Output is kept flat, so that the
+// bucket computation after it runs over plain arrays. Both ends are mapped through the same clock
+// as the trace, so durations match it. Weight of sampled scopes is taken from metadata of their begin event.
+static void pair_scopes(const ProfilerEngine::BufferState& buffer, const ClockMapping& clock,
+                        std::vector<const char*>& names, std::vector<uint64_t>& durations, std::vector<uint64_t>& weights) {
+    struct OpenScope {
+        const char* name;
+        uint64_t time_ns;
+        uint64_t weight;
+    };
+    std::vector<OpenScope> open_scopes;
+    size_t clock_segment = 0;
+    for (Event* position = buffer.events; position < buffer.next_event;) {
+        EventRecord event;
+        position = decode_event(position, event);
+        if (event.type == CALL_BEGIN || event.type == CALL_BEGIN_META || event.type == CALL_BEGIN_ARGS) {
+            uint64_t time_ns = clock.time_ns(event.timestamp, clock_segment, tsc_aux_cpu(event.tsc_aux));
+            open_scopes.push_back({ event.name, time_ns, (event.sampled && event.metadata) ? event.metadata : 1 });
+        }
+        else if ((event.type == CALL_END || event.type == CALL_END_META) && !open_scopes.empty()) {
+            const OpenScope& scope = open_scopes.back();
+            uint64_t time_ns = clock.time_ns(event.timestamp, clock_segment, tsc_aux_cpu(event.tsc_aux));
+            names.push_back(scope.name);
+            durations.push_back(time_ns > scope.time_ns ? time_ns - scope.time_ns : 0);
+            weights.push_back(scope.weight);
+            open_scopes.pop_back();
+        }
+    }
+}
+
+// Writes per-name duration percentiles of begin/end pairs of all given buffers to CSV file, sorted
+// by total time. Buffers are processed in parallel, each worker into its own histograms.
+void ProfilerEngine::write_percentile_report(const char* file_name, const std::vector<BufferState>& buffers) {
+    typedef std::unordered_map<const char*, LatencyHistogram> Histograms;
+    std::vector<Histograms> worker_histograms;
+    std::atomic<size_t> next_buffer(0);
+    ClockMapping clock = clock_mapping(find_first_timestamp(buffers));
+
+    auto worker = [&](Histograms& histograms) {
+        std::vector<const char*> names;
+        std::vector<uint64_t> durations;
+        std::vector<uint64_t> weights;
+        std::vector<uint32_t> buckets;
+        for (size_t buffer_id = next_buffer++; buffer_id < buffers.size(); buffer_id = next_buffer++) {
+            names.clear();
+            durations.clear();
+            weights.clear();
+            pair_scopes(buffers[buffer_id], clock, names, durations, weights);
+
+            buckets.resize(durations.size());
+            for (size_t i = 0; i < durations.size(); ++i) buckets[i] = histogram_bucket(durations[i]);
+
+            // Scopes of the same name tend to come in runs, so the lookup is skipped for them.
+            const char* last_name = nullptr;
+            LatencyHistogram* histogram = nullptr;
+            for (size_t i = 0; i < durations.size(); ++i) {
+                if (names[i] != last_name || !histogram) {
+                    last_name = names[i];
+                    histogram = &histograms[last_name];
+                }
+                histogram->count += weights[i];
+                histogram->total_ns += durations[i] * weights[i];
+                histogram->min_ns = std::min(histogram->min_ns, durations[i]);
+                histogram->max_ns = std::max(histogram->max_ns, durations[i]);
+                histogram->buckets[buckets[i]] += weights[i];
+            }
+        }
+    };
+
+    size_t workers_count = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()), std::max<size_t>(buffers.size(), 1));
+    worker_histograms.resize(workers_count);
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < workers_count; ++i) workers.emplace_back(worker, std::ref(worker_histograms[i]));
+    worker(worker_histograms[0]);
+    for (auto& worker_thread : workers) worker_thread.join();
+
+    // Same name can come from different pointers.
+    std::map<std::string, LatencyHistogram> merged;
+    for (const Histograms& histograms : worker_histograms) {
+        for (const auto& named_histogram : histograms) merged[named_histogram.first].merge(named_histogram.second);
+    }
+
+    std::vector<const std::pair<const std::string, LatencyHistogram>*> sorted;
+    for (const auto& named_histogram : merged) sorted.push_back(&named_histogram);
+    std::stable_sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) {
+        return a->second.total_ns > b->second.total_ns;
+    });
+
+    std::string output = "name,count,total_ns,mean_ns,min_ns,p50_ns,p90_ns,p99_ns,p99.9_ns,max_ns\n";
+    char line[256];
+    for (const auto* named_histogram : sorted) {
+        // Function signatures have commas, so names are always quoted.
+        output += '"';
+        for (char character : named_histogram->first) {
+            if (character == '"') output += '"';
+            output += character;
+        }
+
+        const LatencyHistogram& histogram = named_histogram->second;
+        snprintf(line, sizeof(line), "\",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+            histogram.count, histogram.total_ns, histogram.total_ns / histogram.count, histogram.min_ns,
+            histogram.percentile_ns(0.5), histogram.percentile_ns(0.9), histogram.percentile_ns(0.99),
+            histogram.percentile_ns(0.999), histogram.max_ns);
+        output += line;
+    }
+
+    int fd = open_output_file(file_name);
+    if (fd < 0) {
+        printf("Couldn't create file: %s\n", file_name);
+        return;
+    }
+    if (!write_whole(fd, output.data(), output.size())) printf("Couldn't write whole percentile report to file: %s\n", file_name);
+    close_output_file(fd);
+}
+
+#if LOP_STREAMING
+// Called by emitters when the thread reaches events_end. At the end of the table the thread wraps to
+// its start, drain thread is in the same lap then, so it's done with the start already. Then the new
+// events_end is set right before the drain position (emit call writes at most LOP_BUFFER_SLACK records
+// past it, same as past the end of the table), or the thread waits until the drain thread moves on.
+void ProfilerEngine::wait_for_stream_space(EventBuffer* event_buffer) {
+    Event* table_end = event_buffer->events + event_buffer->capacity;
+    if (event_buffer->next_event >= table_end) {
+        ++event_buffer->wrap_sequence;
+        compiler_barrier();
+        event_buffer->wrap_end = event_buffer->next_event;
+        event_buffer->next_event = event_buffer->events;
+        compiler_barrier();
+        ++event_buffer->wrap_sequence;
+    }
+
+    const volatile EventBuffer* buffer = event_buffer;
+    for (uint32_t attempt = 0;; ++attempt) {
+        // Drain thread moves drain_event before drain_laps, so reading them the other way around
+        // can only underestimate the space.
+        uint64_t drain_laps = buffer->drain_laps;
+        compiler_barrier();
+        Event* drain_event = buffer->drain_event;
+        compiler_barrier();
+
+        if (drain_laps == event_buffer->wrap_sequence / 2) {
+            event_buffer->events_end = table_end;
+            return;
+        }
+        if (drain_event > event_buffer->next_event + LOP_BUFFER_SLACK) {
+            event_buffer->events_end = drain_event - LOP_BUFFER_SLACK;
+            return;
+        }
+
+        if (!attempt) {
+            ++stream_waits;
+            stream_wakeup = true;
+            stream_cv.notify_one();
+        }
+        if (attempt < 64) std::this_thread::yield();
+        else              std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+void ProfilerEngine::stream_loop() {
+    std::unique_lock<std::mutex> lock(g_lop_inst.stream_mutex);
+    while (g_lop_inst.stream_run) {
+        g_lop_inst.stream_cv.wait_for(lock, std::chrono::milliseconds(g_lop_inst.stream_interval_ms), []() {
+            return g_lop_inst.stream_wakeup || !g_lop_inst.stream_run;
+        });
+        g_lop_inst.stream_wakeup = false;
+        g_lop_inst.drain_streams();
+    }
+}
+
+// Stream is a regular binary dump, just with many thread records per thread and sync points spread
+// all over it. Header is rewritten at the end with the final TSC frequency. Caller holds stream_mutex.
+void ProfilerEngine::open_stream() {
+    if (stream_fd >= 0) return;
+
+    snprintf(stream_name, sizeof(stream_name), "events_pid%u_stream%" PRIu64 ".lopdump", get_process_id(), ++stream_count);
+    stream_fd = open_output_file(stream_name);
+    if (stream_fd < 0) {
+        printf("Couldn't create file: %s, events will be dropped.\n", stream_name);
+        return;
+    }
+    printf("Streaming events to: %s\n", stream_name); fflush(stdout);
+
+    compiler_barrier();
+    uint64_t tsc_open = _asm_fast_rdtsc();
+    auto time_open = std::chrono::system_clock::now();
+    compiler_barrier();
+
+    stream_header = {};
+    memcpy(stream_header.magic, DUMP_MAGIC, sizeof(stream_header.magic));
+    stream_header.version = DUMP_VERSION;
+    stream_header.event_size = sizeof(Event);
+    stream_header.pid = get_process_id();
+    stream_header.tsc_enable = tsc_open;
+    stream_header.tsc_disable = tsc_open;
+    stream_header.time_enable_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time_open.time_since_epoch()).count();
+    stream_header.time_disable_ns = stream_header.time_enable_ns;
+    stream_header.ticks_per_ns_ratio = ticks_per_ns_ratio;
+
+    stream_success = write_whole(stream_fd, &stream_header, sizeof(stream_header));
+#if LOP_CPU_ID
+    DumpRecord cpu_record = { DUMP_RECORD_CPU_IDS, 0, cpu_tsc_offsets.size() * sizeof(int64_t) };
+    stream_success = stream_success && write_whole(stream_fd, &cpu_record, sizeof(cpu_record));
+    stream_success = stream_success && write_whole(stream_fd, cpu_tsc_offsets.data(), cpu_tsc_offsets.size() * sizeof(int64_t));
+#endif
+    stream_records = 0;
+    stream_waits = 0;
+    stream_sync_tsc = 0;
+    stream_names.clear();
+    append_stream_clock_syncs();
+}
+
+// Caller holds stream_mutex, but not buffers_mutex, so that new threads can get their buffers
+// meanwhile. Buffers can't go away under our hands, only drained ones are given to new threads.
+void ProfilerEngine::drain_streams() {
+    std::vector<EventBuffer*> stream_buffers;
+    {
+        const std::lock_guard<std::mutex> lock(buffers_mutex);
+        stream_buffers.assign(event_buffers.begin(), event_buffers.end());
+        for (CustomTLS* custom_tls_entry : retired_buffers) stream_buffers.push_back(&custom_tls_entry->event_buffer);
+    }
+
+    for (EventBuffer* event_buffer : stream_buffers) drain_stream_buffer(event_buffer);
+
+    {
+        const std::lock_guard<std::mutex> lock(buffers_mutex);
+        for (auto entry = retired_buffers.begin(); entry != retired_buffers.end();) {
+            const EventBuffer& event_buffer = (*entry)->event_buffer;
+            if (event_buffer.drain_laps == event_buffer.wrap_sequence / 2 && event_buffer.drain_event == event_buffer.next_event) {
+                free_buffers.push_back(*entry);
+                entry = retired_buffers.erase(entry);
             }
             else {
-                printf("Unknown event type. Bailing out.\n");
-                return;
+                ++entry;
+            }
+        }
+    }
+
+    if (stream_fd >= 0) append_stream_clock_syncs();
+}
+
+// Appends everything the owning thread has written since the last call. Thread wraps only from
+// an emit call, so once it's in the next lap, the previous one is complete.
+uint64_t ProfilerEngine::drain_stream_buffer(EventBuffer* event_buffer) {
+    if (!event_buffer->events) return 0;
+
+    Event* next_event;
+    Event* wrap_end;
+    uint64_t laps = read_ring_position(event_buffer, next_event, wrap_end);
+    uint64_t drained = 0;
+    if (laps != event_buffer->drain_laps) {
+        drained += append_stream_range(event_buffer, event_buffer->drain_event, wrap_end);
+        if (event_buffer->drain_event != wrap_end) return drained;
+
+        event_buffer->drain_event = event_buffer->events;
+        compiler_barrier();
+        event_buffer->drain_laps = laps;
+    }
+    return drained + append_stream_range(event_buffer, event_buffer->drain_event, next_event);
+}
+
+// Appends written records from the start of given range, up to the first one that is reserved by
+// emit call which isn't done yet. They are zeroed afterwards (see event_written) and given back to
+// the owning thread. Without stream file they are just dropped.
+uint64_t ProfilerEngine::append_stream_range(EventBuffer* event_buffer, Event* begin, Event* end) {
+    Event* written_end = begin;
+    while (written_end < end && event_written(written_end)) ++written_end;
+    compiler_barrier();
+    uint64_t count = written_end - begin;
+    if (!count) return 0;
+
+    if (stream_fd >= 0 && stream_success) {
+        // Names go before the events, so that the stream is complete at any point.
+        stream_staging.clear();
+        EventCategories categories;
+        bool categories_taken = false;
+        auto append_name = [&](const char* name) {
+            if (!stream_names.insert(name).second) return;
+            if (!categories_taken) {
+                categories = snapshot_event_categories();
+                categories_taken = true;
+            }
+            append_name_records(stream_staging, name, categories);
+        };
+        // Argument records carry argument name in the name slot, string values need extra care.
+        for (Event* position = begin; position < written_end; ++position) {
+            if (position->type == ARG_STRING && position->metadata) append_name(reinterpret_cast<const char*>(position->metadata));
+            if (position->type == FLOW_START || position->type == FLOW_FINISH || !position->name) continue;
+            append_name(position->name);
+        }
+
+        uint64_t thread_info[2] = { event_buffer->thread_id, count };
+        DumpRecord record = { DUMP_RECORD_THREAD, 0, sizeof(thread_info) + count * sizeof(Event) };
+        append_bytes(stream_staging, &record, sizeof(record));
+        append_bytes(stream_staging, thread_info, sizeof(thread_info));
+
+        stream_success = write_whole(stream_fd, stream_staging.data(), stream_staging.size()) &&
+                         write_whole(stream_fd, begin, count * sizeof(Event));
+        if (!stream_success) printf("Couldn't write to file: %s, events will be dropped.\n", stream_name);
+        stream_records += count;
+    }
+
+    memset(begin, 0, count * sizeof(Event));
+    compiler_barrier();
+    event_buffer->drain_event = written_end;
+    return count;
+}
+
+// Sync points taken since the last call. Converter sorts them, so they can go anywhere in the stream.
+void ProfilerEngine::append_stream_clock_syncs() {
+    std::vector<ClockSync> syncs;
+    {
+        const std::lock_guard<std::mutex> lock(clock_sync_mutex);
+        for (uint32_t i = 0; i < clock_sync_count; ++i) {
+            if (clock_syncs[i].tsc > stream_sync_tsc) syncs.push_back(clock_syncs[i]);
+        }
+    }
+    if (syncs.empty() || !stream_success) return;
+
+    for (const ClockSync& sync : syncs) stream_sync_tsc = std::max(stream_sync_tsc, sync.tsc);
+    DumpRecord sync_record = { DUMP_RECORD_CLOCK_SYNC, 0, syncs.size() * sizeof(ClockSync) };
+    stream_success = write_whole(stream_fd, &sync_record, sizeof(sync_record)) &&
+                     write_whole(stream_fd, syncs.data(), syncs.size() * sizeof(ClockSync));
+}
+
+// Caller holds stream_mutex and has drained all buffers.
+void ProfilerEngine::close_stream() {
+    if (stream_fd < 0) return;
+
+    refine_tsc_frequency();
+    record_clock_sync();
+    append_stream_clock_syncs();
+
+    compiler_barrier();
+    stream_header.tsc_disable = _asm_fast_rdtsc();
+    auto time_close = std::chrono::system_clock::now();
+    compiler_barrier();
+    stream_header.time_disable_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time_close.time_since_epoch()).count();
+    stream_header.ticks_per_ns_ratio = ticks_per_ns_ratio;
+
+    DumpRecord end_record = { DUMP_RECORD_END, 0, 0 };
+    stream_success = stream_success && write_whole(stream_fd, &end_record, sizeof(end_record));
+    stream_success = stream_success && seek_output_file(stream_fd, 0) == 0 && write_whole(stream_fd, &stream_header, sizeof(stream_header));
+    close_output_file(stream_fd);
+    stream_fd = -1;
+
+    printf("Streamed %" PRIu64 " events to: %s, threads waited for the drain thread %" PRIu64 " times\n",
+        stream_records, stream_name, stream_waits.load());
+    if (!stream_success) printf("Couldn't write whole stream to file: %s\n", stream_name);
+}
+#endif
+
+void ProfilerEngine::install_crash_handler() {
+#if defined(_WIN32) || defined(_WIN64)
+    printf("Crash dumps are not supported on Windows.\n");
+#else
+    // Signal handler can use only async-signal-safe calls, so file, string set and staging buffer
+    // are all prepared here. File is removed by the destructor if nothing crashed.
+    snprintf(crash_dump_name, sizeof(crash_dump_name), "events_pid%u_crash.lopdump", get_process_id());
+    crash_dump_fd = open_output_file(crash_dump_name);
+    if (crash_dump_fd < 0) {
+        printf("Couldn't create file: %s\n", crash_dump_name);
+        return;
+    }
+    crash_dump_names = new const char* [CRASH_DUMP_NAMES_SIZE]();
+    crash_dump_staging = new char[CRASH_DUMP_STAGING_SIZE];
+
+    struct sigaction action = {};
+    action.sa_handler = crash_signal_handler;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    for (int signal_number : { SIGSEGV, SIGABRT, SIGBUS, SIGFPE }) {
+        sigaction(signal_number, &action, nullptr);
+    }
+    printf("Crash dumps will be written to: %s\n", crash_dump_name);
+#endif
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+// Small records are gathered in preallocated buffer, so that crash dump doesn't do a syscall
+// for every name. Event tables go to the file directly.
+struct CrashDumpWriter {
+    int fd;
+    char* staging;
+    size_t used = 0;
+    bool success = true;
+
+    void flush() {
+        success = success && write_whole(fd, staging, used);
+        used = 0;
+    }
+
+    void append(const void* data, size_t size) {
+        if (used + size > CRASH_DUMP_STAGING_SIZE) flush();
+        if (size > CRASH_DUMP_STAGING_SIZE) {
+            success = success && write_whole(fd, data, size);
+            return;
+        }
+        memcpy(staging + used, data, size);
+        used += size;
+    }
+};
+
+void ProfilerEngine::crash_signal_handler(int signal_number) {
+    // Only the first crashing thread writes the dump.
+    if (!g_lop_inst.crash_dump_written.exchange(true)) {
+        g_lop_inst.write_crash_dump();
+    }
+
+    // Handler was installed with SA_RESETHAND, so this ends the process as it would without us.
+    raise(signal_number);
+}
+
+void ProfilerEngine::write_crash_dump() {
+    // Other threads keep emitting meanwhile and we can't take buffers_mutex here, so we just hope
+    // that no thread is starting or finishing right now. Unlike in flush, the dump is written
+    // exactly as it is in memory and converter deals with the rest.
+    compiler_barrier();
+    uint64_t tsc_crash = _asm_fast_rdtsc();
+    struct timespec time_crash;
+    clock_gettime(CLOCK_REALTIME, &time_crash);
+    compiler_barrier();
+
+    DumpHeader header = {};
+    memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+    header.version = DUMP_VERSION;
+    header.event_size = sizeof(Event);
+    header.pid = get_process_id();
+    header.tsc_enable = tsc_enable;
+    header.tsc_disable = tsc_crash;
+    header.time_enable_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time_enable.time_since_epoch()).count();
+    header.time_disable_ns = static_cast<int64_t>(time_crash.tv_sec) * 1000000000 + time_crash.tv_nsec;
+    header.ticks_per_ns_ratio = ticks_per_ns_ratio;
+
+    // Same as in refine_tsc_frequency, but there is no time to wait for better measurement.
+    struct timespec steady_crash;
+    clock_gettime(CLOCK_MONOTONIC, &steady_crash);
+    int64_t measured_ns = static_cast<int64_t>(steady_crash.tv_sec) * 1000000000 + steady_crash.tv_nsec - time_startup_ns;
+    if (measured_ns > LOP_TSC_LONG_MEASUREMENT_NS || (!tsc_frequency_reported && measured_ns > 0)) {
+        header.ticks_per_ns_ratio = static_cast<double>(tsc_crash - tsc_startup) / static_cast<double>(measured_ns);
+    }
+
+    CrashDumpWriter writer = { crash_dump_fd, crash_dump_staging };
+    writer.append(&header, sizeof(header));
+
+    // Sync points might be just thinned out by other thread, converter drops the ones out of order.
+    uint32_t sync_count = clock_sync_count;
+    ClockSync crash_sync = { tsc_crash, time_startup_ns + measured_ns };
+    DumpRecord sync_record = { DUMP_RECORD_CLOCK_SYNC, 0, (sync_count + 1) * sizeof(ClockSync) };
+    writer.append(&sync_record, sizeof(sync_record));
+    writer.append(clock_syncs, sync_count * sizeof(ClockSync));
+    writer.append(&crash_sync, sizeof(crash_sync));
+#if LOP_CPU_ID
+    DumpRecord cpu_record = { DUMP_RECORD_CPU_IDS, 0, cpu_tsc_offsets.size() * sizeof(int64_t) };
+    writer.append(&cpu_record, sizeof(cpu_record));
+    writer.append(cpu_tsc_offsets.data(), cpu_tsc_offsets.size() * sizeof(int64_t));
+#endif
+
+    auto dump_buffer = [this, &writer](EventBuffer* event_buffer) {
+        Event* events = event_buffer->events;
+        Event* next_event = event_buffer->next_event;
+        if (!events) return;
+
+        // Without "safer" mode nothing stops emitters at the end of the table.
+        next_event = std::min(next_event, event_buffer->events_end + LOP_BUFFER_SLACK);
+
+        // In ring mode rest of the older lap follows the current one in the table, and goes first.
+        // In streaming mode only what the drain thread didn't append to the stream yet is dumped.
+        Event* wrap_end = next_event;
+        Event* older_begin = next_event;
+        Event* current_begin = events;
+#if LOP_RING
+        if (event_buffer->wrap_end > next_event) wrap_end = event_buffer->wrap_end;
+#elif LOP_STREAMING
+        if (event_buffer->drain_laps != event_buffer->wrap_sequence / 2) {
+            wrap_end = event_buffer->wrap_end;
+            older_begin = event_buffer->drain_event;
+        }
+        else {
+            current_begin = event_buffer->drain_event;
+        }
+#endif
+        uint64_t thread_info[2] = { event_buffer->thread_id, static_cast<uint64_t>((wrap_end - older_begin) + (next_event - current_begin)) };
+        DumpRecord record = { DUMP_RECORD_THREAD, 0, sizeof(thread_info) + thread_info[1] * sizeof(Event) };
+        writer.append(&record, sizeof(record));
+        writer.append(&thread_info, sizeof(thread_info));
+        writer.flush();
+        writer.success = writer.success && write_whole(crash_dump_fd, older_begin, (wrap_end - older_begin) * sizeof(Event));
+        writer.success = writer.success && write_whole(crash_dump_fd, current_begin, (next_event - current_begin) * sizeof(Event));
+
+        // Names are deduplicated in open addressing set. When it's full, remaining names are just
+        // written every time, converter doesn't mind duplicates. Drained records are zeroed, so
+        // they are skipped.
+        auto dump_name = [this, &writer](const char* name) {
+            uint64_t slot = (reinterpret_cast<uint64_t>(name) * 0x9E3779B97F4A7C15ULL) >> 48;
+            uint64_t probes = 0;
+            while (crash_dump_names[slot] && crash_dump_names[slot] != name && probes < 64) {
+                slot = (slot + 1) & (CRASH_DUMP_NAMES_SIZE - 1);
+                ++probes;
             }
+            if (crash_dump_names[slot] == name) return;
+            if (probes < 64) crash_dump_names[slot] = name;
 
-            first_event = false;
-        }
-    }
+            uint64_t name_pointer = reinterpret_cast<uint64_t>(name);
+            uint64_t name_length = strlen(name);
+            DumpRecord string_record = { DUMP_RECORD_STRING, 0, sizeof(name_pointer) + name_length };
+            writer.append(&string_record, sizeof(string_record));
+            writer.append(&name_pointer, sizeof(name_pointer));
+            writer.append(name, name_length);
+        };
+        for (Event* position = events; position < wrap_end;) {
+            if (!event_written(position)) {
+                ++position;
+                continue;
+            }
 
-    for (const auto& [timestamp, event] : COUNTER_events) {
-        auto tsc_diff = timestamp - tsc_base;
-        auto time_ns = static_cast<uint64_t>(static_cast<double>(tsc_diff) / ticks_per_ns_ratio);
-        fprintf(file,
-            "%c{"
-            "\"pid\": %u,"
-            "\"ts\":%" PRIu64 ".%03" PRIu64 ","
-            "\"name\":\"%s\","
-            "\"ph\":\"C\","
-            "\"args\":{"
-            "\"val\":%" PRIu64 ""
-            "}"
-            "}\n",
-            first_event ? ' ' : ',', pid, time_ns / 1000, time_ns % 1000, event->name, event->metadata);
+            EventRecord event;
+            position = decode_event(position, event);
+            for_each_arg_string(event, dump_name);
+            if (event.type == FLOW_START || event.type == FLOW_FINISH || !event.name) continue;
+            dump_name(event.name);
+        }
+    };
+    for (EventBuffer* event_buffer : event_buffers) dump_buffer(event_buffer);
+    for (CustomTLS* custom_tls_entry : retired_buffers) dump_buffer(&custom_tls_entry->event_buffer);
 
-        first_event = false;
-    }
+    DumpRecord end_record = { DUMP_RECORD_END, 0, 0 };
+    writer.append(&end_record, sizeof(end_record));
+    writer.flush();
+    close(crash_dump_fd);
 
-    fprintf(file,"]}");
-    fclose(file);
+    // printf isn't safe here.
+    static const char message[] = "LOP: fatal signal, trace written to crash dump.\n";
+    static const char failure[] = "LOP: fatal signal, couldn't write whole crash dump.\n";
+    if (writer.success) write(STDERR_FILENO, message, sizeof(message) - 1);
+    else                write(STDERR_FILENO, failure, sizeof(failure) - 1);
 }
+#endif
 
 void ProfilerEngine::flush(const char* suffix) {
     const std::lock_guard<std::mutex> control_lock(control_mutex);
+#if LOP_STREAMING
+    const std::lock_guard<std::mutex> stream_lock(stream_mutex);
+#endif
+
+    // User flush needs to wait for all internal exhaustions flushes to finish. Scheduler takes
+    // buffers_mutex before it has exhausted tables written, so this goes first.
+    while (active_exhaustion_count) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
     const std::lock_guard<std::mutex> buffer_lock(buffers_mutex);
     printf("ProfilerEngine::flush at PID:%u\n", get_process_id());
     if (suffix) printf("Flushing for suffix: \"%s\"\n", suffix);
+    if (uint64_t dropped = dropped_records.exchange(0)) {
+        printf("Dropped %" PRIu64 " records of threads that exhausted their tables without a spare one.\n", dropped);
+    }
     fflush(stdout);
 
-    if (enabled) {
+    if (lop_enabled) {
         printf("Tried to flush enabled LOP. Doing nothing.");
         return;
     }
@@ -480,38 +3782,132 @@ void ProfilerEngine::flush(const char* suffix) {
         return;
     }
 
+#if LOP_STREAMING
+    // Drain thread waits for us, so whatever it didn't get to yet goes to the stream right here.
+    for (EventBuffer* event_buffer : event_buffers) drain_stream_buffer(event_buffer);
+    for (CustomTLS* custom_tls_entry : retired_buffers) drain_stream_buffer(&custom_tls_entry->event_buffer);
+    close_stream();
+#else
     std::vector<BufferState> buffers;
-    for (auto& event_buffer : event_buffers)
-    {
+    auto add_buffer = [&buffers](EventBuffer* event_buffer) {
+#if LOP_RING
+        buffers.push_back(copy_ring_buffer(event_buffer));
+#else
         BufferState buffer;
         buffer.events = event_buffer->events;
         buffer.next_event = event_buffer->next_event;
         buffer.thread_id = event_buffer->thread_id;
+        buffer.capacity = event_buffer->capacity;
 
         buffers.push_back(buffer);
-    }
+#endif
+    };
+    for (EventBuffer* event_buffer : event_buffers) add_buffer(event_buffer);
+    for (CustomTLS* custom_tls_entry : retired_buffers) add_buffer(&custom_tls_entry->event_buffer);
 
     flush_buffers(suffix, buffers);
+#endif
+
+#if LOP_AGGREGATE
+    write_aggregate_summary(suffix);
+#endif
 
     for (EventBuffer* buffer : event_buffers) {
         buffer->next_event = buffer->events; // re-initialize current buffers
+        buffer->wrap_end = nullptr;
+        buffer->wrap_sequence = 0;
+#if LOP_STREAMING
+        buffer->events_end = buffer->events + buffer->capacity;
+        buffer->drain_event = buffer->events;
+        buffer->drain_laps = 0;
+#endif
     }
 
-    while (active_exhaustion_count) {
-        // User flush needs to wait for all internal exhaustions flushes to finish.
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    // Buffers of exited threads are flushed now, so new threads can take them. Used part is
+    // cleared, because unwritten events are expected to be zeroed (see event_written).
+    for (CustomTLS* custom_tls_entry : retired_buffers) {
+        EventBuffer& event_buffer = custom_tls_entry->event_buffer;
+        Event* used_end = std::min(std::max(event_buffer.next_event, event_buffer.wrap_end), event_buffer.events_end + LOP_BUFFER_SLACK);
+        memset(event_buffer.events, 0, (used_end - event_buffer.events) * sizeof(Event));
+        free_buffers.push_back(custom_tls_entry);
+    }
+    retired_buffers.clear();
+
+#if LOP_RING
+    for (BufferState& buffer : buffers) {
+        if (buffer.events) free_event_table(buffer.events, buffer.capacity);
     }
+#endif
 
     flushed = true;
 
     printf("ProfilerEngine::flush finished\n"); fflush(stdout);
 }
 
+void ProfilerEngine::snapshot(const char* suffix) {
+#if LOP_RING
+    // Beginning of the trace was most likely overwritten long ago, together with lop_engine_enable,
+    // so put another UNIX time reference in.
+    emit_begin_event("lop_engine_snapshot");
+    auto time_snapshot = std::chrono::system_clock::now();
+    emit_end_meta_event("lop_engine_snapshot", std::chrono::duration_cast<std::chrono::nanoseconds>(time_snapshot.time_since_epoch()).count());
+
+    // Tables are copied while profiler keeps on running, see copy_ring_buffer.
+    std::vector<BufferState> buffers;
+    uint64_t snapshot_id;
+    {
+        const std::lock_guard<std::mutex> lock(buffers_mutex);
+        snapshot_id = ++snapshot_count;
+        printf("ProfilerEngine::snapshot #%" PRIu64 " at PID:%u\n", snapshot_id, get_process_id()); fflush(stdout);
+
+        buffers.reserve(event_buffers.size() + retired_buffers.size());
+        for (EventBuffer* event_buffer : event_buffers) {
+            buffers.push_back(copy_ring_buffer(event_buffer));
+        }
+        for (CustomTLS* custom_tls_entry : retired_buffers) {
+            buffers.push_back(copy_ring_buffer(&custom_tls_entry->event_buffer));
+        }
+    }
+
+    std::string snapshot_suffix = suffix ? std::string(suffix) : "snapshot_" + std::to_string(snapshot_id);
+    flush_buffers(snapshot_suffix.c_str(), buffers);
+
+    for (BufferState& buffer : buffers) {
+        if (buffer.events) free_event_table(buffer.events, buffer.capacity);
+    }
+
+    printf("ProfilerEngine::snapshot finished\n"); fflush(stdout);
+#else
+    (void)suffix;
+    printf("Snapshots are available only in ring mode, see LOP_RING.\n");
+#endif
+}
+
 ProfilerEngine::~ProfilerEngine() {
     printf("ProfilerEngine::~ProfilerEngine at PID:%u\n", get_process_id()); fflush(stdout);
 
-    scheduler_run = false;
-    scheduler_thread.join();
+    // Threads exiting from now on just leave their buffers where they are.
+    thread_exit_tracking = false;
+
+    prefault_run = false;
+    if (prefault_thread.joinable()) prefault_thread.join();
+
+    {
+        const std::lock_guard<std::mutex> lock(clock_sync_mutex);
+        clock_sync_run = false;
+    }
+    clock_sync_cv.notify_all();
+    if (clock_sync_thread.joinable()) clock_sync_thread.join();
+
+#if LOP_STREAMING
+    // Final flush drains the rest by itself.
+    {
+        const std::lock_guard<std::mutex> lock(stream_mutex);
+        stream_run = false;
+    }
+    stream_cv.notify_all();
+    if (stream_thread.joinable()) stream_thread.join();
+#endif
     
     if (running) {
         disable();
@@ -521,6 +3917,36 @@ ProfilerEngine::~ProfilerEngine() {
         }
     }
 
+    // Stopped after the final flush, which waits for it to get exhausted tables written.
+    {
+        const std::lock_guard<std::mutex> lock(scheduler_mutex);
+        scheduler_run = false;
+    }
+    scheduler_cv.notify_one();
+    scheduler_thread.join();
+
+    // Tables exhausted after the final flush are not written anymore.
+    for (SpareTable* table = exhausted_tables.exchange(nullptr); table;) {
+        SpareTable* next = table->next;
+        free_event_table(table->events, table->capacity);
+        delete table;
+        table = next;
+        --active_exhaustion_count;
+    }
+    for (SpareTable* table : spare_tables) {
+        free_event_table(table->events, table->capacity);
+        delete table;
+    }
+    spare_tables.clear();
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    // We didn't crash after all, so don't leave empty dump behind.
+    if (crash_dump_fd >= 0 && !crash_dump_written.exchange(true)) {
+        close(crash_dump_fd);
+        unlink(crash_dump_name);
+    }
+#endif
+
     printf("ProfilerEngine::~ProfilerEngine finished\n"); fflush(stdout);
 }
 
@@ -534,185 +3960,691 @@ void ProfilerEngine::remove_event_buffer(EventBuffer* event_buffer) {
     event_buffers.remove(event_buffer);
 }
 
-void ProfilerEngine::handle_exhausted_buffers(EventBuffer* signalling_event_buffer) {
-    // Allow only one thread to perform exhaustion handling.
-#if LOP_SAFER_LOSSLESS
-    exhaustion_mutex.lock();
-#else
-    if (exhaustion_mutex.try_lock())
-#endif
+CustomTLS* ProfilerEngine::acquire_custom_tls() {
+    uint64_t capacity = t_buffer_capacity ? t_buffer_capacity : buffer_capacity.load();
+    CustomTLS* custom_tls_entry = nullptr;
     {
-        control_mutex.lock();
-        buffers_mutex.lock();
-
-        // Now we are fully locked. 
-        // Double-check if someone else didn't cleanup the buffer already.
-        if (signalling_event_buffer->next_event - signalling_event_buffer->events < LOP_BUFFER_SIZE) {
-            buffers_mutex.unlock();
-            control_mutex.unlock();
-            exhaustion_mutex.unlock();
-            return;
+        const std::lock_guard<std::mutex> lock(buffers_mutex);
+        auto reusable = std::find_if(free_buffers.begin(), free_buffers.end(), [capacity](CustomTLS* entry) {
+            return entry->event_buffer.capacity == capacity;
+        });
+        if (reusable != free_buffers.end()) {
+            custom_tls_entry = *reusable;
+            free_buffers.erase(reusable);
+
+            // Table is already faulted in and cleared.
+            EventBuffer& event_buffer = custom_tls_entry->event_buffer;
+            event_buffer.thread_id = _asm_get_tid();
+            event_buffer.next_event = event_buffer.events;
+            event_buffer.events_end = event_buffer.events + capacity;
+            event_buffer.wrap_end = nullptr;
+            event_buffer.wrap_sequence = 0;
+            event_buffer.drain_event = event_buffer.events;
+            event_buffer.drain_laps = 0;
+            event_buffers.push_back(&event_buffer);
         }
+    }
+    if (!custom_tls_entry) custom_tls_entry = new CustomTLS;
+    set_thread_custom_tls(custom_tls_entry);
 
-        ++active_exhaustion_count;
+    if (thread_exit_tracking) {
+#if defined(_WIN32) || defined(_WIN64)
+        FlsSetValue(thread_exit_key, custom_tls_entry);
+#else
+        pthread_setspecific(thread_exit_key, custom_tls_entry);
+#endif
+    }
+    return custom_tls_entry;
+}
 
-#if !LOP_SAFER_LOSSLESS
-        // Disable the profiler so we can (almost) safely replace the buffers.
-        enabled = false;
+void ProfilerEngine::retire_custom_tls(CustomTLS* custom_tls_entry) {
+    const std::lock_guard<std::mutex> lock(buffers_mutex);
 
-        // Now we need to delay the swap for long enough so that threads emitting events
-        // right now can exit the emission procedures. Few microseconds is enough and
-        // we will get that by busy-calling RDTSC all over again because it have quite
-        // well defined execution time.
-        // This kinda workaround is needed because Windows usually cannot sleep for less
-        // than millisecond and that's definitely too much.
-        compiler_barrier();
-        for (uint64_t i = 0; i < 2000; i++) {_asm_fast_rdtsc();}
-        compiler_barrier();
-#endif
+    // Events emitted later on by this thread (from other exit callbacks) go to a new buffer.
+    if (get_thread_custom_tls() == custom_tls_entry) set_thread_custom_tls(nullptr);
 
-        std::vector<BufferState> exhausted_buffers;
-        exhausted_buffers.reserve(event_buffers.size());
-        uint64_t new_backup_id = 0;
-        for (auto& event_buffer : event_buffers)
-        {
-            BufferState exhausted_buffer;
-            exhausted_buffer.events = event_buffer->events;
-            exhausted_buffer.next_event = event_buffer->next_event;
-            exhausted_buffer.thread_id = event_buffer->thread_id;
+    EventBuffer& event_buffer = custom_tls_entry->event_buffer;
+    if (!event_buffer.events) return;
 
-            exhausted_buffers.push_back(exhausted_buffer);
+    event_buffers.remove(&event_buffer);
 
-            // This hot swap might cause issues because we could get false negative exhaustion checks.
-            // But thanks to compiler barrier, in worst case it will put such event in new table anyway...
-            // ... which is good, actually.
-            event_buffer->next_event = event_buffer->events_backup;
-            compiler_barrier();
-            event_buffer->events = event_buffer->events_backup;
-        }
+    // In streaming mode, drain thread gives it to new threads once it's drained, see drain_streams.
+    // Statistics of aggregation mode are merged at flush, like events.
+    if (!LOP_STREAMING && event_buffer.next_event == event_buffer.events && !event_buffer.wrap_end && !event_buffer.aggregate) {
+        free_buffers.push_back(custom_tls_entry);
+    }
+    else {
+        retired_buffers.push_back(custom_tls_entry);
+    }
+}
 
-#if !LOP_SAFER_LOSSLESS
-        // Swap is done, we can enable profiler again.
-        enabled = true;
-#endif
+// "Safer" mode. Called by emitters of the thread whose table is full, between its emit calls, so
+// nobody else writes to the table and other threads are not affected at all. Thread takes spare table
+// prepared by the scheduler thread and passes the full one to it in the same node.
+void ProfilerEngine::swap_exhausted_table(EventBuffer* event_buffer) {
+    // Only this thread pops, so the top node can't be popped and pushed back between the load and
+    // the CAS (no ABA), scheduler can only push more of them meanwhile.
+    SpareTable* spare = event_buffer->spare_table.load();
+    while (spare && !event_buffer->spare_table.compare_exchange_weak(spare, spare->next)) {}
+    if (!spare) {
+        // With small buffers, exhaustions can come faster than scheduler refills spares. Allocating
+        // one here would put mmap into traced code, so the records are dropped instead.
+        dropped_records += event_buffer->next_event - event_buffer->events;
+        memset(event_buffer->events, 0, (event_buffer->next_event - event_buffer->events) * sizeof(Event));
+        event_buffer->next_event = event_buffer->events;
+        return;
+    }
+    --event_buffer->spare_count;
 
-        // Generate special event on current thread so that we can track on the trace at what point of
-        // UNIX time this specific trace started. It can be used to merge traces using postprocessing
-        // because every trace will have either lop_enable or lop_engine_recovery event that has global
-        // UNIX timestamp gathered at that specific part of trace so it gives you a way to position the
-        // events globally.
-        emit_begin_event("lop_engine_recovery");
-        time_enable = std::chrono::system_clock::now();
-        emit_end_meta_event("lop_engine_recovery", std::chrono::duration_cast<std::chrono::nanoseconds>(time_enable.time_since_epoch()).count());
-
-        // Now we can process all events in the saved exhausted buffers, but we will do so in other thread
-        // to not delay user execution too much as this process is very slow.
-        // We will also prepare new backup buffers there.
-        // We are using queue to a dedicated thread scheduler because creating new thread directly here
-        // can take even a millisecond(!) or so as my tests shown and we don't want to delay current user
-        // thread for that long.
-        {
-            const std::lock_guard<std::mutex> lock(scheduler_queue_mutex);
-            scheduler_queue.push(std::move(exhausted_buffers));
-        }
+    Event* exhausted_events = event_buffer->events;
+    Event* exhausted_end = event_buffer->next_event;
 
-        // Now we can unlock the mutexes as events tables are fully corrected so we could freely enter this
-        // function again from any another thread.
-        buffers_mutex.unlock();
-        control_mutex.unlock();
-        exhaustion_mutex.unlock();
+    event_buffer->next_event = spare->events;
+    compiler_barrier();
+    event_buffer->events_end = spare->events + event_buffer->capacity;
+    event_buffer->events = spare->events;
 
-        // INFO: Feel free to add any additional callback logic here.
-        // ...
-    }
+    spare->events = exhausted_events;
+    spare->next_event = exhausted_end;
+    spare->thread_id = event_buffer->thread_id;
+
+    // Flush waits for the table from the moment it's pushed.
+    ++active_exhaustion_count;
+    spare->next = exhausted_tables.load();
+    while (!exhausted_tables.compare_exchange_weak(spare->next, spare)) {}
+
+    // Generate special event at the start of the new table, so that we can track on the trace at what
+    // point of UNIX time it started. It can be used to merge traces using postprocessing because every
+    // trace will have either lop_enable or lop_engine_recovery event that has global UNIX timestamp
+    // gathered at that specific part of trace so it gives you a way to position the events globally.
+    emit_begin_event("lop_engine_recovery");
+    auto time_recovery = std::chrono::system_clock::now();
+    emit_end_meta_event("lop_engine_recovery", std::chrono::duration_cast<std::chrono::nanoseconds>(time_recovery.time_since_epoch()).count());
+
+    // INFO: Feel free to add any additional callback logic here.
+    // ...
 }
 
 EventBuffer::EventBuffer() {
     thread_id = _asm_get_tid();
-    events = new Event[LOP_BUFFER_SIZE];
+    capacity = t_buffer_capacity ? t_buffer_capacity : g_lop_inst.buffer_capacity.load();
+    events = allocate_event_table(capacity);
 
 #if LOP_SAFER
-    events_backup = new Event[LOP_BUFFER_SIZE];
+    // Not registered yet, so nobody else touches the stack.
+    for (uint32_t i = 0; events && i < LOP_SPARE_TABLES; ++i) {
+        SpareTable* spare = new SpareTable{ allocate_event_table(capacity), nullptr, 0, capacity, spare_table.load() };
+        if (!spare->events) {
+            delete spare;
+            break;
+        }
+        spare_table = spare;
+        ++spare_count;
+    }
 #endif
 
     next_event = events;
+    events_end = events + capacity;
+    drain_event = events;
     if (events) {
+        // We are on the first emit of this thread anyway, so get the first pages in right now,
+        // before prefault thread even notices this buffer.
+        if (g_lop_inst.prefault != PREFAULT_NONE) {
+            prefaulted_table = events;
+            prefaulted_end = events + std::min<uint64_t>(LOP_HUGE_PAGE_SIZE / sizeof(Event), capacity + LOP_BUFFER_SLACK);
+            prefault_range(prefaulted_table, prefaulted_end);
+        }
+
         g_lop_inst.add_event_buffer(this);
+        registered = true;
     }
     else {
         printf("Couldn't allocate ring buffer.\n");
     }
 }
 
+EventBuffer::EventBuffer(uint64_t table_capacity) {
+    capacity = table_capacity;
+    events = allocate_event_table(capacity);
+    next_event = events;
+    events_end = events + capacity;
+    drain_event = events;
+}
+
 EventBuffer::~EventBuffer() {
-    printf("EventBuffer::~EventBuffer at TID:%" PRIu64 "\n", thread_id); fflush(stdout);
-    g_lop_inst.remove_event_buffer(this);
+    if (registered) {
+        printf("EventBuffer::~EventBuffer at TID:%" PRIu64 "\n", thread_id); fflush(stdout);
+        g_lop_inst.remove_event_buffer(this);
+    }
     if (events) {
-        delete[] events;
+        free_event_table(events, capacity);
         events = nullptr;
     }
+    for (SpareTable* spare = spare_table.exchange(nullptr); spare;) {
+        SpareTable* next = spare->next;
+        free_event_table(spare->events, spare->capacity);
+        delete spare;
+        spare = next;
+    }
+    spare_count = 0;
+    std::free(aggregate);
+    aggregate = nullptr;
+    delete names;
+    names = nullptr;
 
     thread_id = -1;
-    printf("EventBuffer::~EventBuffer finished\n"); fflush(stdout);
+    if (registered) {
+        printf("EventBuffer::~EventBuffer finished\n"); fflush(stdout);
+    }
+}
+
+#if LOP_AGGREGATE
+static inline uint32_t log2_bucket(uint64_t value) {
+#if defined(_WIN32) || defined(_WIN64)
+    unsigned long index;
+    return _BitScanReverse64(&index, value) ? index : 0;
+#else
+    return value ? 63 - __builtin_clzll(value) : 0;
+#endif
+}
+
+static AggregateTable* thread_aggregate_table() {
+    CustomTLS* custom_tls_entry = get_thread_custom_tls();
+    if (!custom_tls_entry) custom_tls_entry = allocate_custom_tls();
+
+    // Zeroed pages are committed as entries get used, so untouched part of the table costs nothing.
+    EventBuffer& event_buffer = custom_tls_entry->event_buffer;
+    if (!event_buffer.aggregate) event_buffer.aggregate = static_cast<AggregateTable*>(std::calloc(1, sizeof(AggregateTable)));
+    return event_buffer.aggregate;
+}
+
+static void aggregate_begin(const char* name, uint64_t tsc, uint64_t weight = 1) {
+    AggregateTable* table = thread_aggregate_table();
+    if (!table) return;
+
+    if (table->depth < LOP_AGGREGATE_DEPTH) table->scopes[table->depth] = { name, tsc, weight };
+    else                                    ++table->dropped;
+    ++table->depth;
+}
+
+static void aggregate_end(uint64_t tsc) {
+    AggregateTable* table = thread_aggregate_table();
+    if (!table) return;
+
+    if (!table->depth) {
+        ++table->unmatched_ends;
+        return;
+    }
+    if (--table->depth >= LOP_AGGREGATE_DEPTH) return;
+
+    const AggregateTable::OpenScope& scope = table->scopes[table->depth];
+    uint64_t ticks = (tsc > scope.tsc) ? tsc - scope.tsc : 0;
+
+    // Linear probing, entries are never removed while the profiler runs.
+    uint64_t slot = (reinterpret_cast<uint64_t>(scope.name) * 0x9E3779B97F4A7C15ULL) >> 32;
+    for (uint32_t probe = 0; probe < LOP_AGGREGATE_NAMES; ++probe, ++slot) {
+        AggregateEntry& entry = table->entries[slot & (LOP_AGGREGATE_NAMES - 1)];
+        if (!entry.name) {
+            entry.name = scope.name;
+            entry.min_ticks = UINT64_MAX;
+        }
+        else if (entry.name != scope.name) {
+            continue;
+        }
+
+        entry.count += scope.weight;
+        entry.total_ticks += ticks * scope.weight;
+        entry.min_ticks = std::min(entry.min_ticks, ticks);
+        entry.max_ticks = std::max(entry.max_ticks, ticks);
+        entry.histogram[log2_bucket(ticks)] += scope.weight;
+        return;
+    }
+    ++table->dropped;
+}
+
+// Merges statistics of all threads by name string, as the same name can come from different
+// pointers, and clears them. Threads are disabled at this point, like for the event tables.
+void ProfilerEngine::write_aggregate_summary(const char* suffix) {
+    std::map<std::string, AggregateEntry> merged;
+    uint64_t unmatched_ends = 0;
+    uint64_t dropped = 0;
+    auto merge_table = [&](EventBuffer* event_buffer) {
+        AggregateTable* table = event_buffer->aggregate;
+        if (!table) return;
+
+        for (const AggregateEntry& entry : table->entries) {
+            if (!entry.name) continue;
+            auto inserted = merged.emplace(entry.name, entry);
+            if (inserted.second) continue;
+
+            AggregateEntry& total = inserted.first->second;
+            total.count += entry.count;
+            total.total_ticks += entry.total_ticks;
+            total.min_ticks = std::min(total.min_ticks, entry.min_ticks);
+            total.max_ticks = std::max(total.max_ticks, entry.max_ticks);
+            for (uint32_t bucket = 0; bucket < LOP_AGGREGATE_BUCKETS; ++bucket) total.histogram[bucket] += entry.histogram[bucket];
+        }
+        unmatched_ends += table->unmatched_ends;
+        dropped += table->dropped;
+        memset(table, 0, sizeof(AggregateTable));
+    };
+    for (EventBuffer* event_buffer : event_buffers) merge_table(event_buffer);
+    for (CustomTLS* custom_tls_entry : retired_buffers) merge_table(&custom_tls_entry->event_buffer);
+
+    std::vector<const std::pair<const std::string, AggregateEntry>*> sorted;
+    for (const auto& entry : merged) sorted.push_back(&entry);
+    std::stable_sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) {
+        return a->second.total_ticks > b->second.total_ticks;
+    });
+
+    refine_tsc_frequency();
+    ClockMapping clock = clock_mapping(0);
+    auto to_ns = [&clock](uint64_t ticks) { return clock.duration_ns(ticks); };
+
+    std::string output;
+    char line[256];
+    snprintf(line, sizeof(line), "{\"pid\":%u,\"unmatched_ends\":%" PRIu64 ",\"dropped\":%" PRIu64 ",\"scopes\":[",
+        get_process_id(), unmatched_ends, dropped);
+    output += line;
+    for (const auto* named_entry : sorted) {
+        const AggregateEntry& entry = named_entry->second;
+        output += (named_entry == sorted.front()) ? "\n{\"name\":\"" : ",\n{\"name\":\"";
+        size_t name_offset = output.size();
+        output.resize(name_offset + named_entry->first.size() * JSON_ESCAPE_MAX_FACTOR);
+        char* name_end = put_json_string(&output[name_offset], named_entry->first.data(), named_entry->first.size());
+        output.resize(name_end - output.data());
+        snprintf(line, sizeof(line), "\",\"count\":%" PRIu64 ",\"total_ns\":%" PRIu64 ",\"mean_ns\":%" PRIu64 ",\"min_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 ",\"histogram\":[",
+            entry.count, to_ns(entry.total_ticks), to_ns(entry.total_ticks / entry.count), to_ns(entry.min_ticks), to_ns(entry.max_ticks));
+        output += line;
+
+        // Only non-empty buckets, each with its upper bound.
+        bool first_bucket = true;
+        for (uint32_t bucket = 0; bucket < LOP_AGGREGATE_BUCKETS; ++bucket) {
+            if (!entry.histogram[bucket]) continue;
+            uint64_t upper_ticks = (bucket < 63) ? (2ULL << bucket) : UINT64_MAX;
+            snprintf(line, sizeof(line), "%s{\"le_ns\":%" PRIu64 ",\"count\":%" PRIu64 "}", first_bucket ? "" : ",", to_ns(upper_ticks), entry.histogram[bucket]);
+            output += line;
+            first_bucket = false;
+        }
+        output += "]}";
+    }
+    output += "\n]}\n";
+
+    auto time_summary = std::chrono::system_clock::now();
+    uint64_t time_diff_us = std::chrono::duration_cast<std::chrono::microseconds>(time_summary - time_enable).count();
+    char name[200];
+    if (suffix) snprintf(name, 200, "events_pid%u_ts%" PRIu64 "_%s_summary.json", get_process_id(), time_diff_us, suffix);
+    else        snprintf(name, 200, "events_pid%u_ts%" PRIu64 "_summary.json", get_process_id(), time_diff_us);
+    printf("Creating file: %s, %zu scope names\n", name, merged.size()); fflush(stdout);
+
+    int fd = open_output_file(name);
+    if (fd < 0) {
+        printf("Couldn't create file: %s\n", name);
+        return;
+    }
+    if (!write_whole(fd, output.data(), output.size())) printf("Couldn't write whole summary to file: %s\n", name);
+    close_output_file(fd);
+}
+#endif
+
+// FNV-1a, names are short and hashed only by the thread that interns them.
+static inline uint64_t hash_name(std::string_view name) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (char character : name) {
+        hash ^= static_cast<uint8_t>(character);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+const char* NameArena::intern(std::string_view name) {
+    uint64_t hash = hash_name(name);
+    if (slots.empty()) slots.resize(LOP_NAME_TABLE_MIN);
+
+    uint64_t mask = slots.size() - 1;
+    uint64_t slot = hash & mask;
+    for (; slots[slot].name; slot = (slot + 1) & mask) {
+        const Slot& candidate = slots[slot];
+        if (candidate.hash == hash && candidate.length == name.size() && !memcmp(candidate.name, name.data(), name.size())) {
+            return candidate.name;
+        }
+    }
+
+    // First time the thread sees this name, copy it with terminating zero.
+    uint64_t size = name.size() + 1;
+    if (static_cast<uint64_t>(block_end - block_next) < size) {
+        uint64_t block_size = std::max<uint64_t>(size, LOP_NAME_BLOCK_SIZE);
+        char* block = static_cast<char*>(std::malloc(block_size));
+        if (!block) return nullptr;
+        blocks.push_back(block);
+        block_next = block;
+        block_end = block + block_size;
+    }
+    char* copy = block_next;
+    block_next += size;
+    memcpy(copy, name.data(), name.size());
+    copy[name.size()] = '\0';
+
+    if (2 * (names_count + 1) > slots.size()) {
+        std::vector<Slot> grown(slots.size() * 2);
+        mask = grown.size() - 1;
+        for (const Slot& entry : slots) {
+            if (!entry.name) continue;
+            uint64_t position = entry.hash & mask;
+            while (grown[position].name) position = (position + 1) & mask;
+            grown[position] = entry;
+        }
+        slots.swap(grown);
+        for (slot = hash & mask; slots[slot].name; slot = (slot + 1) & mask) {}
+    }
+    slots[slot] = { hash, copy, name.size() };
+    ++names_count;
+    return copy;
+}
+
+const char* intern_event_name(std::string_view name) {
+    CustomTLS* custom_tls_entry = get_thread_custom_tls();
+    if (!custom_tls_entry) custom_tls_entry = allocate_custom_tls();
+
+    EventBuffer& event_buffer = custom_tls_entry->event_buffer;
+    if (!event_buffer.names) event_buffer.names = new NameArena;
+    const char* interned = event_buffer.names->intern(name);
+    return interned ? interned : "lop_name_dropped";
+}
+
+#if LOP_INLINE_EMITTERS
+static_assert(sizeof(inline_emitters::Event) == sizeof(Event), "Update profiler_inline.h.");
+static_assert(offsetof(inline_emitters::Event, name) == offsetof(Event, name), "Update profiler_inline.h.");
+static_assert(offsetof(inline_emitters::Event, metadata) == offsetof(Event, metadata), "Update profiler_inline.h.");
+static_assert(offsetof(inline_emitters::Event, type) == offsetof(Event, type), "Update profiler_inline.h.");
+static_assert(offsetof(inline_emitters::Event, tsc_aux) == offsetof(Event, tsc_aux), "Update profiler_inline.h.");
+static_assert(inline_emitters::IMMEDIATE_CALL == DUMP_EVENT_IMMEDIATE_CALL && inline_emitters::ENDBEGIN_CALL == DUMP_EVENT_ENDBEGIN_CALL, "Update profiler_inline.h.");
+static_assert(offsetof(inline_emitters::EventBuffer, next_event) == offsetof(EventBuffer, next_event), "Update profiler_inline.h.");
+static_assert(offsetof(inline_emitters::EventBuffer, events_end) == offsetof(EventBuffer, events_end), "Update profiler_inline.h.");
+static_assert(offsetof(CustomTLS, event_buffer) == 0, "Inline emitters expect event buffer at the start of CustomTLS.");
+
+// Used by inline emitters from profiler_inline.h for the events they can't write themselves.
+# define LOP_OUTLINE_EMITTER(name) inline_emitters::name
+#else
+# define LOP_OUTLINE_EMITTER(name) name
+#endif
+
+void LOP_OUTLINE_EMITTER(emit_begin_event)(const char* name) {
+    compiler_barrier();
+#if LOP_AGGREGATE
+    if (lop_enabled) aggregate_begin(name, _asm_fast_rdtsc());
+#else
+    if (lop_enabled) _asm_emit_begin_event(&g_lop_inst, name);
+#endif
+    compiler_barrier();
+}
+
+void LOP_OUTLINE_EMITTER(emit_end_event)(const char* name) {
+    compiler_barrier();
+#if LOP_AGGREGATE
+    (void)name;
+    if (lop_enabled) aggregate_end(_asm_fast_rdtsc());
+#else
+    if (lop_enabled) _asm_emit_end_event(&g_lop_inst, name);
+#endif
+    compiler_barrier();
+}
+
+void LOP_OUTLINE_EMITTER(emit_endbegin_event)(const char* end_name, const char* begin_name) {
+    compiler_barrier();
+#if LOP_AGGREGATE
+    (void)end_name;
+    if (lop_enabled) {
+        uint64_t tsc = _asm_fast_rdtsc();
+        aggregate_end(tsc);
+        aggregate_begin(begin_name, tsc);
+    }
+#else
+    if (lop_enabled) _asm_emit_endbegin_event(&g_lop_inst, end_name, begin_name);
+#endif
+    compiler_barrier();
+}
+
+void LOP_OUTLINE_EMITTER(emit_immediate_event)(const char* name) {
+    compiler_barrier();
+    if (lop_enabled) _asm_emit_immediate_event(&g_lop_inst, name);
+    compiler_barrier();
 }
 
-void emit_begin_event(const char* name) {
+void LOP_OUTLINE_EMITTER(emit_begin_meta_event)(const char* name, uint64_t metadata) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_begin_event(&g_lop_inst, name);
+#if LOP_AGGREGATE
+    (void)metadata;
+    if (lop_enabled) aggregate_begin(name, _asm_fast_rdtsc());
+#else
+    if (lop_enabled) _asm_emit_begin_meta_event(&g_lop_inst, name, metadata);
+#endif
     compiler_barrier();
 }
 
-void emit_end_event(const char* name) {
+void LOP_OUTLINE_EMITTER(emit_end_meta_event)(const char* name, uint64_t metadata) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_end_event(&g_lop_inst, name);
+#if LOP_AGGREGATE
+    (void)name;
+    (void)metadata;
+    if (lop_enabled) aggregate_end(_asm_fast_rdtsc());
+#else
+    if (lop_enabled) _asm_emit_end_meta_event(&g_lop_inst, name, metadata);
+#endif
     compiler_barrier();
 }
 
-void emit_endbegin_event(const char* end_name, const char* begin_name) {
+void LOP_OUTLINE_EMITTER(emit_immediate_meta_event)(const char* name, uint64_t metadata) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_endbegin_event(&g_lop_inst, end_name, begin_name);
+    if (lop_enabled) _asm_emit_immediate_meta_event(&g_lop_inst, name, metadata);
     compiler_barrier();
 }
 
-void emit_immediate_event(const char* name) {
+void LOP_OUTLINE_EMITTER(emit_counter_event)(const char* name, uint64_t count) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_immediate_event(&g_lop_inst, name);
+    if (lop_enabled) _asm_emit_counter_event(&g_lop_inst, name, count);
     compiler_barrier();
 }
 
-void emit_begin_meta_event(const char* name, uint64_t metadata) {
+void LOP_OUTLINE_EMITTER(emit_flow_start_event)(const char* name, uint64_t flow_id) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_begin_meta_event(&g_lop_inst, name, metadata);
+    if (lop_enabled) _asm_emit_flow_start_event(&g_lop_inst, name, flow_id);
     compiler_barrier();
 }
 
-void emit_end_meta_event(const char* name, uint64_t metadata) {
+void LOP_OUTLINE_EMITTER(emit_flow_finish_event)(const char* name, uint64_t flow_id) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_end_meta_event(&g_lop_inst, name, metadata);
+    if (lop_enabled) _asm_emit_flow_finish_event(&g_lop_inst, name, flow_id);
     compiler_barrier();
 }
 
-void emit_immediate_meta_event(const char* name, uint64_t metadata) {
+// Dynamic names are interned only when the event is going to be recorded.
+void emit_begin_event_dyn(std::string_view name) {
+    if (lop_enabled) emit_begin_event(intern_event_name(name));
+}
+
+void emit_end_event_dyn(std::string_view name) {
+    if (lop_enabled) emit_end_event(intern_event_name(name));
+}
+
+void emit_immediate_event_dyn(std::string_view name) {
+    if (lop_enabled) emit_immediate_event(intern_event_name(name));
+}
+
+void emit_endbegin_event_dyn(std::string_view end_name, std::string_view begin_name) {
+    if (lop_enabled) emit_endbegin_event(intern_event_name(end_name), intern_event_name(begin_name));
+}
+
+void emit_begin_meta_event_dyn(std::string_view name, uint64_t metadata) {
+    if (lop_enabled) emit_begin_meta_event(intern_event_name(name), metadata);
+}
+
+void emit_end_meta_event_dyn(std::string_view name, uint64_t metadata) {
+    if (lop_enabled) emit_end_meta_event(intern_event_name(name), metadata);
+}
+
+void emit_immediate_meta_event_dyn(std::string_view name, uint64_t metadata) {
+    if (lop_enabled) emit_immediate_meta_event(intern_event_name(name), metadata);
+}
+
+void emit_counter_event_dyn(std::string_view name, uint64_t count) {
+    if (lop_enabled) emit_counter_event(intern_event_name(name), count);
+}
+
+void emit_flow_start_event_dyn(std::string_view name, uint64_t flow_id) {
+    if (lop_enabled) emit_flow_start_event(intern_event_name(name), flow_id);
+}
+
+void emit_flow_finish_event_dyn(std::string_view name, uint64_t flow_id) {
+    if (lop_enabled) emit_flow_finish_event(intern_event_name(name), flow_id);
+}
+
+static_assert((LOP_MAX_EVENT_ARGS + 1) * (LOP_COMPACT_EVENTS ? 2 : 1) + 1 <= LOP_BUFFER_SLACK, "Events with arguments must fit in the slack.");
+static_assert(ARG_INT + EventArg::POINTER == ARG_POINTER, "Argument record types must follow EventArg::Type.");
+static_assert(CALL_BEGIN_SAMPLED <= DUMP_EVENT_TYPE_MASK, "Event types must leave room for call flags.");
+
+// Reserves records for emit call done in C++ rather than asm (events with arguments), with the same
+// checks the asm emitters do in current mode, see MacroExhaustionCheck in profiler_asm.cpp.
+static Event* reserve_event_records(uint64_t count) {
+    CustomTLS* custom_tls_entry = get_thread_custom_tls();
+    if (!custom_tls_entry) custom_tls_entry = allocate_custom_tls();
+    EventBuffer* event_buffer = &custom_tls_entry->event_buffer;
+
+#if LOP_SAFER
+    if (event_buffer->next_event >= event_buffer->events_end) exhaustion_handler(event_buffer);
+#elif LOP_RING
+    if (event_buffer->next_event >= event_buffer->events_end) {
+        ++event_buffer->wrap_sequence;
+        compiler_barrier();
+        event_buffer->wrap_end = event_buffer->next_event;
+        event_buffer->next_event = event_buffer->events;
+        compiler_barrier();
+        ++event_buffer->wrap_sequence;
+    }
+#elif LOP_STREAMING
+    if (event_buffer->next_event >= event_buffer->events_end) stream_handler(event_buffer);
+#endif
+
+    Event* event = event_buffer->next_event;
+    event_buffer->next_event = event + count;
+    return event;
+}
+
+// Fills single record, except for its timestamp, and returns position of the next one.
+static inline Event* fill_record(Event* position, event_type type, const char* name, uint64_t metadata) {
+    position->name = name;
+#if LOP_COMPACT_EVENTS
+    position->timestamp_type = type; // Timestamp is added by publish_record.
+    if (type == CALL_BEGIN_ARGS || type == CALL_BEGIN_SAMPLED || is_argument_record(type)) {
+        position[1].timestamp_type = metadata;
+        position[1].name = nullptr;
+        return position + 2;
+    }
+    return position + 1;
+#else
+    position->metadata = metadata;
+    position->type = type;
+    return position + 1;
+#endif
+}
+
+// Sets call flags (see DUMP_EVENT_TYPE_MASK) of the record filled by fill_record.
+static inline void mark_call(Event* position, uint32_t call_flags) {
+#if LOP_COMPACT_EVENTS
+    position->timestamp_type |= call_flags;
+#else
+    position->type = static_cast<event_type>(position->type | call_flags);
+#endif
+}
+
+static inline uint64_t read_record_timestamp(uint32_t& tsc_aux) {
+#if LOP_CPU_ID
+    return __rdtscp(&tsc_aux);
+#else
+    tsc_aux = 0;
+    return _asm_fast_rdtsc();
+#endif
+}
+
+static inline void publish_record(Event* position, uint64_t timestamp, uint32_t tsc_aux) {
+#if LOP_COMPACT_EVENTS
+    (void)tsc_aux;
+    position->timestamp_type |= timestamp << COMPACT_TYPE_BITS;
+#else
+    position->tsc_aux = tsc_aux;
+    position->timestamp = timestamp;
+#endif
+}
+
+// Writes begin event followed by its argument records, and for immediate events also the end event,
+// all in one reservation. The begin event is written last, so that it's never seen written while
+// its arguments aren't (see event_written).
+static void write_args_event(const char* name, std::initializer_list<EventArg> args, bool immediate) {
+    uint64_t args_count = std::min<uint64_t>(args.size(), LOP_MAX_EVENT_ARGS);
+    uint64_t records_per_arg = LOP_COMPACT_EVENTS ? 2 : 1;
+    uint64_t count = records_per_arg * (args_count + 1) + (immediate ? 1 : 0);
+    Event* header = reserve_event_records(count);
+
+    Event* args_begin = header + records_per_arg;
+    Event* position = args_begin;
+    for (const EventArg& arg : args) {
+        if (position == args_begin + records_per_arg * args_count) break;
+
+        uint64_t value = arg.value;
+        event_type type = static_cast<event_type>(ARG_INT + arg.type);
+        if (arg.type == EventArg::STRING_VIEW) {
+            value = reinterpret_cast<uint64_t>(intern_event_name(std::string_view(reinterpret_cast<const char*>(arg.value), arg.length)));
+            type = ARG_STRING;
+        }
+        position = fill_record(position, type, arg.name, value);
+    }
+    Event* end = position;
+    if (immediate) fill_record(end, CALL_END, name, 0);
+
+    uint32_t tsc_aux;
+    uint64_t timestamp = read_record_timestamp(tsc_aux);
+    for (position = args_begin; position < end; position += records_per_arg) publish_record(position, timestamp, tsc_aux);
+    if (immediate) publish_record(end, timestamp + LOP_CALL_TIMESTAMP_SPREAD, tsc_aux);
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_immediate_meta_event(&g_lop_inst, name, metadata);
+    fill_record(header, CALL_BEGIN_ARGS, name, args_count);
+    if (immediate) mark_call(header, DUMP_EVENT_IMMEDIATE_CALL);
+    publish_record(header, timestamp, tsc_aux);
+}
+
+static void write_sampled_begin_event(const char* name, uint64_t weight) {
+    Event* position = reserve_event_records(LOP_COMPACT_EVENTS ? 2 : 1);
+    fill_record(position, CALL_BEGIN_SAMPLED, name, weight);
+    uint32_t tsc_aux;
+    uint64_t timestamp = read_record_timestamp(tsc_aux);
     compiler_barrier();
+    publish_record(position, timestamp, tsc_aux);
 }
 
-void emit_counter_event(const char* name, uint64_t count) {
+void emit_begin_args_event(const char* name, std::initializer_list<EventArg> args) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_counter_event(&g_lop_inst, name, count);
+#if LOP_AGGREGATE
+    (void)args;
+    if (lop_enabled) aggregate_begin(name, _asm_fast_rdtsc());
+#else
+    if (lop_enabled) write_args_event(name, args, false);
+#endif
     compiler_barrier();
 }
 
-void emit_flow_start_event(const char* name, uint64_t flow_id) {
+void emit_immediate_args_event(const char* name, std::initializer_list<EventArg> args) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_flow_start_event(&g_lop_inst, name, flow_id);
+    if (lop_enabled) write_args_event(name, args, true);
     compiler_barrier();
 }
 
-void emit_flow_finish_event(const char* name, uint64_t flow_id) {
+// Always out of line, it's called only for kept calls of sampled scopes.
+void emit_sampled_begin_event(const char* name, uint64_t weight) {
     compiler_barrier();
-    if (g_lop_inst.enabled) _asm_emit_flow_finish_event(&g_lop_inst, name, flow_id);
+#if LOP_AGGREGATE
+    if (lop_enabled) aggregate_begin(name, _asm_fast_rdtsc(), weight);
+#else
+    if (lop_enabled) write_sampled_begin_event(name, weight);
+#endif
     compiler_barrier();
 }
  
@@ -56,13 +56,37 @@ PUBLIC _asm_emit_flow_finish_event
 
 EXTERN allocate_custom_tls : PROC 
 EXTERN exhaustion_handler : PROC 
+EXTERN stream_handler : PROC
 
-COMMENT @ To enable "safer" mode, set LOP_SAFER to 1 and make sure
- that LOP_BUFFER_SIZE is equal to the one set up in profiler.cpp
+COMMENT @ To enable "safer" mode, set LOP_SAFER to 1.
 @
+IFNDEF LOP_SAFER
 LOP_SAFER equ 0
-LOP_SAFER_LOSSLESS equ 0
-LOP_BUFFER_SIZE equ 0400000h
+ENDIF
+
+COMMENT @ Must match LOP_COMPACT_EVENTS from profiler.h.
+@
+IFNDEF LOP_COMPACT_EVENTS
+LOP_COMPACT_EVENTS equ 0
+ENDIF
+
+COMMENT @ Must match LOP_RING from profiler.h.
+@
+IFNDEF LOP_RING
+LOP_RING equ 0
+ENDIF
+
+COMMENT @ Must match LOP_STREAMING from profiler.h.
+@
+IFNDEF LOP_STREAMING
+LOP_STREAMING equ 0
+ENDIF
+
+COMMENT @ Must match LOP_CPU_ID from profiler.h.
+@
+IFNDEF LOP_CPU_ID
+LOP_CPU_ID equ 0
+ENDIF
 
 CALL_BEGIN       equ 0
 CALL_END         equ 1
@@ -72,85 +96,155 @@ COUNTER_INT      equ 4
 FLOW_START       equ 5
 FLOW_FINISH      equ 6
 
+COMMENT @ Set above the type of the first record of immediate and end-begin calls, must match profiler_dump.h.
+@
+EVENT_IMMEDIATE_CALL equ 40h
+EVENT_ENDBEGIN_CALL  equ 80h
+
+IF LOP_COMPACT_EVENTS
+COMPACT_TYPE_BITS equ 8
+
+Event STRUCT
+    timestamp_type dq ?
+    event_name     dq ?
+Event ENDS
+ELSE
 Event STRUCT
     timestamp      dq ?
     event_name     dq ?
     metadata       dq ?
     event_type     dd ?
-    padding        dd ? ; Instead of this you could just set /Zp16 in MASM settings to match C++ struct packing
+    tsc_aux        dd ? ; Padding without LOP_CPU_ID. Instead of this you could just set /Zp16 in MASM settings to match C++ struct packing
 Event ENDS
+ENDIF
 
 EventBuffer STRUCT
     next_event    dq ?
     events        dq ?
-    events_backup dq ?
+    spare_table   dq ?
     thread_id     dq ?
+    events_end    dq ?
+    wrap_end      dq ?
+    wrap_sequence dq ?
 EventBuffer ENDS
 
+COMMENT @ Custom TLS of the thread is kept in TlsAlloc slot in TEB, its offset is in the first
+  field of ProfilerEngine (see custom_tls_offset in profiler.cpp).
+@
 MacroTLSCheck MACRO
-    mov   r9, gs:[48h] ; tid
-    mov  rcx, [rcx]
-    and   r9, 0FFFFh  
-    lea  rax, [rcx+r9*8]  
-    mov  r11, qword ptr [rax]  
+    mov   r9, qword ptr [rcx]
+    mov   r11, qword ptr gs:[r9]
     test r11, r11
     jz   _allocate_custom_tls_and_continue
 _custom_tls_ready:
 ENDM
 
+COMMENT @ allocate_custom_tls also stores the result in the TLS slot.
+@
 MacroTLSAllocate MACRO
 _allocate_custom_tls_and_continue:
     push r8
-    push rax
     push rdx
-    sub rsp, 32
+    sub rsp, 40
     call allocate_custom_tls
-    add rsp, 32
+    add rsp, 40
     mov r11, rax
     pop rdx
-    pop rax
     pop r8
-    mov qword ptr [rax], r11
     jmp _custom_tls_ready
 ENDM
 
+COMMENT @ rdtscp leaves TSC_AUX (CPU number) in ecx, which goes to every written record before its
+  timestamp. Profiler instance isn't needed anymore at that point, so rcx is free.
+@
+MacroReadTimestamp MACRO
+IF LOP_CPU_ID
+    rdtscp
+ELSE
+    rdtsc
+ENDIF
+ENDM
+
+MacroStoreCpu MACRO record
+IF LOP_CPU_ID
+    mov  [record].Event.tsc_aux, ecx
+ENDIF
+ENDM
+
 INTERLOCKED_ADD equ xadd
 
 IF LOP_SAFER
 
-IF LOP_SAFER_LOSSLESS
-    INTERLOCKED_ADD equ lock xadd
-ENDIF
-
+COMMENT @ exhaustion_handler swaps the table of this thread only, so plain xadd is enough and the
+  emission goes on in the new table afterwards.
+@
     MacroExhaustionCheck MACRO
         mov   r9, [r11].EventBuffer.next_event
-        sub   r9, [r11].EventBuffer.events
-        cmp   r9, LOP_BUFFER_SIZE * SIZEOF Event
+        cmp   r9, [r11].EventBuffer.events_end
         jnb   _handle_fallback
     _fallback_handled:
     ENDM
 
     MacroExhaustionFallback MACRO
     _handle_fallback:
-IF LOP_SAFER_LOSSLESS
         push r11
         push r8
         push rax
         push rdx
-ENDIF
         mov rcx, r11
         sub rsp, 40
         call exhaustion_handler
         add rsp, 40
-IF LOP_SAFER_LOSSLESS
         pop rdx
         pop rax
         pop r8
         pop r11
         jmp _fallback_handled
-ELSE
-        ret
-ENDIF
+    ENDM
+
+ELSEIF LOP_RING
+
+    MacroExhaustionCheck MACRO
+        mov   r9, [r11].EventBuffer.next_event
+        cmp   r9, [r11].EventBuffer.events_end
+        jnb   _handle_fallback
+    _fallback_handled:
+    ENDM
+
+    MacroExhaustionFallback MACRO
+    _handle_fallback:
+        add   [r11].EventBuffer.wrap_sequence, 1
+        mov   [r11].EventBuffer.wrap_end, r9
+        mov   r9, [r11].EventBuffer.events
+        mov   [r11].EventBuffer.next_event, r9
+        add   [r11].EventBuffer.wrap_sequence, 1
+        jmp   _fallback_handled
+    ENDM
+
+ELSEIF LOP_STREAMING
+
+    MacroExhaustionCheck MACRO
+        mov   r9, [r11].EventBuffer.next_event
+        cmp   r9, [r11].EventBuffer.events_end
+        jnb   _handle_fallback
+    _fallback_handled:
+    ENDM
+
+    MacroExhaustionFallback MACRO
+    _handle_fallback:
+        push r11
+        push r8
+        push rax
+        push rdx
+        mov rcx, r11
+        sub rsp, 40
+        call stream_handler
+        add rsp, 40
+        pop rdx
+        pop rax
+        pop r8
+        pop r11
+        jmp _fallback_handled
     ENDM
 
 ELSE
@@ -191,6 +285,8 @@ _asm_get_tid PROC
 	ret
 _asm_get_tid ENDP
 
+IF LOP_COMPACT_EVENTS EQ 0
+
 ALIGN 16
 _asm_emit_begin_event PROC ; profiler_instance: QWORD, event_name: QWORD
     MacroTLSCheck
@@ -200,7 +296,8 @@ _asm_emit_begin_event PROC ; profiler_instance: QWORD, event_name: QWORD
     INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
     mov  [r9].Event.event_name, rdx
     mov  [r9].Event.event_type, CALL_BEGIN
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -219,7 +316,8 @@ _asm_emit_end_event PROC ; profiler_instance: QWORD, event_name: QWORD
     INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
     mov  [r9].Event.event_name, rdx
     mov  [r9].Event.event_type, CALL_END
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -238,10 +336,12 @@ _asm_emit_endbegin_event PROC ; profiler_instance: QWORD, end_name: QWORD, begin
     INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
     lea  r10, [r9 + SIZEOF Event]
     mov  [r9].Event.event_name, rdx
-    mov  [r9].Event.event_type, CALL_END
+    mov  [r9].Event.event_type, CALL_END OR EVENT_ENDBEGIN_CALL
     mov  [r10].Event.event_name, r8
     mov  [r10].Event.event_type, CALL_BEGIN
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
+    MacroStoreCpu r10
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -262,10 +362,12 @@ _asm_emit_immediate_event PROC ; profiler_instance: QWORD, event_name: QWORD
     INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
     lea  r10, [r9 + SIZEOF Event]
     mov  [r9].Event.event_name, rdx
-    mov  [r9].Event.event_type, CALL_END
+    mov  [r9].Event.event_type, CALL_END OR EVENT_IMMEDIATE_CALL
     mov  [r10].Event.event_name, rdx
     mov  [r10].Event.event_type, CALL_BEGIN
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
+    MacroStoreCpu r10
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -287,7 +389,8 @@ _asm_emit_begin_meta_event PROC ; profiler_instance: QWORD, event_name: QWORD, m
     mov  [r9].Event.event_name, rdx
     mov  [r9].Event.event_type, CALL_BEGIN_META
     mov  [r9].Event.metadata, r8
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -307,7 +410,8 @@ _asm_emit_end_meta_event PROC ; profiler_instance: QWORD, event_name: QWORD, met
     mov  [r9].Event.event_name, rdx
     mov  [r9].Event.event_type, CALL_END_META
     mov  [r9].Event.metadata, r8
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -327,7 +431,8 @@ _asm_emit_counter_event PROC ; profiler_instance: QWORD, event_name: QWORD, coun
     mov  [r9].Event.event_name, rdx
     mov  [r9].Event.event_type, COUNTER_INT
     mov  [r9].Event.metadata, r8
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -346,12 +451,14 @@ _asm_emit_immediate_meta_event PROC ; profiler_instance: QWORD, event_name: QWOR
     INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
     lea  r10, [r9 + SIZEOF Event]
     mov  [r9].Event.event_name, rdx
-    mov  [r9].Event.event_type, CALL_END_META
+    mov  [r9].Event.event_type, CALL_END_META OR EVENT_IMMEDIATE_CALL
     mov  [r9].Event.metadata, r8
     mov  [r10].Event.event_name, rdx
     mov  [r10].Event.event_type, CALL_BEGIN_META
     mov  [r10].Event.metadata, r8
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
+    MacroStoreCpu r10
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -380,7 +487,10 @@ _asm_emit_flow_start_event PROC ; profiler_instance: QWORD, event_name: QWORD, f
     mov  [r11].Event.event_name, rdx
     mov  [r11].Event.event_type, CALL_END_META
     mov  [r11].Event.metadata,   r8
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
+    MacroStoreCpu r10
+    MacroStoreCpu r11
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -411,7 +521,10 @@ _asm_emit_flow_finish_event PROC ; profiler_instance: QWORD, event_name: QWORD,
     mov  [r11].Event.event_name, rdx
     mov  [r11].Event.event_type, CALL_END_META
     mov  [r11].Event.metadata,   r8
-    rdtsc
+    MacroReadTimestamp
+    MacroStoreCpu r9
+    MacroStoreCpu r10
+    MacroStoreCpu r11
     shl  rdx, 32
     or   rax, rdx
     mov  [r9].Event.timestamp, rax
@@ -425,6 +538,252 @@ _asm_emit_flow_finish_event PROC ; profiler_instance: QWORD, event_name: QWORD,
     MacroExhaustionFallback
 _asm_emit_flow_finish_event ENDP
 
+ELSE ; LOP_COMPACT_EVENTS
+
+COMMENT @ Compact layout emitters. Timestamp is shifted left and combined with the event type, so every
+ record header is a single qword store. Metadata goes to the extension record right after header.
+@
+
+ALIGN 16
+_asm_emit_begin_event PROC ; profiler_instance: QWORD, event_name: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    mov  [r9].Event.event_name, rdx
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    or   rax, CALL_BEGIN
+    mov  [r9].Event.timestamp_type, rax
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_begin_event ENDP
+
+ALIGN 16
+_asm_emit_end_event PROC ; profiler_instance: QWORD, event_name: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    mov  [r9].Event.event_name, rdx
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    or   rax, CALL_END
+    mov  [r9].Event.timestamp_type, rax
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_end_event ENDP
+
+ALIGN 16
+_asm_emit_endbegin_event PROC ; profiler_instance: QWORD, end_name: QWORD, begin_name: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, 2 * SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    lea  r10, [r9 + SIZEOF Event]
+    mov  [r9].Event.event_name, rdx
+    mov  [r10].Event.event_name, r8
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    lea  rdx, [rax + CALL_END + EVENT_ENDBEGIN_CALL]
+    mov  [r9].Event.timestamp_type, rdx
+    lea  rdx, [rax + CALL_BEGIN + (1 SHL COMPACT_TYPE_BITS)]
+    mov  [r10].Event.timestamp_type, rdx
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_endbegin_event ENDP
+
+ALIGN 16
+_asm_emit_immediate_event PROC ; profiler_instance: QWORD, event_name: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, 2 * SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    lea  r10, [r9 + SIZEOF Event]
+    mov  [r9].Event.event_name, rdx
+    mov  [r10].Event.event_name, rdx
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    lea  rdx, [rax + CALL_END + EVENT_IMMEDIATE_CALL]
+    mov  [r9].Event.timestamp_type, rdx
+    lea  rdx, [rax + CALL_BEGIN + (10 SHL COMPACT_TYPE_BITS)]
+    mov  [r10].Event.timestamp_type, rdx
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_immediate_event ENDP
+
+ALIGN 16
+_asm_emit_begin_meta_event PROC ; profiler_instance: QWORD, event_name: QWORD, metadata: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, 2 * SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    mov  [r9].Event.event_name, rdx
+    mov  [r9 + SIZEOF Event].Event.timestamp_type, r8
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    or   rax, CALL_BEGIN_META
+    mov  [r9].Event.timestamp_type, rax
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_begin_meta_event ENDP
+
+ALIGN 16
+_asm_emit_end_meta_event PROC ; profiler_instance: QWORD, event_name: QWORD, metadata: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, 2 * SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    mov  [r9].Event.event_name, rdx
+    mov  [r9 + SIZEOF Event].Event.timestamp_type, r8
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    or   rax, CALL_END_META
+    mov  [r9].Event.timestamp_type, rax
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_end_meta_event ENDP
+
+ALIGN 16
+_asm_emit_counter_event PROC ; profiler_instance: QWORD, event_name: QWORD, count: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, 2 * SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    mov  [r9].Event.event_name, rdx
+    mov  [r9 + SIZEOF Event].Event.timestamp_type, r8
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    or   rax, COUNTER_INT
+    mov  [r9].Event.timestamp_type, rax
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_counter_event ENDP
+
+ALIGN 16
+_asm_emit_immediate_meta_event PROC ; profiler_instance: QWORD, event_name: QWORD, metadata: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, 4 * SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    lea  r10, [r9 + 2 * SIZEOF Event]
+    mov  [r9].Event.event_name, rdx
+    mov  [r9 + SIZEOF Event].Event.timestamp_type, r8
+    mov  [r10].Event.event_name, rdx
+    mov  [r10 + SIZEOF Event].Event.timestamp_type, r8
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    lea  rdx, [rax + CALL_END_META + EVENT_IMMEDIATE_CALL]
+    mov  [r9].Event.timestamp_type, rdx
+    lea  rdx, [rax + CALL_BEGIN_META + (10 SHL COMPACT_TYPE_BITS)]
+    mov  [r10].Event.timestamp_type, rdx
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_immediate_meta_event ENDP
+
+ALIGN 16
+_asm_emit_flow_start_event PROC ; profiler_instance: QWORD, event_name: QWORD, flow_id: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, 5 * SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    lea  r10, [r9 + 2 * SIZEOF Event]
+    lea  r11, [r9 + 3 * SIZEOF Event]
+    mov  [r9].Event.event_name, rdx
+    mov  [r9 + SIZEOF Event].Event.timestamp_type, r8
+    mov  [r10].Event.event_name, r8
+    mov  [r11].Event.event_name, rdx
+    mov  [r11 + SIZEOF Event].Event.timestamp_type, r8
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    lea  rdx, [rax + CALL_BEGIN_META]
+    mov  [r9].Event.timestamp_type, rdx
+    lea  rdx, [rax + FLOW_START + (5 SHL COMPACT_TYPE_BITS)]
+    mov  [r10].Event.timestamp_type, rdx
+    lea  rdx, [rax + CALL_END_META + (10 SHL COMPACT_TYPE_BITS)]
+    mov  [r11].Event.timestamp_type, rdx
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_flow_start_event ENDP
+
+ALIGN 16
+_asm_emit_flow_finish_event PROC ; profiler_instance: QWORD, event_name: QWORD, flow_id: QWORD
+    MacroTLSCheck
+    MacroExhaustionCheck
+
+    mov   r9, 5 * SIZEOF Event
+    INTERLOCKED_ADD  [r11].EventBuffer.next_event, r9
+    lea  r10, [r9 + 2 * SIZEOF Event]
+    lea  r11, [r9 + 3 * SIZEOF Event]
+    mov  [r9].Event.event_name, rdx
+    mov  [r9 + SIZEOF Event].Event.timestamp_type, r8
+    mov  [r10].Event.event_name, r8
+    mov  [r11].Event.event_name, rdx
+    mov  [r11 + SIZEOF Event].Event.timestamp_type, r8
+    rdtsc
+    shl  rdx, 32
+    or   rax, rdx
+    shl  rax, COMPACT_TYPE_BITS
+    lea  rdx, [rax + CALL_BEGIN_META]
+    mov  [r9].Event.timestamp_type, rdx
+    lea  rdx, [rax + FLOW_FINISH + (5 SHL COMPACT_TYPE_BITS)]
+    mov  [r10].Event.timestamp_type, rdx
+    lea  rdx, [rax + CALL_END_META + (10 SHL COMPACT_TYPE_BITS)]
+    mov  [r11].Event.timestamp_type, rdx
+    ret
+
+    MacroTLSAllocate
+    MacroExhaustionFallback
+_asm_emit_flow_finish_event ENDP
+
+ENDIF ; LOP_COMPACT_EVENTS
+
+
 OPTION PROLOGUE:PrologueDef
 OPTION EPILOGUE:EpilogueDef
 
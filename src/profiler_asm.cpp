@@ -42,11 +42,30 @@
 #include <unistd.h>
 #include <stddef.h>
 
-// To enable "safer" mode, set LOP_SAFER to true and make sure
-// that LOP_BUFFER_SIZE is equal to the one set up in profiler.cpp
+// To enable "safer" mode, set LOP_SAFER to true.
+#ifndef LOP_SAFER
 #define LOP_SAFER false
-#define LOP_SAFER_LOSSLESS false
-#define LOP_BUFFER_SIZE 0x400000U
+#endif
+
+// Must match LOP_COMPACT_EVENTS from profiler.h.
+#ifndef LOP_COMPACT_EVENTS
+#define LOP_COMPACT_EVENTS false
+#endif
+
+// Must match LOP_RING from profiler.h.
+#ifndef LOP_RING
+#define LOP_RING false
+#endif
+
+// Must match LOP_STREAMING from profiler.h.
+#ifndef LOP_STREAMING
+#define LOP_STREAMING false
+#endif
+
+// Must match LOP_CPU_ID from profiler.h.
+#ifndef LOP_CPU_ID
+#define LOP_CPU_ID false
+#endif
 
 struct CustomTLS;
 struct ProfilerEngine;
@@ -61,22 +80,59 @@ enum event_type : uint32_t {
     FLOW_FINISH,
 };
 
+// Set above the type of the first record of immediate and end-begin calls, must match profiler_dump.h.
+#define EVENT_IMMEDIATE_CALL 0x40
+#define EVENT_ENDBEGIN_CALL 0x80
+
+#if LOP_COMPACT_EVENTS
+#define COMPACT_TYPE_BITS 8
+
+struct Event {
+    uint64_t timestamp_type;
+    const char* name;
+};
+#else
 struct Event {
     uint64_t timestamp;
     const char* name;
     uint64_t metadata;
     event_type type;
+    uint32_t tsc_aux;
 };
+#endif
 
 struct EventBuffer {
     Event* next_event;
     Event* events;
-    Event* events_backup;
+    void* spare_table;
     uint64_t thread_id;
+    Event* events_end;
+    Event* wrap_end;
+    uint64_t wrap_sequence;
 };
 
+// Ring mode wrap path doesn't get these as operands, so they are fixed.
+#define EVENT_BUFFER_WRAP_END 40
+#define EVENT_BUFFER_WRAP_SEQUENCE 48
+static_assert(offsetof(EventBuffer, wrap_end) == EVENT_BUFFER_WRAP_END, "Update EVENT_BUFFER_WRAP_END.");
+static_assert(offsetof(EventBuffer, wrap_sequence) == EVENT_BUFFER_WRAP_SEQUENCE, "Update EVENT_BUFFER_WRAP_SEQUENCE.");
+
+#if LOP_CPU_ID
+// rdtscp leaves TSC_AUX (CPU number and NUMA node) in ecx, which goes to every written record before
+// its timestamp. Emitters take at most 3 arguments, so rcx is free.
+#define EVENT_TSC_AUX 28
+static_assert(offsetof(Event, tsc_aux) == EVENT_TSC_AUX, "Update EVENT_TSC_AUX.");
+
+#define MacroReadTimestamp "rdtscp\n\t"
+#define MacroStoreCpu(record) "movl %%ecx, " TOSTRING(EVENT_TSC_AUX) "(" record ")\n\t"
+#else
+#define MacroReadTimestamp "rdtsc\n\t"
+#define MacroStoreCpu(record) ""
+#endif
+
 extern CustomTLS* allocate_custom_tls();
 extern void exhaustion_handler(EventBuffer*);
+extern void stream_handler(EventBuffer*);
 
 #define CONCAT(A, B) A##B
 #define TOSTRING(s) _TOSTRING(s)
@@ -86,45 +142,78 @@ extern void exhaustion_handler(EventBuffer*);
 
 #if LOP_SAFER
 
-#if LOP_SAFER_LOSSLESS
-#define INTERLOCKED_ADD "lock xaddq"
+// "Safer" mode. exhaustion_handler swaps the table of this thread only, so nobody else touches
+// next_event and plain xadd is enough. Arguments are preserved around the call and the emission
+// goes on in the new table afterwards.
+#define MacroExhaustionCheck(label_prefix)                                          \
+    "movq %c0(%%r11), %%r9\n\t"                                                     \
+    "cmp  %c2(%%r11), %%r9\n\t"                                                     \
+    "jae " TOSTRING(CONCAT(label_prefix,_handle_fallback)) "\n\t"                   \
+TOSTRING(CONCAT(label_prefix,_fallback_handled)) ":\n\t"
 
-#define MacroExhaustionPreHandler                                                   \
+#define MacroExhaustionFallback(label_prefix)                                       \
+TOSTRING(CONCAT(label_prefix,_handle_fallback)) ":\n\t"                             \
     "push %%r11\n\t"                                                                \
     "push %%rdx\n\t"                                                                \
     "push %%rax\n\t"                                                                \
-    "push %%rsi\n\t"
-
-#define MacroExhaustionPostHandler(label_prefix)                                    \
+    "push %%rsi\n\t"                                                                \
+    "movq %%r11, %%rdi\n\t"                                                         \
+    "sub  $40, %%rsp\n\t"                                                           \
+    "call exhaustion_handler\n\t"                                                   \
+    "add  $40, %%rsp\n\t"                                                           \
     "pop  %%rsi\n\t"                                                                \
     "pop  %%rax\n\t"                                                                \
     "pop  %%rdx\n\t"                                                                \
     "pop  %%r11\n\t"                                                                \
     "jmp " TOSTRING(CONCAT(label_prefix,_fallback_handled)) "\n\t"
 
-#else // LOP_SAFER_LOSSLESS
+#elif LOP_RING
+
+// Ring mode. When the end of the table is reached, next_event goes back to its start and position
+// of the wrap is remembered, so that snapshot can tell where the older lap ends. The branch is
+// practically always not taken, so it costs close to nothing. Wrap is surrounded by wrap_sequence
+// increments (seqlock style), so that snapshot can read the position consistently.
+#define MacroExhaustionCheck(label_prefix)                                          \
+    "movq %c0(%%r11), %%r9\n\t"                                                     \
+    "cmp  %c2(%%r11), %%r9\n\t"                                                     \
+    "jae " TOSTRING(CONCAT(label_prefix,_handle_fallback)) "\n\t"                   \
+TOSTRING(CONCAT(label_prefix,_fallback_handled)) ":\n\t"
 
-#define MacroExhaustionPreHandler ""
-#define MacroExhaustionPostHandler(label_prefix)                                    \
-    "ret\n\t"
+#define MacroExhaustionFallback(label_prefix)                                       \
+TOSTRING(CONCAT(label_prefix,_handle_fallback)) ":\n\t"                             \
+    "addq $1, " TOSTRING(EVENT_BUFFER_WRAP_SEQUENCE) "(%%r11)\n\t"                  \
+    "movq %%r9, " TOSTRING(EVENT_BUFFER_WRAP_END) "(%%r11)\n\t"                     \
+    "movq %c1(%%r11), %%r9\n\t"                                                     \
+    "movq %%r9, %c0(%%r11)\n\t"                                                     \
+    "addq $1, " TOSTRING(EVENT_BUFFER_WRAP_SEQUENCE) "(%%r11)\n\t"                  \
+    "jmp " TOSTRING(CONCAT(label_prefix,_fallback_handled)) "\n\t"
 
-#endif // LOP_SAFER_LOSSLESS
+#elif LOP_STREAMING
 
+// Streaming mode. events_end is where the thread would catch up with the drain thread (or the end
+// of the table), stream_handler wraps the table or waits until there is space, so the emission
+// goes on afterwards. Arguments are preserved around the call, same as in "safer" mode.
 #define MacroExhaustionCheck(label_prefix)                                          \
     "movq %c0(%%r11), %%r9\n\t"                                                     \
-    "sub  %c1(%%r11), %%r9\n\t"                                                     \
-    "cmp  %2, %%r9\n\t"                                                             \
-    "jz " TOSTRING(CONCAT(label_prefix,_handle_fallback)) "\n\t"                    \
+    "cmp  %c2(%%r11), %%r9\n\t"                                                     \
+    "jae " TOSTRING(CONCAT(label_prefix,_handle_fallback)) "\n\t"                   \
 TOSTRING(CONCAT(label_prefix,_fallback_handled)) ":\n\t"
 
 #define MacroExhaustionFallback(label_prefix)                                       \
 TOSTRING(CONCAT(label_prefix,_handle_fallback)) ":\n\t"                             \
-    MacroExhaustionPreHandler                                                       \
+    "push %%r11\n\t"                                                                \
+    "push %%rdx\n\t"                                                                \
+    "push %%rax\n\t"                                                                \
+    "push %%rsi\n\t"                                                                \
     "movq %%r11, %%rdi\n\t"                                                         \
     "sub  $40, %%rsp\n\t"                                                           \
-    "call exhaustion_handler\n\t"                                                   \
+    "call stream_handler\n\t"                                                       \
     "add  $40, %%rsp\n\t"                                                           \
-    MacroExhaustionPostHandler(label_prefix)
+    "pop  %%rsi\n\t"                                                                \
+    "pop  %%rax\n\t"                                                                \
+    "pop  %%rdx\n\t"                                                                \
+    "pop  %%r11\n\t"                                                                \
+    "jmp " TOSTRING(CONCAT(label_prefix,_fallback_handled)) "\n\t"
 
 #else // LOP_SAFER
 
@@ -133,30 +222,26 @@ TOSTRING(CONCAT(label_prefix,_handle_fallback)) ":\n\t"
 
 #endif // LOP_SAFER
 
+// Custom TLS of the thread is kept in initial-exec thread_local lop_custom_tls (see profiler.cpp),
+// so it's unique for every thread. In executables linker turns the GOT load into immediate.
 #define MacroTLSCheck(label_prefix)                                                 \
-    "movq %%fs:0x10, %%r9\n\t"                                                      \
-    "movq (%%rdi), %%rdi\n\t"                                                       \
-    "shr  $12, %%r9\n\t"                                                            \
-    "and  $0xFFFF, %%r9\n\t"                                                        \
-    "lea  (%%rdi, %%r9, 8), %%rax\n\t"                                              \
-    "movq (%%rax), %%r11\n\t"                                                       \
+    "movq lop_custom_tls@gottpoff(%%rip), %%r11\n\t"                                \
+    "movq %%fs:(%%r11), %%r11\n\t"                                                  \
     "test %%r11, %%r11\n\t"                                                         \
     "jz " TOSTRING(CONCAT(label_prefix,_allocate_custom_tls_and_continue)) "\n\t"   \
 TOSTRING(CONCAT(label_prefix,_custom_tls_ready)) ":\n\t"
 
+// allocate_custom_tls also stores the result in lop_custom_tls.
 #define MacroTLSAllocate(label_prefix)    \
 TOSTRING(CONCAT(label_prefix,_allocate_custom_tls_and_continue)) ":\n\t"  \
     "push %%rdx\n\t"                                                      \
-    "push %%rax\n\t"                                                      \
     "push %%rsi\n\t"                                                      \
-    "sub  $32, %%rsp\n\t"                                                 \
+    "sub  $40, %%rsp\n\t"                                                 \
     "call allocate_custom_tls\n\t"                                        \
-    "add  $32, %%rsp\n\t"                                                 \
+    "add  $40, %%rsp\n\t"                                                 \
     "mov  %%rax, %%r11\n\t"                                               \
     "pop  %%rsi\n\t"                                                      \
-    "pop  %%rax\n\t"                                                      \
     "pop  %%rdx\n\t"                                                      \
-    "movq %%r11, (%%rax)\n\t"                                             \
     "jmp " TOSTRING(CONCAT(label_prefix,_custom_tls_ready)) "\n\t"
 
 extern "C" __attribute__((naked)) uint64_t _asm_fast_rdtsc() {
@@ -173,6 +258,8 @@ extern "C" __attribute__((naked)) uint64_t _asm_get_tid() {
         "ret");
 }
 
+#if !LOP_COMPACT_EVENTS
+
 extern "C" __attribute__((naked)) void _asm_emit_begin_event(ProfilerEngine*, const char*) {
     __asm__ __volatile__(
         MacroTLSCheck(_asm_emit_begin_event)
@@ -181,14 +268,15 @@ extern "C" __attribute__((naked)) void _asm_emit_begin_event(ProfilerEngine*, co
         INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
         "movq %%rsi, %c4(%%r9)\n\t"
         "movq %5, %c6(%%r9)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c7(%%r9)\n\t"
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_begin_event)
         MacroExhaustionFallback(_asm_emit_begin_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
             "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_BEGIN), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)) :
     );
 }
@@ -201,14 +289,15 @@ extern "C" __attribute__((naked)) void _asm_emit_end_event(ProfilerEngine*, cons
         INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
         "movq %%rsi, %c4(%%r9)\n\t"
         "movq %5, %c6(%%r9)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c7(%%r9)\n\t"
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_end_event)
         MacroExhaustionFallback(_asm_emit_end_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
             "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_END), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)) :
     );
 }
@@ -224,7 +313,9 @@ extern "C" __attribute__((naked)) void _asm_emit_endbegin_event(ProfilerEngine*,
         "movq %5, %c6(%%r9)\n\t"
         "movq %%rdx, %c4(%%r10)\n\t"
         "movq %8, %c6(%%r10)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
+        MacroStoreCpu("%%r10")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c7(%%r9)\n\t"
@@ -233,8 +324,8 @@ extern "C" __attribute__((naked)) void _asm_emit_endbegin_event(ProfilerEngine*,
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_endbegin_event)
         MacroExhaustionFallback(_asm_emit_endbegin_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
-            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_END), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_END | EVENT_ENDBEGIN_CALL), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)),
             "i" (CALL_BEGIN) :
     );
 }
@@ -250,7 +341,9 @@ extern "C" __attribute__((naked)) void _asm_emit_immediate_event(ProfilerEngine*
         "movq %5, %c6(%%r9)\n\t"
         "movq %%rsi, %c4(%%r10)\n\t"
         "movq %8, %c6(%%r10)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
+        MacroStoreCpu("%%r10")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c7(%%r9)\n\t"
@@ -259,8 +352,8 @@ extern "C" __attribute__((naked)) void _asm_emit_immediate_event(ProfilerEngine*
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_immediate_event)
         MacroExhaustionFallback(_asm_emit_immediate_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
-            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_END), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_END | EVENT_IMMEDIATE_CALL), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)),
             "i" (CALL_BEGIN) :
     );
 }
@@ -274,14 +367,15 @@ extern "C" __attribute__((naked)) void _asm_emit_begin_meta_event(ProfilerEngine
         "movq %%rsi, %c4(%%r9)\n\t"
         "movq %5, %c6(%%r9)\n\t"
         "movq %%rdx, %c7(%%r9)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c8(%%r9)\n\t"
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_begin_meta_event)
         MacroExhaustionFallback(_asm_emit_begin_meta_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
             "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_BEGIN_META), "i" (offsetof(Event, type)), "i" (offsetof(Event, metadata)),
             "i" (offsetof(Event, timestamp)) :
     );
@@ -296,14 +390,15 @@ extern "C" __attribute__((naked)) void _asm_emit_end_meta_event(ProfilerEngine*,
         "movq %%rsi, %c4(%%r9)\n\t"
         "movq %5, %c6(%%r9)\n\t"
         "movq %%rdx, %c7(%%r9)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c8(%%r9)\n\t"
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_end_meta_event)
         MacroExhaustionFallback(_asm_emit_end_meta_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
             "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_END_META), "i" (offsetof(Event, type)), "i" (offsetof(Event, metadata)),
             "i" (offsetof(Event, timestamp)) :
     );
@@ -318,14 +413,15 @@ extern "C" __attribute__((naked)) void _asm_emit_counter_event(ProfilerEngine*,
         "movq %%rsi, %c4(%%r9)\n\t"
         "movq %5, %c6(%%r9)\n\t"
         "movq %%rdx, %c7(%%r9)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c8(%%r9)\n\t"
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_counter_event)
         MacroExhaustionFallback(_asm_emit_counter_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
             "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COUNTER_INT), "i" (offsetof(Event, type)), "i" (offsetof(Event, metadata)),
             "i" (offsetof(Event, timestamp)) :
     );
@@ -344,7 +440,9 @@ extern "C" __attribute__((naked)) void _asm_emit_immediate_meta_event(ProfilerEn
         "movq %%rsi, %c4(%%r10)\n\t"
         "movq %8, %c6(%%r10)\n\t"
         "movq %%rdx, %c9(%%r10)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
+        MacroStoreCpu("%%r10")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c7(%%r9)\n\t"
@@ -353,8 +451,8 @@ extern "C" __attribute__((naked)) void _asm_emit_immediate_meta_event(ProfilerEn
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_immediate_meta_event)
         MacroExhaustionFallback(_asm_emit_immediate_meta_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
-            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_END_META), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_END_META | EVENT_IMMEDIATE_CALL), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)),
             "i" (CALL_BEGIN_META), "i" (offsetof(Event, metadata)) :
     );
 }
@@ -375,7 +473,10 @@ extern "C" __attribute__((naked)) void _asm_emit_flow_start_event(ProfilerEngine
         "movq %%rsi, %c4(%%r11)\n\t"
         "movq %10, %c6(%%r11)\n\t"
         "movq %%rdx, %c9(%%r11)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
+        MacroStoreCpu("%%r10")
+        MacroStoreCpu("%%r11")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c7(%%r9)\n\t"
@@ -386,7 +487,7 @@ extern "C" __attribute__((naked)) void _asm_emit_flow_start_event(ProfilerEngine
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_flow_start_event)
         MacroExhaustionFallback(_asm_emit_flow_start_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
             "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_BEGIN_META), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)),
             "i" (FLOW_START), "i" (offsetof(Event, metadata)), "i" (CALL_END_META) :
     );
@@ -408,7 +509,10 @@ extern "C" __attribute__((naked)) void _asm_emit_flow_finish_event(ProfilerEngin
         "movq %%rsi, %c4(%%r11)\n\t"
         "movq %10, %c6(%%r11)\n\t"
         "movq %%rdx, %c9(%%r11)\n\t"
-        "rdtsc\n\t"
+        MacroReadTimestamp
+        MacroStoreCpu("%%r9")
+        MacroStoreCpu("%%r10")
+        MacroStoreCpu("%%r11")
         "shl $32, %%rdx\n\t"
         "or %%rdx, %%rax\n\t"
         "movq %%rax, %c7(%%r9)\n\t"
@@ -419,8 +523,260 @@ extern "C" __attribute__((naked)) void _asm_emit_flow_finish_event(ProfilerEngin
         "ret\n\t"
         MacroTLSAllocate(_asm_emit_flow_finish_event)
         MacroExhaustionFallback(_asm_emit_flow_finish_event)
-        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (LOP_BUFFER_SIZE * sizeof(Event)),
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
             "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (CALL_BEGIN_META), "i" (offsetof(Event, type)), "i" (offsetof(Event, timestamp)),
             "i" (FLOW_FINISH), "i" (offsetof(Event, metadata)), "i" (CALL_END_META) :
     );
 }
+
+#else // !LOP_COMPACT_EVENTS
+
+// Compact layout emitters. Timestamp is shifted left and combined with the event type, so every
+// record header is a single qword store. Metadata goes to the extension record right after header.
+
+extern "C" __attribute__((naked)) void _asm_emit_begin_event(ProfilerEngine*, const char*) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_begin_event)
+        MacroExhaustionCheck(_asm_emit_begin_event)
+        "movq %3, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "or %6, %%rax\n\t"
+        "movq %%rax, %c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_begin_event)
+        MacroExhaustionFallback(_asm_emit_begin_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_BEGIN), "i" (offsetof(Event, timestamp_type)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_end_event(ProfilerEngine*, const char*) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_end_event)
+        MacroExhaustionCheck(_asm_emit_end_event)
+        "movq %3, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "or %6, %%rax\n\t"
+        "movq %%rax, %c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_end_event)
+        MacroExhaustionFallback(_asm_emit_end_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_END), "i" (offsetof(Event, timestamp_type)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_endbegin_event(ProfilerEngine*, const char*, const char*) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_endbegin_event)
+        MacroExhaustionCheck(_asm_emit_endbegin_event)
+        "movq %3*2, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "movq %%rdx, %c3+%c4(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "lea %c6(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c7(%%r9)\n\t"
+        "lea %c8(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c3+%c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_endbegin_event)
+        MacroExhaustionFallback(_asm_emit_endbegin_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_END | EVENT_ENDBEGIN_CALL), "i" (offsetof(Event, timestamp_type)),
+            "i" (CALL_BEGIN + (1 << COMPACT_TYPE_BITS)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_immediate_event(ProfilerEngine*, const char*) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_immediate_event)
+        MacroExhaustionCheck(_asm_emit_immediate_event)
+        "movq %3*2, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "movq %%rsi, %c3+%c4(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "lea %c6(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c7(%%r9)\n\t"
+        "lea %c8(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c3+%c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_immediate_event)
+        MacroExhaustionFallback(_asm_emit_immediate_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_END | EVENT_IMMEDIATE_CALL), "i" (offsetof(Event, timestamp_type)),
+            "i" (CALL_BEGIN + (10 << COMPACT_TYPE_BITS)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_begin_meta_event(ProfilerEngine*, const char*, uint64_t) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_begin_meta_event)
+        MacroExhaustionCheck(_asm_emit_begin_meta_event)
+        "movq %3*2, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "movq %%rdx, %c3(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "or %6, %%rax\n\t"
+        "movq %%rax, %c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_begin_meta_event)
+        MacroExhaustionFallback(_asm_emit_begin_meta_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_BEGIN_META), "i" (offsetof(Event, timestamp_type)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_end_meta_event(ProfilerEngine*, const char*, uint64_t) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_end_meta_event)
+        MacroExhaustionCheck(_asm_emit_end_meta_event)
+        "movq %3*2, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "movq %%rdx, %c3(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "or %6, %%rax\n\t"
+        "movq %%rax, %c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_end_meta_event)
+        MacroExhaustionFallback(_asm_emit_end_meta_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_END_META), "i" (offsetof(Event, timestamp_type)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_counter_event(ProfilerEngine*, const char*, uint64_t) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_counter_event)
+        MacroExhaustionCheck(_asm_emit_counter_event)
+        "movq %3*2, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "movq %%rdx, %c3(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "or %6, %%rax\n\t"
+        "movq %%rax, %c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_counter_event)
+        MacroExhaustionFallback(_asm_emit_counter_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (COUNTER_INT), "i" (offsetof(Event, timestamp_type)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_immediate_meta_event(ProfilerEngine*, const char*, uint64_t) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_immediate_meta_event)
+        MacroExhaustionCheck(_asm_emit_immediate_meta_event)
+        "movq %3*4, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "movq %%rdx, %c3(%%r9)\n\t"
+        "movq %%rsi, %c3*2+%c4(%%r9)\n\t"
+        "movq %%rdx, %c3*3(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "lea %c6(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c7(%%r9)\n\t"
+        "lea %c8(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c3*2+%c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_immediate_meta_event)
+        MacroExhaustionFallback(_asm_emit_immediate_meta_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_END_META | EVENT_IMMEDIATE_CALL), "i" (offsetof(Event, timestamp_type)),
+            "i" (CALL_BEGIN_META + (10 << COMPACT_TYPE_BITS)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_flow_start_event(ProfilerEngine*, const char*, uint64_t) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_flow_start_event)
+        MacroExhaustionCheck(_asm_emit_flow_start_event)
+        "movq %3*5, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "movq %%rdx, %c3(%%r9)\n\t"
+        "movq %%rdx, %c3*2+%c4(%%r9)\n\t"
+        "movq %%rsi, %c3*3+%c4(%%r9)\n\t"
+        "movq %%rdx, %c3*4(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "lea %c6(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c7(%%r9)\n\t"
+        "lea %c8(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c3*2+%c7(%%r9)\n\t"
+        "lea %c9(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c3*3+%c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_flow_start_event)
+        MacroExhaustionFallback(_asm_emit_flow_start_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_BEGIN_META), "i" (offsetof(Event, timestamp_type)),
+            "i" (FLOW_START + (5 << COMPACT_TYPE_BITS)), "i" (CALL_END_META + (10 << COMPACT_TYPE_BITS)) :
+    );
+}
+
+extern "C" __attribute__((naked)) void _asm_emit_flow_finish_event(ProfilerEngine*, const char*, uint64_t) {
+    __asm__ __volatile__(
+        MacroTLSCheck(_asm_emit_flow_finish_event)
+        MacroExhaustionCheck(_asm_emit_flow_finish_event)
+        "movq %3*5, %%r9\n\t"
+        INTERLOCKED_ADD " %%r9, %c0(%%r11)\n\t"
+        "movq %%rsi, %c4(%%r9)\n\t"
+        "movq %%rdx, %c3(%%r9)\n\t"
+        "movq %%rdx, %c3*2+%c4(%%r9)\n\t"
+        "movq %%rsi, %c3*3+%c4(%%r9)\n\t"
+        "movq %%rdx, %c3*4(%%r9)\n\t"
+        "rdtsc\n\t"
+        "shl $32, %%rdx\n\t"
+        "or %%rdx, %%rax\n\t"
+        "shl %5, %%rax\n\t"
+        "lea %c6(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c7(%%r9)\n\t"
+        "lea %c8(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c3*2+%c7(%%r9)\n\t"
+        "lea %c9(%%rax), %%rdx\n\t"
+        "movq %%rdx, %c3*3+%c7(%%r9)\n\t"
+        "ret\n\t"
+        MacroTLSAllocate(_asm_emit_flow_finish_event)
+        MacroExhaustionFallback(_asm_emit_flow_finish_event)
+        : : "i" (offsetof(EventBuffer, next_event)), "i" (offsetof(EventBuffer, events)), "i" (offsetof(EventBuffer, events_end)),
+            "i" (sizeof(Event)), "i" (offsetof(Event, name)), "i" (COMPACT_TYPE_BITS), "i" (CALL_BEGIN_META), "i" (offsetof(Event, timestamp_type)),
+            "i" (FLOW_FINISH + (5 << COMPACT_TYPE_BITS)), "i" (CALL_END_META + (10 << COMPACT_TYPE_BITS)) :
+    );
+}
+
+#endif // !LOP_COMPACT_EVENTS
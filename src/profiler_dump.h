@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) 2025 Krzysztof Badziak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Layout of the binary trace dump written by profiler_flush() when LOP_OUTPUT_FORMAT=binary
+// is set in the environment, or all the time in streaming mode (LOP_STREAMING). The dump is
+// just the raw in-memory event tables plus everything needed to interpret them later, so
+// writing it costs not much more than the disk bandwidth. Use tools/lop_convert.cpp to turn
+// it into a regular trace.
+//
+// File structure:
+//   DumpHeader
+//   DumpRecord + payload
+//   DumpRecord + payload
+//   ...
+//   DumpRecord (DUMP_RECORD_END, no payload)
+//
+// All values are stored in native (little-endian, x64) byte order.
+
+namespace LOP {
+
+constexpr char     DUMP_MAGIC[8] = { 'L', 'O', 'P', 'D', 'U', 'M', 'P', '\0' };
+constexpr uint32_t DUMP_VERSION  = 2; // 2 added call flags in event type, see DUMP_EVENT_TYPE_MASK.
+
+struct DumpHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t event_size;         // sizeof(Event) of the producer, DumpEvent or DumpCompactEvent.
+    uint64_t pid;
+    uint64_t tsc_enable;         // TSC value at profiler_enable() (or at last recovery).
+    uint64_t tsc_disable;        // TSC value at the moment of the dump.
+    int64_t  time_enable_ns;     // UNIX time matching tsc_enable.
+    int64_t  time_disable_ns;    // UNIX time matching tsc_disable.
+    double   ticks_per_ns_ratio; // Final calibration used to convert ticks to nanoseconds.
+};
+
+enum dump_record_type : uint32_t {
+    DUMP_RECORD_END,    // No payload, terminates the file.
+    DUMP_RECORD_STRING, // Payload: uint64_t name pointer, followed by string bytes (not terminated).
+                        // Also used for argument names and string argument values.
+    DUMP_RECORD_THREAD, // Payload: uint64_t thread_id, uint64_t record count, followed by raw event records.
+                        // Streamed dumps have many of these per thread, in chronological order.
+    DUMP_RECORD_CATEGORY, // Payload: uint64_t name pointer, followed by category name bytes (not terminated).
+    DUMP_RECORD_CLOCK_SYNC, // Payload: array of DumpClockSync, in any order.
+    DUMP_RECORD_CPU_IDS,  // Payload: int64_t TSC offset of every CPU against the reference one, empty if not measured.
+                          // Present only if events carry TSC_AUX, see DumpEvent.
+};
+
+struct DumpRecord {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t payload_size;
+};
+
+// Mirror of the LOP::Event structure from profiler.cpp, with the name stored as plain integer,
+// because pointers are meaningless outside of the process that produced them. Events with arguments
+// carry argument count as metadata and are followed by that many argument records, with argument
+// name in place of name and the value (string pointer for strings) in metadata.
+struct DumpEvent {
+    uint64_t timestamp;
+    uint64_t name;
+    uint64_t metadata;
+    uint32_t type;
+    uint32_t tsc_aux; // Padding, unless the dump has DUMP_RECORD_CPU_IDS.
+};
+
+// TSC_AUX as set up by Linux holds CPU number in its low bits and NUMA node above them.
+#define DUMP_TSC_AUX_CPU_BITS 12
+
+// Event type is in the low bits of type. First record of immediate and end-begin calls also has
+// one of the flags above it, as their records look the same as the ones of two separate calls.
+#define DUMP_EVENT_TYPE_MASK 0x3F
+#define DUMP_EVENT_IMMEDIATE_CALL 0x40
+#define DUMP_EVENT_ENDBEGIN_CALL 0x80
+
+// TSC paired with steady clock reading. Converter interpolates between consecutive sync points
+// instead of using ticks_per_ns_ratio, which is kept only as a fallback.
+struct DumpClockSync {
+    uint64_t tsc;
+    int64_t  time_ns;  // Steady clock, only differences between sync points matter.
+};
+
+// Mirror of the LOP::Event structure when LOP_COMPACT_EVENTS is enabled. Timestamp is truncated and
+// shifted left by DUMP_COMPACT_TYPE_BITS, low bits hold the type. Meta and counter events are followed
+// by an extension record with metadata in its first qword, and so are begins of sampled scopes, which
+// carry their weight. Flow markers keep flow ID in place of name.
+// Events with arguments carry argument count as metadata and are followed by that many argument
+// records, each with its own extension holding the value.
+#define DUMP_COMPACT_TYPE_BITS 8
+
+struct DumpCompactEvent {
+    uint64_t timestamp_type;
+    uint64_t name;
+};
+
+}
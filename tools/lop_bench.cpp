@@ -0,0 +1,276 @@
+/**
+ * Copyright (c) 2025 Krzysztof Badziak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Benchmark of the emitters and of the flush path. It's built together with the profiler, in the
+// mode you want to measure, so build it once per mode, e.g.:
+//
+//   g++ tools/lop_bench.cpp src/profiler_asm.cpp src/profiler.cpp -std=c++17 -Iinclude -O2 -pthread -o lop_bench
+//   g++ -DLOP_SAFER=true tools/lop_bench.cpp src/profiler_asm.cpp src/profiler.cpp -std=c++17 -Iinclude -O2 -pthread -o lop_bench_safer
+//
+// Usage: lop_bench [results.jsonl] [max_threads]
+//
+// Every result is written as a single JSON line, so results of different modes and releases can
+// simply be concatenated and compared. Traces produced meanwhile are written as usual.
+
+#include "profiler.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_CALLS 5000            // Emitter calls per round.
+#define BENCH_ROUNDS 8              // Best round is reported.
+#define BENCH_FLUSH_EVENTS 1000000  // Events in the flushed trace.
+#define BENCH_THREAD_EVENTS 100000  // Events per thread in scaling benchmark.
+#define BENCH_TLS_THREADS 32        // Threads started one by one to measure their first event.
+#define BENCH_EXHAUSTIONS 8         // Buffer exhaustions to measure in "safer" mode.
+#define BENCH_EXHAUSTION_BUFFER 0x40000ULL
+#define BENCH_PAUSE_NS 5000.0       // Emit calls slower than that are counted as recovery pauses.
+#define BENCH_RECORD_SIZE 32        // Size of the biggest event record, for buffer sizing.
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ns(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+struct Results {
+    FILE* file;
+    std::string mode;
+    std::string environment;
+
+    void add(const char* benchmark, const char* name, unsigned threads, double value, const char* unit) {
+        char line[512];
+        snprintf(line, sizeof(line),
+            "{\"mode\":\"%s\",\"env\":\"%s\",\"benchmark\":\"%s\",\"case\":\"%s\",\"threads\":%u,\"value\":%.3f,\"unit\":\"%s\"}\n",
+            mode.c_str(), environment.c_str(), benchmark, name, threads, value, unit);
+        fputs(line, file);
+        fflush(file);
+        printf("lop_bench: %s", line);
+        fflush(stdout);
+    }
+};
+
+static std::string build_mode() {
+    std::string mode;
+    auto add = [&mode](bool enabled, const char* name) {
+        if (!enabled) return;
+        if (!mode.empty()) mode += "+";
+        mode += name;
+    };
+    add(LOP_SAFER, "safer");
+    add(LOP_COMPACT_EVENTS, "compact");
+    add(LOP_RING, "ring");
+    add(LOP_STREAMING, "streaming");
+    add(LOP_AGGREGATE, "aggregate");
+    add(LOP_CPU_ID, "cpu_id");
+    add(LOP_INLINE_EMITTERS, "inline");
+    add(LOP_STATIC_KEYS, "static_keys");
+    return mode.empty() ? "default" : mode;
+}
+
+// Environment that changes the results, page faults especially.
+static std::string build_environment() {
+    std::string environment;
+    for (const char* name : { "LOP_PREFAULT", "LOP_PREFAULT_WINDOW", "LOP_HUGEPAGES", "LOP_OUTPUT_FORMAT" }) {
+        const char* value = getenv(name);
+        if (!value) continue;
+        if (!environment.empty()) environment += " ";
+        environment += std::string(name) + "=" + value;
+    }
+    return environment;
+}
+
+// Best of BENCH_ROUNDS, in nanoseconds per call.
+template <typename Emit>
+static double measure_calls(Emit emit) {
+    double best = 1e300;
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < BENCH_CALLS; ++i) emit(i);
+        auto end = Clock::now();
+        best = std::min(best, elapsed_ns(start, end) / BENCH_CALLS);
+    }
+    return best;
+}
+
+// Flush of a known number of events. It also faults in the event table of the main thread, which
+// is reused after the flush, so emitter benchmarks below don't measure page faults.
+static void bench_flush(Results& results) {
+    LOP::profiler_enable();
+    for (uint64_t i = 0; i < BENCH_FLUSH_EVENTS / 2; ++i) {
+        LOP::emit_begin_event("bench_flush");
+        LOP::emit_end_event("bench_flush");
+    }
+    LOP::profiler_disable();
+
+    auto start = Clock::now();
+    LOP::profiler_flush("bench_flush");
+    auto end = Clock::now();
+
+    // Enable and disable add two pairs of events.
+    double events = BENCH_FLUSH_EVENTS + 4;
+    results.add("flush", "flush_buffers", 1, events / (elapsed_ns(start, end) / 1e9), "events/s");
+}
+
+static void bench_emitters(Results& results) {
+    LOP::profiler_enable();
+    results.add("emit", "emit_begin_event", 1, measure_calls([](uint64_t) { LOP::emit_begin_event("bench"); }), "ns/call");
+    results.add("emit", "emit_end_event", 1, measure_calls([](uint64_t) { LOP::emit_end_event("bench"); }), "ns/call");
+    results.add("emit", "emit_immediate_event", 1, measure_calls([](uint64_t) { LOP::emit_immediate_event("bench"); }), "ns/call");
+    results.add("emit", "emit_endbegin_event", 1, measure_calls([](uint64_t) { LOP::emit_endbegin_event("bench", "bench"); }), "ns/call");
+    results.add("emit", "emit_begin_meta_event", 1, measure_calls([](uint64_t i) { LOP::emit_begin_meta_event("bench", i); }), "ns/call");
+    results.add("emit", "emit_end_meta_event", 1, measure_calls([](uint64_t i) { LOP::emit_end_meta_event("bench", i); }), "ns/call");
+    results.add("emit", "emit_immediate_meta_event", 1, measure_calls([](uint64_t i) { LOP::emit_immediate_meta_event("bench", i); }), "ns/call");
+    results.add("emit", "emit_counter_event", 1, measure_calls([](uint64_t i) { LOP::emit_counter_event("bench", i); }), "ns/call");
+    results.add("emit", "emit_flow_start_event", 1, measure_calls([](uint64_t i) { LOP::emit_flow_start_event("bench", i); }), "ns/call");
+    results.add("emit", "emit_flow_finish_event", 1, measure_calls([](uint64_t i) { LOP::emit_flow_finish_event("bench", i); }), "ns/call");
+    LOP::profiler_disable();
+
+    results.add("emit_disabled", "emit_begin_event", 1, measure_calls([](uint64_t) { LOP::emit_begin_event("bench"); }), "ns/call");
+}
+
+// All threads emit the same number of events at the same time. Their first event (and the buffer
+// allocation that comes with it) is done before the start.
+static void bench_scaling(Results& results, unsigned threads_count) {
+    std::atomic<unsigned> ready(0);
+    std::atomic<bool> start(false);
+    std::vector<double> thread_ns(threads_count);
+    std::vector<std::thread> threads;
+
+    for (unsigned thread_id = 0; thread_id < threads_count; ++thread_id) {
+        threads.emplace_back([&, thread_id]() {
+            LOP::emit_immediate_event("bench_scaling_start");
+            ++ready;
+            while (!start) std::this_thread::yield();
+
+            auto thread_start = Clock::now();
+            for (uint64_t i = 0; i < BENCH_THREAD_EVENTS / 2; ++i) {
+                LOP::emit_begin_event("bench_scaling");
+                LOP::emit_end_event("bench_scaling");
+            }
+            thread_ns[thread_id] = elapsed_ns(thread_start, Clock::now());
+        });
+    }
+
+    while (ready != threads_count) std::this_thread::yield();
+    start = true;
+    for (auto& thread : threads) thread.join();
+
+    double slowest_ns = *std::max_element(thread_ns.begin(), thread_ns.end());
+    double average_ns = 0;
+    for (double ns : thread_ns) average_ns += ns / threads_count;
+    results.add("scaling", "ns_per_event", threads_count, average_ns / BENCH_THREAD_EVENTS, "ns/event");
+    results.add("scaling", "throughput", threads_count, threads_count * BENCH_THREAD_EVENTS / (slowest_ns / 1e9), "events/s");
+}
+
+// First event of a thread allocates its custom TLS and event table.
+static void bench_first_event(Results& results) {
+    double total_ns = 0;
+    double slowest_ns = 0;
+    double next_ns = 0;
+    for (unsigned i = 0; i < BENCH_TLS_THREADS; ++i) {
+        std::thread([&]() {
+            auto first = Clock::now();
+            LOP::emit_begin_event("bench_first_event");
+            auto second = Clock::now();
+            LOP::emit_end_event("bench_first_event");
+            auto end = Clock::now();
+
+            total_ns += elapsed_ns(first, second);
+            slowest_ns = std::max(slowest_ns, elapsed_ns(first, second));
+            next_ns += elapsed_ns(second, end);
+        }).join();
+    }
+    results.add("first_event", "average", 1, total_ns / BENCH_TLS_THREADS, "ns/call");
+    results.add("first_event", "max", 1, slowest_ns, "ns/call");
+    results.add("first_event", "next_event", 1, next_ns / BENCH_TLS_THREADS, "ns/call");
+}
+
+#if LOP_SAFER
+// Thread with small event table runs into exhaustion again and again. The emit call that hits it
+// is paused until the tables are swapped.
+static void bench_exhaustion(Results& results) {
+    std::thread([&]() {
+        LOP::profiler_set_thread_buffer_size(BENCH_EXHAUSTION_BUFFER);
+
+        // Compact records are smaller, so there are half as many exhaustions with them.
+        const uint64_t events = BENCH_EXHAUSTIONS * BENCH_EXHAUSTION_BUFFER / BENCH_RECORD_SIZE;
+        std::vector<double> pauses;
+        for (uint64_t i = 0; i < events; ++i) {
+            auto start = Clock::now();
+            LOP::emit_immediate_event("bench_exhaustion");
+            double ns = elapsed_ns(start, Clock::now());
+            if (ns > BENCH_PAUSE_NS) pauses.push_back(ns);
+        }
+
+        // Preemptions look the same as pauses from here, median is less sensitive to them.
+        std::sort(pauses.begin(), pauses.end());
+        results.add("exhaustion", "pauses", 1, static_cast<double>(pauses.size()), "count");
+        results.add("exhaustion", "median_pause", 1, pauses.empty() ? 0.0 : pauses[pauses.size() / 2] / 1000.0, "us");
+        results.add("exhaustion", "max_pause", 1, pauses.empty() ? 0.0 : pauses.back() / 1000.0, "us");
+    }).join();
+}
+#endif
+
+int main(int argc, char** argv) {
+    const char* results_name = (argc > 1) ? argv[1] : "lop_bench.jsonl";
+    unsigned max_threads = (argc > 2) ? static_cast<unsigned>(atoi(argv[2])) : std::thread::hardware_concurrency();
+    max_threads = std::max(1U, max_threads);
+
+    Results results;
+    results.file = fopen(results_name, "a");
+    if (!results.file) {
+        printf("Couldn't open results file: %s\n", results_name);
+        return 1;
+    }
+    results.mode = build_mode();
+    results.environment = build_environment();
+
+    // Main thread holds the flushed events, and later the emitter benchmarks in the same pages.
+    LOP::profiler_set_thread_buffer_size((BENCH_FLUSH_EVENTS + 1024) * BENCH_RECORD_SIZE);
+    bench_flush(results);
+    bench_emitters(results);
+
+    LOP::profiler_enable();
+    LOP::profiler_set_buffer_size((BENCH_THREAD_EVENTS + 1024) * BENCH_RECORD_SIZE);
+    for (unsigned threads = 1; threads < max_threads; threads *= 2) bench_scaling(results, threads);
+    bench_scaling(results, max_threads);
+
+    LOP::profiler_set_buffer_size(0x100000);
+    bench_first_event(results);
+
+#if LOP_SAFER
+    bench_exhaustion(results);
+#endif
+    LOP::profiler_disable();
+    LOP::profiler_flush("bench");
+
+    fclose(results.file);
+    return 0;
+}
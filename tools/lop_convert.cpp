@@ -0,0 +1,587 @@
+/**
+ * Copyright (c) 2025 Krzysztof Badziak
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Offline converter for binary trace dumps produced with LOP_OUTPUT_FORMAT=binary, by streaming
+// mode (LOP_STREAMING) and by crash handler.
+// Output is the same Chrome JSON trace that the profiler would produce in-process.
+//
+// Usage: lop_convert <input.lopdump> [output.json]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "profiler_dump.h"
+
+using namespace LOP;
+
+// Must stay in sync with event_type from profiler.cpp.
+enum event_type : uint32_t {
+    CALL_BEGIN,
+    CALL_END,
+    CALL_BEGIN_META,
+    CALL_END_META,
+    COUNTER_INT,
+    FLOW_START,
+    FLOW_FINISH,
+    CALL_BEGIN_ARGS,
+    ARG_INT,
+    ARG_UINT,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+    CALL_BEGIN_SAMPLED,
+};
+
+static bool is_argument_record(uint32_t type) {
+    return type >= ARG_INT && type <= ARG_POINTER;
+}
+
+struct ThreadTable {
+    uint64_t thread_id;
+    std::vector<DumpEvent> events;
+};
+
+struct Dump {
+    DumpHeader header;
+    std::vector<char> data;
+    std::unordered_map<uint64_t, std::string> names;
+    std::unordered_map<uint64_t, std::string> categories;
+    std::vector<DumpClockSync> clock_syncs;
+    bool cpu_ids = false;
+    std::vector<int64_t> cpu_offsets;
+    std::vector<ThreadTable> threads;
+};
+
+static uint32_t tsc_aux_cpu(uint32_t tsc_aux) {
+    return tsc_aux & ((1U << DUMP_TSC_AUX_CPU_BITS) - 1);
+}
+
+static uint32_t tsc_aux_node(uint32_t tsc_aux) {
+    return tsc_aux >> DUMP_TSC_AUX_CPU_BITS;
+}
+
+// Same as in profiler.cpp, sync points closer than that are too noisy to interpolate between.
+#define MIN_CLOCK_SYNC_SPAN_NS 50000000LL
+
+// Converts ticks into nanoseconds since tsc_base the same way as the profiler does, interpolating
+// between sync points, or with the single frequency from header if there aren't enough of them.
+struct ClockMapping {
+    std::vector<DumpClockSync> points;
+    std::vector<double> ns_per_tick;
+    std::vector<int64_t> cpu_offsets;
+    int64_t time_base_ns = 0;
+
+    ClockMapping(const Dump& dump, uint64_t tsc_base) {
+        std::vector<DumpClockSync> sorted = dump.clock_syncs;
+        std::sort(sorted.begin(), sorted.end(), [](const DumpClockSync& a, const DumpClockSync& b) { return a.tsc < b.tsc; });
+        for (const DumpClockSync& sync : sorted) {
+            if (points.empty() || (sync.tsc > points.back().tsc && sync.time_ns - points.back().time_ns >= MIN_CLOCK_SYNC_SPAN_NS)) {
+                points.push_back(sync);
+            }
+        }
+        if (points.empty()) points.push_back({ tsc_base, 0 });
+
+        for (size_t i = 0; i + 1 < points.size(); ++i) {
+            ns_per_tick.push_back(static_cast<double>(points[i + 1].time_ns - points[i].time_ns) / static_cast<double>(points[i + 1].tsc - points[i].tsc));
+        }
+        ns_per_tick.push_back(ns_per_tick.empty() ? 1.0 / dump.header.ticks_per_ns_ratio : ns_per_tick.back());
+        time_base_ns = static_cast<int64_t>(time_ns(tsc_base));
+        cpu_offsets = dump.cpu_offsets;
+    }
+
+    uint64_t time_ns(uint64_t tsc, uint32_t cpu = 0) const {
+        if (cpu < cpu_offsets.size()) tsc -= cpu_offsets[cpu];
+        auto next = std::upper_bound(points.begin(), points.end(), tsc, [](uint64_t value, const DumpClockSync& sync) { return value < sync.tsc; });
+        size_t segment = (next == points.begin()) ? 0 : (next - points.begin()) - 1;
+        int64_t ticks = static_cast<int64_t>(tsc - points[segment].tsc);
+        int64_t time = points[segment].time_ns + static_cast<int64_t>(static_cast<double>(ticks) * ns_per_tick[segment]);
+        return static_cast<uint64_t>(std::max<int64_t>(time - time_base_ns, 0));
+    }
+};
+
+// Restores bits truncated by compact layout, using enable timestamp as a reference.
+static uint64_t expand_compact_timestamp(uint64_t truncated, uint64_t reference) {
+    const uint64_t range = 1ULL << (64 - DUMP_COMPACT_TYPE_BITS);
+    uint64_t timestamp = (reference & ~(range - 1)) | truncated;
+    if (timestamp > reference && timestamp - reference > range / 2) timestamp -= range;
+    else if (timestamp < reference && reference - timestamp > range / 2) timestamp += range;
+    return timestamp;
+}
+
+static void decode_compact_events(const DumpHeader& header, const char* records, uint64_t record_count, std::vector<DumpEvent>& events) {
+    std::vector<DumpCompactEvent> compact(record_count);
+    memcpy(compact.data(), records, record_count * sizeof(DumpCompactEvent));
+
+    for (uint64_t i = 0; i < record_count; ++i) {
+        DumpEvent event = {};
+        event.type = static_cast<uint32_t>(compact[i].timestamp_type & DUMP_EVENT_TYPE_MASK);
+        event.timestamp = expand_compact_timestamp(compact[i].timestamp_type >> DUMP_COMPACT_TYPE_BITS, header.tsc_enable);
+        event.name = compact[i].name;
+
+        if (event.type == FLOW_START || event.type == FLOW_FINISH) {
+            event.metadata = event.name;
+            event.name = 0;
+        }
+        else if ((event.type == CALL_BEGIN_META || event.type == CALL_END_META || event.type == COUNTER_INT ||
+                  event.type == CALL_BEGIN_ARGS || event.type == CALL_BEGIN_SAMPLED || is_argument_record(event.type)) && i + 1 < record_count) {
+            event.metadata = compact[++i].timestamp_type;
+        }
+        events.push_back(event);
+    }
+}
+
+static bool load_dump(const char* file_name, Dump& dump) {
+    FILE* file = fopen(file_name, "rb");
+    if (!file) {
+        printf("Couldn't open file: %s\n", file_name);
+        return false;
+    }
+
+    char chunk[1 << 16];
+    size_t read_bytes;
+    while ((read_bytes = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        dump.data.insert(dump.data.end(), chunk, chunk + read_bytes);
+    }
+    fclose(file);
+
+    if (dump.data.size() < sizeof(DumpHeader)) {
+        printf("File is too small to be a trace dump.\n");
+        return false;
+    }
+
+    memcpy(&dump.header, dump.data.data(), sizeof(DumpHeader));
+    if (memcmp(dump.header.magic, DUMP_MAGIC, sizeof(DUMP_MAGIC)) != 0 || dump.header.version == 0 || dump.header.version > DUMP_VERSION) {
+        printf("Not a trace dump or unsupported dump version.\n");
+        return false;
+    }
+    if (dump.header.event_size != sizeof(DumpEvent) && dump.header.event_size != sizeof(DumpCompactEvent)) {
+        printf("Unsupported event size: %" PRIu32 "\n", dump.header.event_size);
+        return false;
+    }
+
+    std::unordered_map<uint64_t, size_t> last_thread_tables;
+    size_t offset = sizeof(DumpHeader);
+    while (offset + sizeof(DumpRecord) <= dump.data.size()) {
+        DumpRecord record;
+        memcpy(&record, dump.data.data() + offset, sizeof(record));
+        offset += sizeof(record);
+
+        if (record.type == DUMP_RECORD_END) return true;
+
+        if (record.payload_size > dump.data.size() - offset) break;
+        const char* payload = dump.data.data() + offset;
+
+        if (record.type == DUMP_RECORD_STRING) {
+            uint64_t name_pointer;
+            memcpy(&name_pointer, payload, sizeof(name_pointer));
+            dump.names[name_pointer].assign(payload + sizeof(name_pointer), record.payload_size - sizeof(name_pointer));
+        }
+        else if (record.type == DUMP_RECORD_CATEGORY) {
+            uint64_t name_pointer;
+            memcpy(&name_pointer, payload, sizeof(name_pointer));
+            dump.categories[name_pointer].assign(payload + sizeof(name_pointer), record.payload_size - sizeof(name_pointer));
+        }
+        else if (record.type == DUMP_RECORD_CLOCK_SYNC) {
+            size_t sync_count = record.payload_size / sizeof(DumpClockSync);
+            size_t first_sync = dump.clock_syncs.size();
+            dump.clock_syncs.resize(first_sync + sync_count);
+            memcpy(dump.clock_syncs.data() + first_sync, payload, sync_count * sizeof(DumpClockSync));
+        }
+        else if (record.type == DUMP_RECORD_CPU_IDS) {
+            dump.cpu_ids = true;
+            dump.cpu_offsets.resize(record.payload_size / sizeof(int64_t));
+            memcpy(dump.cpu_offsets.data(), payload, dump.cpu_offsets.size() * sizeof(int64_t));
+        }
+        else if (record.type == DUMP_RECORD_THREAD) {
+            ThreadTable thread;
+            uint64_t record_count;
+            memcpy(&thread.thread_id, payload, sizeof(uint64_t));
+            memcpy(&record_count, payload + sizeof(uint64_t), sizeof(uint64_t));
+            const char* records = payload + 2 * sizeof(uint64_t);
+
+            if (dump.header.event_size == sizeof(DumpEvent)) {
+                thread.events.resize(record_count);
+                memcpy(thread.events.data(), records, record_count * sizeof(DumpEvent));
+                // Call flags matter only for overhead compensation, which is done before the dump.
+                for (DumpEvent& event : thread.events) event.type &= DUMP_EVENT_TYPE_MASK;
+            }
+            else {
+                decode_compact_events(dump.header, records, record_count, thread.events);
+            }
+
+            // Streamed dumps have many records per thread. Records are joined as long as they follow
+            // each other in time, otherwise it's another thread that got the same ID later on.
+            auto last_table = last_thread_tables.find(thread.thread_id);
+            if (last_table != last_thread_tables.end()) {
+                std::vector<DumpEvent>& events = dump.threads[last_table->second].events;
+                if (events.empty() || thread.events.empty() || events.back().timestamp <= thread.events.front().timestamp) {
+                    events.insert(events.end(), thread.events.begin(), thread.events.end());
+                    offset += record.payload_size;
+                    continue;
+                }
+            }
+            last_thread_tables[thread.thread_id] = dump.threads.size();
+            dump.threads.push_back(std::move(thread));
+        }
+
+        offset += record.payload_size;
+    }
+
+    printf("Trace dump is truncated, converting what is there.\n");
+    return true;
+}
+
+static const char* event_name(const Dump& dump, uint64_t name_pointer) {
+    auto name = dump.names.find(name_pointer);
+    return (name != dump.names.end()) ? name->second.c_str() : "<unknown>";
+}
+
+// Appends string contents with quotes, backslashes and control characters escaped.
+static void append_json_string(std::string& out, const char* string) {
+    for (; *string; ++string) {
+        unsigned char character = static_cast<unsigned char>(*string);
+        if (character == '"' || character == '\\') {
+            out += '\\';
+            out += static_cast<char>(character);
+        }
+        else if (character < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+            out += escaped;
+        }
+        else {
+            out += static_cast<char>(character);
+        }
+    }
+}
+
+// Returns event name ready to be put inside JSON string.
+static std::string json_event_name(const Dump& dump, uint64_t name_pointer) {
+    std::string out;
+    append_json_string(out, event_name(dump, name_pointer));
+    return out;
+}
+
+// Returns the rest of "cat" field to be put right after the event name, or nothing if event has no category.
+static std::string event_category(const Dump& dump, uint64_t name_pointer) {
+    auto category = dump.categories.find(name_pointer);
+    if (category == dump.categories.end()) return std::string();
+    std::string out = "\",\"cat\":\"";
+    append_json_string(out, category->second.c_str());
+    return out;
+}
+
+// Renders argument records following event with arguments as members of "args" object.
+// Returns number of argument records consumed, which are not always all of them if the
+// table was cut off in the middle.
+static size_t format_json_args(const Dump& dump, const std::vector<DumpEvent>& events, size_t index, std::string& out) {
+    size_t count = 0;
+    char value[64];
+    while (count < events[index].metadata && index + 1 + count < events.size() && is_argument_record(events[index + 1 + count].type)) {
+        const DumpEvent& arg = events[index + 1 + count];
+        if (arg.type == ARG_INT) {
+            snprintf(value, sizeof(value), "%" PRId64, static_cast<int64_t>(arg.metadata));
+        }
+        else if (arg.type == ARG_UINT) {
+            snprintf(value, sizeof(value), "%" PRIu64, arg.metadata);
+        }
+        else if (arg.type == ARG_DOUBLE) {
+            double number;
+            memcpy(&number, &arg.metadata, sizeof(number));
+            snprintf(value, sizeof(value), std::isfinite(number) ? "%.17g" : "\"%g\"", number);
+        }
+        else if (arg.type == ARG_POINTER) {
+            snprintf(value, sizeof(value), "\"0x%" PRIx64 "\"", arg.metadata);
+        }
+        else {
+            value[0] = '\0';
+        }
+
+        if (count) out += ',';
+        out += '"';
+        if (arg.name) append_json_string(out, event_name(dump, arg.name));
+        out += "\":";
+        if (arg.type == ARG_STRING && arg.metadata) {
+            out += '"';
+            append_json_string(out, event_name(dump, arg.metadata));
+            out += '"';
+        }
+        else {
+            out += value[0] ? value : "null";
+        }
+        ++count;
+    }
+    return count;
+}
+
+static bool write_json(const Dump& dump, const char* file_name) {
+    FILE* file = fopen(file_name, "w");
+    if (!file) {
+        printf("Couldn't create file: %s\n", file_name);
+        return false;
+    }
+
+    auto pid = static_cast<unsigned>(dump.header.pid);
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+    // Find first event, timewise.
+    uint64_t tsc_base = std::numeric_limits<uint64_t>::max();
+    for (const ThreadTable& thread : dump.threads) {
+        for (const DumpEvent& event : thread.events)
+            if (event.timestamp < tsc_base) tsc_base = event.timestamp;
+    }
+    ClockMapping clock(dump, tsc_base);
+
+    // Without CPU IDs the field is just padding.
+    auto event_tsc_aux = [&dump](const DumpEvent& event) { return dump.cpu_ids ? event.tsc_aux : 0; };
+
+    bool first_event = true;
+    std::map<uint64_t, const DumpEvent*> COUNTER_events;
+    for (const ThreadTable& thread : dump.threads) {
+        uint32_t last_tsc_aux = thread.events.empty() ? 0 : event_tsc_aux(thread.events.front());
+        for (size_t index = 0; index < thread.events.size(); ++index) {
+            const DumpEvent* event = &thread.events[index];
+            uint32_t tsc_aux = event_tsc_aux(*event);
+            auto time_ns = clock.time_ns(event->timestamp, tsc_aux_cpu(tsc_aux));
+
+            if (tsc_aux != last_tsc_aux) {
+                fprintf(file,
+                    "%c{"
+                    "\"tid\":\"%" PRIx64 "\","
+                    "\"pid\":%u,"
+                    "\"ts\":%" PRIu64 ".%03" PRIu64 ","
+                    "\"name\":\"migration\","
+                    "\"ph\":\"i\","
+                    "\"s\":\"t\","
+                    "\"args\":{"
+                    "\"from\":%u,\"to\":%u,\"from_node\":%u,\"to_node\":%u"
+                    "}"
+                    "}\n",
+                    first_event ? ' ' : ',', thread.thread_id, pid, time_ns / 1000, time_ns % 1000,
+                    tsc_aux_cpu(last_tsc_aux), tsc_aux_cpu(tsc_aux), tsc_aux_node(last_tsc_aux), tsc_aux_node(tsc_aux));
+                first_event = false;
+                last_tsc_aux = tsc_aux;
+            }
+
+            if (event->type == COUNTER_INT) {
+                // Chrome tracing requires counters to be sorted by timestamps.
+                COUNTER_events.insert({ event->timestamp, event });
+            }
+            else if (event->type == CALL_BEGIN || event->type == CALL_END) {
+                const char* eventPh = (event->type == CALL_BEGIN) ? "B" : "E";
+                fprintf(file,
+                    "%c{"
+                    "\"tid\":\"%" PRIx64 "\","
+                    "\"pid\":%u,"
+                    "\"ts\":%" PRIu64 ".%03" PRIu64 ","
+                    "\"name\":\"%s%s\","
+                    "\"ph\":\"%s\""
+                    "}\n",
+                    first_event ? ' ' : ',', thread.thread_id, pid, time_ns / 1000, time_ns % 1000, json_event_name(dump, event->name).c_str(),
+                    event_category(dump, event->name).c_str(), eventPh);
+            }
+            else if (event->type == CALL_BEGIN_META || event->type == CALL_END_META || event->type == CALL_BEGIN_SAMPLED) {
+                // Sampled scope begin carries its weight, shown as meta.
+                bool begin = (event->type != CALL_END_META);
+                const char* eventPh = begin ? "B" : "E";
+                const char* metaName = begin ? "b_meta" : "e_meta";
+                fprintf(file,
+                    "%c{"
+                    "\"tid\":\"%" PRIx64 "\","
+                    "\"pid\":%u,"
+                    "\"ts\":%" PRIu64 ".%03" PRIu64 ","
+                    "\"name\":\"%s%s\","
+                    "\"ph\":\"%s\","
+                    "\"args\":{"
+                    "\"%s\":\"%" PRIx64 "\""
+                    "}"
+                    "}\n",
+                    first_event ? ' ' : ',', thread.thread_id, pid, time_ns / 1000, time_ns % 1000, json_event_name(dump, event->name).c_str(),
+                    event_category(dump, event->name).c_str(), eventPh, metaName, event->metadata);
+            }
+            else if (event->type == CALL_BEGIN_ARGS) {
+                std::string args;
+                index += format_json_args(dump, thread.events, index, args);
+                fprintf(file,
+                    "%c{"
+                    "\"tid\":\"%" PRIx64 "\","
+                    "\"pid\":%u,"
+                    "\"ts\":%" PRIu64 ".%03" PRIu64 ","
+                    "\"name\":\"%s%s\","
+                    "\"ph\":\"B\","
+                    "\"args\":{%s}"
+                    "}\n",
+                    first_event ? ' ' : ',', thread.thread_id, pid, time_ns / 1000, time_ns % 1000, json_event_name(dump, event->name).c_str(),
+                    event_category(dump, event->name).c_str(), args.c_str());
+            }
+            else if (is_argument_record(event->type)) {
+                // Its event was cut off.
+                continue;
+            }
+            else if (event->type == FLOW_START || event->type == FLOW_FINISH) {
+                const char* eventPh = (event->type == FLOW_START) ? "s" : "f";
+                uint32_t truncated_flow_id = (uint32_t)event->metadata; // perfetto supports only 32bit flow IDs.
+                fprintf(file,
+                    "%c{"
+                    "\"tid\":\"%" PRIx64 "\","
+                    "\"pid\":%u,"
+                    "\"ts\":%" PRIu64 ".%03" PRIu64 ","
+                    "\"name\":\"flow\","
+                    "\"ph\":\"%s\","
+                    "\"bp\":\"e\","
+                    "\"id\":%" PRIu32 ","
+                    "\"args\":{"
+                    "\"flow_id\":\"%" PRIx64 "\""
+                    "}"
+                    "}\n",
+                    first_event ? ' ' : ',', thread.thread_id, pid, time_ns / 1000, time_ns % 1000, eventPh, truncated_flow_id, event->metadata);
+            }
+            else {
+                printf("Unknown event type. Bailing out.\n");
+                fclose(file);
+                return false;
+            }
+
+            first_event = false;
+        }
+    }
+
+    for (const auto& [timestamp, event] : COUNTER_events) {
+        auto time_ns = clock.time_ns(timestamp, tsc_aux_cpu(event_tsc_aux(*event)));
+        fprintf(file,
+            "%c{"
+            "\"pid\": %u,"
+            "\"ts\":%" PRIu64 ".%03" PRIu64 ","
+            "\"name\":\"%s%s\","
+            "\"ph\":\"C\","
+            "\"args\":{"
+            "\"val\":%" PRIu64 ""
+            "}"
+            "}\n",
+            first_event ? ' ' : ',', pid, time_ns / 1000, time_ns % 1000, json_event_name(dump, event->name).c_str(),
+            event_category(dump, event->name).c_str(), event->metadata);
+
+        first_event = false;
+    }
+
+    if (dump.cpu_ids) {
+        // Per-CPU tracks, same as the profiler writes them, see collect_cpu_residencies in profiler.cpp.
+        struct CpuResidency {
+            uint64_t begin;
+            uint64_t end;
+            uint64_t thread_id;
+            uint32_t tsc_aux;
+        };
+        struct CpuSample {
+            uint64_t timestamp;
+            uint64_t thread_index;
+            uint32_t tsc_aux;
+        };
+        std::vector<CpuSample> samples;
+        for (size_t thread_index = 0; thread_index < dump.threads.size(); ++thread_index) {
+            for (const DumpEvent& event : dump.threads[thread_index].events) samples.push_back({ event.timestamp, thread_index, event.tsc_aux });
+        }
+        std::sort(samples.begin(), samples.end(), [](const CpuSample& a, const CpuSample& b) {
+            if (tsc_aux_cpu(a.tsc_aux) != tsc_aux_cpu(b.tsc_aux)) return tsc_aux_cpu(a.tsc_aux) < tsc_aux_cpu(b.tsc_aux);
+            return a.timestamp < b.timestamp;
+        });
+
+        std::vector<CpuResidency> residencies;
+        uint64_t last_thread_index = 0;
+        for (const CpuSample& sample : samples) {
+            if (!residencies.empty() && last_thread_index == sample.thread_index && tsc_aux_cpu(residencies.back().tsc_aux) == tsc_aux_cpu(sample.tsc_aux)) {
+                residencies.back().end = sample.timestamp;
+            }
+            else {
+                residencies.push_back({ sample.timestamp, sample.timestamp, dump.threads[sample.thread_index].thread_id, sample.tsc_aux });
+                last_thread_index = sample.thread_index;
+            }
+        }
+
+        uint32_t last_cpu = std::numeric_limits<uint32_t>::max();
+        for (const CpuResidency& residency : residencies) {
+            uint32_t cpu = tsc_aux_cpu(residency.tsc_aux);
+            if (cpu != last_cpu) {
+                fprintf(file, "%c{\"pid\":%u,\"tid\":\"cpu %u\",\"name\":\"thread_name\",\"ph\":\"M\",\"args\":{\"name\":\"CPU %u\"}}\n",
+                    first_event ? ' ' : ',', pid, cpu, cpu);
+                first_event = false;
+                last_cpu = cpu;
+            }
+            uint64_t begin_ns = clock.time_ns(residency.begin, cpu);
+            uint64_t duration_ns = clock.time_ns(residency.end, cpu) - begin_ns;
+            fprintf(file,
+                "%c{"
+                "\"pid\":%u,"
+                "\"tid\":\"cpu %u\","
+                "\"ts\":%" PRIu64 ".%03" PRIu64 ","
+                "\"dur\":%" PRIu64 ".%03" PRIu64 ","
+                "\"name\":\"%" PRIx64 "\","
+                "\"ph\":\"X\","
+                "\"args\":{\"node\":%u}"
+                "}\n",
+                first_event ? ' ' : ',', pid, cpu, begin_ns / 1000, begin_ns % 1000, duration_ns / 1000, duration_ns % 1000,
+                residency.thread_id, tsc_aux_node(residency.tsc_aux));
+            first_event = false;
+        }
+    }
+
+    fprintf(file, "]}");
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        printf("Usage: lop_convert <input.lopdump> [output.json]\n");
+        return 1;
+    }
+
+    std::string output_name;
+    if (argc == 3) {
+        output_name = argv[2];
+    }
+    else {
+        output_name = argv[1];
+        auto dot = output_name.rfind(".lopdump");
+        if (dot != std::string::npos) output_name.erase(dot);
+        output_name += ".json";
+    }
+
+    Dump dump;
+    if (!load_dump(argv[1], dump)) return 1;
+
+    uint64_t events_counter = 0;
+    for (const ThreadTable& thread : dump.threads) events_counter += thread.events.size();
+    printf("Loaded %zu threads, %zu names, %" PRIu64 " events.\n", dump.threads.size(), dump.names.size(), events_counter);
+
+    printf("Creating file: %s\n", output_name.c_str());
+    return write_json(dump, output_name.c_str()) ? 0 : 1;
+}